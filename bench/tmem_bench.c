@@ -0,0 +1,1120 @@
+/*
+ * Multithreaded load generator for /dev/tmem_dev.
+ *
+ * Every thread opens its own file, so that it has its own device state,
+ * ring and staging area, and runs a stream of operations against it until
+ * the time or operation budget runs out. Latencies are kept per thread in
+ * log-linear histograms and merged once the threads are done. With -S
+ * the slab caches are read before and after the timed part of every run,
+ * to tell how much the backend allocates per operation and keeps around.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "tmem_dev.h"
+
+#define TMEM_BENCH_DEV "/dev/tmem_dev"
+
+#define MAX_THREADS (1024)
+#define MAX_DEPTH (TMEM_BATCH_MAX)
+
+enum op_type { OP_GET, OP_PUT, OP_INVAL, OP_CALL, NR_OPS };
+
+static const char * const op_names[NR_OPS] = { "get", "put", "inval", "call" };
+
+enum mode { MODE_SINGLE, MODE_BATCH, MODE_RING, MODE_STAGED };
+
+static const char * const mode_names[] = { "single", "batch", "ring", "staged" };
+
+enum dist { DIST_UNIFORM, DIST_ZIPF, DIST_SEQ };
+
+static const char * const dist_names[] = { "uniform", "zipf", "seq" };
+
+enum workload { WORKLOAD_MIX, WORKLOAD_SWAP };
+
+static const char * const workload_names[] = { "mix", "swap" };
+
+/* What the device is told to skip, see TMEM_CONTROL */
+#define CTRL_DUMMY	(1 << 0)
+#define CTRL_SILENT	(1 << 1)
+#define CTRL_GENERATE	(1 << 2)
+#define CTRL_SLEEPY	(1 << 3)
+
+static const char * const ctrl_names[] = { "dummy", "silent", "generate", "sleepy" };
+
+static struct {
+	enum mode mode;
+	enum dist dist;
+	enum workload workload;
+	unsigned int threads[64];
+	unsigned int nr_threads;
+	unsigned int get_pct, put_pct;
+	uint64_t keys;
+	size_t value_size;
+	unsigned int depth;
+	double theta;
+	unsigned int duration;
+	uint64_t ops;
+	unsigned int ctrl;
+	bool breakdown;
+	bool slab;
+	bool prefill;
+	bool pin;
+	const char *dev;
+} cfg = {
+	.mode = MODE_SINGLE,
+	.dist = DIST_UNIFORM,
+	.workload = WORKLOAD_MIX,
+	.threads = { 1 },
+	.nr_threads = 1,
+	.get_pct = 70,
+	.put_pct = 25,
+	.keys = 16384,
+	.value_size = 4096,
+	.depth = 32,
+	.theta = 0.99,
+	.duration = 5,
+	.prefill = true,
+	.dev = TMEM_BENCH_DEV,
+};
+
+/*
+ * Latency histogram: values under HIST_SUB nanoseconds get a bucket each,
+ * and every power of two above that is split in HIST_SUB buckets, so the
+ * error of any percentile stays under 1/HIST_SUB
+ */
+#define HIST_SUB_BITS (4)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+
+	msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t) (HIST_SUB + bucket % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static void hist_add(struct hist *hist, uint64_t ns)
+{
+	hist->buckets[hist_bucket(ns)]++;
+	hist->count++;
+	hist->sum += ns;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->count += from->count;
+	to->sum += from->sum;
+}
+
+static uint64_t hist_percentile(const struct hist *hist, double pct)
+{
+	uint64_t rank = ceil(hist->count * pct / 100.0), seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank && seen)
+			return hist_value(i);
+	}
+
+	return 0;
+}
+
+/* One operation in flight, along with the memory its request points to */
+struct op {
+	enum op_type type;
+	uint64_t key;
+	size_t value_len;
+	void *value;
+};
+
+struct thread {
+	pthread_t pthread;
+	unsigned int id;
+	unsigned int nr_threads;
+	int fd;
+	uint64_t rand;
+	uint64_t seq;
+	uint64_t swap_step;
+	/* Transport state */
+	struct op *ops;
+	struct tmem_batch_op *batch_ops;
+	__s32 *results;
+	void *ring;
+	size_t ring_size;
+	struct tmem_ring_params ring_params;
+	void *staging;
+	size_t staging_size;
+	/* Results */
+	uint64_t done;
+	uint64_t errors;
+	uint64_t misses;
+	uint64_t corrupt;
+	bool failed;
+	struct hist hists[NR_OPS];
+};
+
+/* Threads are set up and prefilled once they pass the first, and timed from the second */
+static pthread_barrier_t ready_barrier, start_barrier;
+static volatile bool stop;
+
+/* Zipfian key ranks, after Gray et al., "Quickly generating billion-record synthetic databases" */
+static double zipf_zetan, zipf_alpha, zipf_eta;
+
+static void zipf_setup(uint64_t n, double theta)
+{
+	double zeta2 = 1.0 + pow(0.5, theta);
+	uint64_t i;
+
+	zipf_zetan = 0;
+	for (i = 1; i <= n; i++)
+		zipf_zetan += 1.0 / pow(i, theta);
+
+	zipf_alpha = 1.0 / (1.0 - theta);
+	zipf_eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+static uint64_t xorshift(struct thread *thread)
+{
+	uint64_t x = thread->rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	thread->rand = x;
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double uniform(struct thread *thread)
+{
+	return (xorshift(thread) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static uint64_t next_key(struct thread *thread)
+{
+	double u, uz;
+	uint64_t rank;
+
+	switch (cfg.dist) {
+	case DIST_ZIPF:
+		u = uniform(thread);
+		uz = u * zipf_zetan;
+		if (uz < 1.0)
+			rank = 0;
+		else if (uz < 1.0 + pow(0.5, cfg.theta))
+			rank = 1;
+		else
+			rank = cfg.keys * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha);
+
+		/* Scatter the hot ranks over the keyspace, as YCSB does */
+		return (rank % cfg.keys) * 0x9E3779B97F4A7C15ULL % cfg.keys;
+
+	case DIST_SEQ:
+		/* Every thread walks its own stretch of the keyspace */
+		return (thread->seq++ + cfg.keys / thread->nr_threads * thread->id) % cfg.keys;
+
+	case DIST_UNIFORM:
+	default:
+		return xorshift(thread) % cfg.keys;
+	}
+}
+
+/*
+ * Swap is what frontswap does to a page: it goes out, comes back in and
+ * is dropped. Every thread swaps a window of its own keys at a time
+ */
+static void next_swap_op(struct thread *thread, struct op *op)
+{
+	uint64_t window = cfg.depth, keys = cfg.keys / thread->nr_threads;
+	uint64_t step = thread->swap_step++;
+	uint64_t round = step / (3 * window), pos = step % (3 * window);
+
+	op->type = pos < window ? OP_PUT : pos < 2 * window ? OP_GET : OP_INVAL;
+	op->key = cfg.keys / thread->nr_threads * thread->id +
+		(round * window + pos % window) % keys;
+}
+
+static void next_op(struct thread *thread, struct op *op)
+{
+	unsigned int pct;
+
+	if (cfg.workload == WORKLOAD_SWAP) {
+		next_swap_op(thread, op);
+		return;
+	}
+
+	pct = xorshift(thread) % 100;
+	op->type = pct < cfg.get_pct ? OP_GET : pct < cfg.get_pct + cfg.put_pct ? OP_PUT : OP_INVAL;
+	op->key = next_key(thread);
+}
+
+/* Values carry their key up front, which is all a get needs to check */
+static void prepare_op(struct op *op)
+{
+	if (op->type == OP_PUT) {
+		memcpy(op->value, &op->key, sizeof(op->key));
+		op->value_len = cfg.value_size;
+	} else {
+		op->value_len = 0;
+	}
+}
+
+static void complete_op(struct thread *thread, struct op *op, int res)
+{
+	uint64_t key;
+
+	thread->done++;
+
+	if (res < 0) {
+		thread->errors++;
+		return;
+	}
+
+	if (op->type != OP_GET)
+		return;
+
+	if (!op->value_len) {
+		thread->misses++;
+		return;
+	}
+
+	/* Only real stores give back what was put */
+	if (cfg.ctrl)
+		return;
+
+	memcpy(&key, op->value, sizeof(key));
+	if (op->value_len != cfg.value_size || key != op->key)
+		thread->corrupt++;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_request(struct tmem_request *request, struct op *op,
+		void *key, void *value, size_t *value_lenp)
+{
+	memset(request, 0, sizeof(*request));
+
+	switch (op->type) {
+	case OP_GET:
+		request->get.key = key;
+		request->get.key_len = sizeof(op->key);
+		request->get.value = value;
+		request->get.value_lenp = value_lenp;
+		break;
+	case OP_PUT:
+		request->put.key = key;
+		request->put.key_len = sizeof(op->key);
+		request->put.value = value;
+		request->put.value_len = op->value_len;
+		break;
+	default:
+		request->inval.key = key;
+		request->inval.key_len = sizeof(op->key);
+		break;
+	}
+}
+
+static unsigned long op_cmd(enum op_type type)
+{
+	return type == OP_GET ? TMEM_GET : type == OP_PUT ? TMEM_PUT : TMEM_INVAL;
+}
+
+static unsigned long op_staged_cmd(enum op_type type)
+{
+	return type == OP_GET ? TMEM_STAGED_GET : type == OP_PUT ? TMEM_STAGED_PUT : TMEM_STAGED_INVAL;
+}
+
+static void run_single(struct thread *thread)
+{
+	struct op *op = &thread->ops[0];
+	struct tmem_request request;
+	uint64_t start;
+	int res;
+
+	next_op(thread, op);
+	prepare_op(op);
+	fill_request(&request, op, &op->key, op->value, &op->value_len);
+
+	start = now_ns();
+	res = ioctl(thread->fd, op_cmd(op->type), &request);
+	hist_add(&thread->hists[op->type], now_ns() - start);
+
+	complete_op(thread, op, res < 0 ? -errno : res);
+}
+
+/*
+ * Staging slots hold the key, the value length and room for the largest
+ * value, in that order; requests carry offsets into the area
+ */
+#define STAGED_SLOT (TMEM_MAX + 2 * sizeof(uint64_t))
+
+static void run_staged(struct thread *thread)
+{
+	struct op *op = &thread->ops[0];
+	struct tmem_request request;
+	void *slot = thread->staging;
+	uint64_t start;
+	int res;
+
+	next_op(thread, op);
+	prepare_op(op);
+
+	memcpy(slot, &op->key, sizeof(op->key));
+	if (op->type == OP_PUT)
+		memcpy(slot + 2 * sizeof(uint64_t), op->value, sizeof(op->key));
+
+	fill_request(&request, op, (void *) 0, (void *) (uintptr_t) (2 * sizeof(uint64_t)),
+			(size_t *) (uintptr_t) sizeof(uint64_t));
+
+	start = now_ns();
+	res = ioctl(thread->fd, op_staged_cmd(op->type), &request);
+	hist_add(&thread->hists[op->type], now_ns() - start);
+
+	if (op->type == OP_GET) {
+		memcpy(&op->value_len, slot + sizeof(uint64_t), sizeof(op->value_len));
+		memcpy(op->value, slot + 2 * sizeof(uint64_t), sizeof(op->key));
+	}
+
+	complete_op(thread, op, res < 0 ? -errno : res);
+}
+
+static void run_batch(struct thread *thread)
+{
+	struct tmem_batch batch;
+	unsigned int i;
+	uint64_t start;
+	int res;
+
+	for (i = 0; i < cfg.depth; i++) {
+		next_op(thread, &thread->ops[i]);
+		prepare_op(&thread->ops[i]);
+
+		thread->batch_ops[i].cmd = op_cmd(thread->ops[i].type);
+		fill_request(&thread->batch_ops[i].request, &thread->ops[i],
+				&thread->ops[i].key, thread->ops[i].value, &thread->ops[i].value_len);
+	}
+
+	batch.nr_ops = cfg.depth;
+	batch.ops = (uintptr_t) thread->batch_ops;
+	batch.results = (uintptr_t) thread->results;
+
+	start = now_ns();
+	res = ioctl(thread->fd, TMEM_BATCH, &batch);
+	hist_add(&thread->hists[OP_CALL], now_ns() - start);
+
+	for (i = 0; i < cfg.depth; i++)
+		complete_op(thread, &thread->ops[i], res < 0 ? -errno : thread->results[i]);
+}
+
+static void run_ring(struct thread *thread)
+{
+	struct tmem_ring_params *params = &thread->ring_params;
+	struct tmem_ring_header *sq = thread->ring + params->sq_off;
+	struct tmem_ring_header *cq = thread->ring + params->cq_off;
+	struct tmem_ring_sqe *sqes = thread->ring + params->sqes_off;
+	struct tmem_ring_cqe *cqes = thread->ring + params->cqes_off;
+	struct tmem_ring_enter enter = { .to_submit = cfg.depth };
+	struct tmem_ring_sqe *sqe;
+	struct tmem_ring_cqe *cqe;
+	uint32_t tail, head;
+	unsigned int i, reaped = 0;
+	uint64_t start;
+	int res;
+
+	tail = sq->tail;
+	for (i = 0; i < cfg.depth; i++, tail++) {
+		next_op(thread, &thread->ops[i]);
+		prepare_op(&thread->ops[i]);
+
+		sqe = &sqes[tail & (params->sq_entries - 1)];
+		sqe->cmd = op_cmd(thread->ops[i].type);
+		sqe->user_data = i;
+		fill_request(&sqe->request, &thread->ops[i],
+				&thread->ops[i].key, thread->ops[i].value, &thread->ops[i].value_len);
+	}
+	__atomic_store_n(&sq->tail, tail, __ATOMIC_RELEASE);
+
+	/* The ring is twice as deep as a round, so every round fits at once */
+	start = now_ns();
+	res = ioctl(thread->fd, TMEM_ENTER, &enter);
+	hist_add(&thread->hists[OP_CALL], now_ns() - start);
+
+	if (res < 0) {
+		/* Nothing was consumed, take the submissions back */
+		__atomic_store_n(&sq->tail, tail - cfg.depth, __ATOMIC_RELEASE);
+		for (i = 0; i < cfg.depth; i++)
+			complete_op(thread, &thread->ops[i], -errno);
+		return;
+	}
+
+	head = cq->head;
+	tail = __atomic_load_n(&cq->tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, reaped++) {
+		cqe = &cqes[head & (params->cq_entries - 1)];
+		complete_op(thread, &thread->ops[cqe->user_data], cqe->res);
+	}
+	__atomic_store_n(&cq->head, head, __ATOMIC_RELEASE);
+
+	/* Leftover submissions would point at reused operations, give up */
+	if (reaped != cfg.depth) {
+		thread->errors += cfg.depth - reaped;
+		stop = true;
+	}
+}
+
+static int control(int fd, unsigned int ctrl)
+{
+	long flags = 0;
+	size_t size = cfg.value_size;
+
+	flags |= ctrl & CTRL_DUMMY ? TCTRL_DUMMY : TCTRL_REAL;
+	flags |= ctrl & CTRL_SILENT ? TCTRL_SILENT : TCTRL_ANSWER;
+	flags |= ctrl & CTRL_GENERATE ? TCTRL_GENERATE : TCTRL_INPUT;
+	flags |= ctrl & CTRL_SLEEPY ? TCTRL_SLEEPY : TCTRL_AWAKE;
+
+	if (ioctl(fd, TMEM_CONTROL, &flags) < 0 || ioctl(fd, TMEM_GENERATE_SIZE, &size) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Puts the thread's share of the keys, so that gets have something to find */
+static int prefill(struct thread *thread)
+{
+	struct op *op = &thread->ops[0];
+	struct tmem_request request;
+	uint64_t key;
+
+	op->type = OP_PUT;
+	for (key = thread->id; key < cfg.keys; key += thread->nr_threads) {
+		op->key = key;
+		prepare_op(op);
+		fill_request(&request, op, &op->key, op->value, &op->value_len);
+
+		if (ioctl(thread->fd, TMEM_PUT, &request) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int thread_setup(struct thread *thread)
+{
+	unsigned int i, nr_ops = cfg.mode == MODE_BATCH || cfg.mode == MODE_RING ? cfg.depth : 1;
+	uint64_t size;
+
+	thread->fd = open(cfg.dev, O_RDWR);
+	if (thread->fd < 0)
+		return -errno;
+
+	thread->ops = calloc(nr_ops, sizeof(*thread->ops));
+	if (!thread->ops)
+		return -ENOMEM;
+
+	/* Gets need room for anything that might have been put */
+	for (i = 0; i < nr_ops; i++) {
+		thread->ops[i].value = calloc(1, TMEM_MAX);
+		if (!thread->ops[i].value)
+			return -ENOMEM;
+	}
+
+	switch (cfg.mode) {
+	case MODE_BATCH:
+		thread->batch_ops = calloc(cfg.depth, sizeof(*thread->batch_ops));
+		thread->results = calloc(cfg.depth, sizeof(*thread->results));
+		if (!thread->batch_ops || !thread->results)
+			return -ENOMEM;
+		break;
+
+	case MODE_RING:
+		thread->ring_params.sq_entries = cfg.depth;
+		thread->ring_params.eventfd = -1;
+		if (ioctl(thread->fd, TMEM_RING_SETUP, &thread->ring_params) < 0)
+			return -errno;
+
+		thread->ring_size = thread->ring_params.size;
+		thread->ring = mmap(NULL, thread->ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, thread->fd, 0);
+		if (thread->ring == MAP_FAILED) {
+			thread->ring = NULL;
+			return -errno;
+		}
+		break;
+
+	case MODE_STAGED:
+		size = STAGED_SLOT;
+		if (ioctl(thread->fd, TMEM_STAGING_SETUP, &size) < 0)
+			return -errno;
+
+		thread->staging_size = (STAGED_SLOT + getpagesize() - 1) & ~((size_t) getpagesize() - 1);
+		thread->staging = mmap(NULL, thread->staging_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, thread->fd, TMEM_STAGING_OFF);
+		if (thread->staging == MAP_FAILED) {
+			thread->staging = NULL;
+			return -errno;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void thread_cleanup(struct thread *thread)
+{
+	unsigned int i, nr_ops = cfg.mode == MODE_BATCH || cfg.mode == MODE_RING ? cfg.depth : 1;
+
+	if (thread->ring)
+		munmap(thread->ring, thread->ring_size);
+	if (thread->staging)
+		munmap(thread->staging, thread->staging_size);
+	if (thread->fd >= 0)
+		close(thread->fd);
+
+	for (i = 0; thread->ops && i < nr_ops; i++)
+		free(thread->ops[i].value);
+
+	free(thread->ops);
+	free(thread->batch_ops);
+	free(thread->results);
+}
+
+static void *thread_fn(void *arg)
+{
+	struct thread *thread = arg;
+	cpu_set_t cpus;
+	int ret;
+
+	if (cfg.pin) {
+		CPU_ZERO(&cpus);
+		CPU_SET(thread->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	ret = thread_setup(thread);
+	if (!ret && cfg.prefill && cfg.workload == WORKLOAD_MIX)
+		ret = prefill(thread);
+	/* Control bits only go on once the store holds the keys */
+	if (!ret)
+		ret = control(thread->fd, cfg.ctrl);
+
+	if (ret) {
+		fprintf(stderr, "thread %u: setup failed: %s\n", thread->id, strerror(-ret));
+		thread->failed = true;
+		stop = true;
+	}
+
+	pthread_barrier_wait(&ready_barrier);
+	pthread_barrier_wait(&start_barrier);
+
+	while (!ret && !stop && (!cfg.ops || thread->done < cfg.ops)) {
+		switch (cfg.mode) {
+		case MODE_BATCH:
+			run_batch(thread);
+			break;
+		case MODE_RING:
+			run_ring(thread);
+			break;
+		case MODE_STAGED:
+			run_staged(thread);
+			break;
+		default:
+			run_single(thread);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * What every slab cache holds, and how often it was allocated from and freed
+ * to; the counts need CONFIG_SLUB_STATS. Merged caches show up under every
+ * name they have with the same numbers, so boot with slab_nomerge to tell
+ * them apart
+ */
+#define SLAB_DIR "/sys/kernel/slab"
+#define MAX_SLABS (2048)
+
+struct slab_stat {
+	char name[NAME_MAX + 1];
+	uint64_t objects;
+	uint64_t size;
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+struct slab_snap {
+	unsigned int nr;
+	bool counts;
+	struct slab_stat stats[MAX_SLABS];
+};
+
+static struct slab_snap slab_before, slab_after;
+
+/* The files start with the total, followed by the per node or per CPU ones */
+static int slab_read(const char *name, const char *file, uint64_t *val)
+{
+	char path[PATH_MAX];
+	unsigned long long v;
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), SLAB_DIR "/%s/%s", name, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	ret = fscanf(f, "%llu", &v) == 1 ? 0 : -EINVAL;
+	fclose(f);
+	if (!ret)
+		*val = v;
+
+	return ret;
+}
+
+static int slab_snapshot(struct slab_snap *snap)
+{
+	struct slab_stat *stat;
+	struct dirent *dirent;
+	uint64_t fast, slow;
+	DIR *dir;
+
+	dir = opendir(SLAB_DIR);
+	if (!dir)
+		return -errno;
+
+	snap->nr = 0;
+	snap->counts = true;
+	while ((dirent = readdir(dir)) && snap->nr < MAX_SLABS) {
+		/* Dots, and the merged caches every name of theirs links to */
+		if (dirent->d_name[0] == '.' || dirent->d_name[0] == ':')
+			continue;
+
+		stat = &snap->stats[snap->nr];
+		snprintf(stat->name, sizeof(stat->name), "%s", dirent->d_name);
+		if (slab_read(stat->name, "objects", &stat->objects) ||
+		    slab_read(stat->name, "slab_size", &stat->size))
+			continue;
+
+		if (!slab_read(stat->name, "alloc_fastpath", &fast) &&
+		    !slab_read(stat->name, "alloc_slowpath", &slow))
+			stat->allocs = fast + slow;
+		else
+			snap->counts = false;
+
+		if (!slab_read(stat->name, "free_fastpath", &fast) &&
+		    !slab_read(stat->name, "free_slowpath", &slow))
+			stat->frees = fast + slow;
+		else
+			snap->counts = false;
+
+		snap->nr++;
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+/* Every cache that was used during the run, per operation, and what it holds more or less than before */
+static void slab_report(const struct slab_snap *before, const struct slab_snap *after,
+		uint64_t done)
+{
+	const struct slab_stat *from, *to;
+	int64_t objects, total = 0;
+	uint64_t allocs, frees;
+	char per_op[2][16];
+	unsigned int i, j;
+
+	printf("  %-24s %12s %12s %12s %14s\n", "slab", "allocs/op", "frees/op",
+		"objects", "bytes");
+
+	for (i = 0; i < after->nr; i++) {
+		to = &after->stats[i];
+		for (j = 0, from = NULL; j < before->nr && !from; j++) {
+			if (!strcmp(before->stats[j].name, to->name))
+				from = &before->stats[j];
+		}
+		if (!from)
+			continue;
+
+		allocs = after->counts ? to->allocs - from->allocs : 0;
+		frees = after->counts ? to->frees - from->frees : 0;
+		objects = (int64_t) to->objects - (int64_t) from->objects;
+		if (!allocs && !frees && !objects)
+			continue;
+
+		snprintf(per_op[0], sizeof(per_op[0]), "%.2f", done ? (double) allocs / done : 0);
+		snprintf(per_op[1], sizeof(per_op[1]), "%.2f", done ? (double) frees / done : 0);
+
+		total += objects * (int64_t) to->size;
+		printf("  %-24s %12s %12s %+12lld %+14lld\n", to->name,
+			after->counts ? per_op[0] : "n/a", after->counts ? per_op[1] : "n/a",
+			(long long) objects, (long long) (objects * (int64_t) to->size));
+	}
+
+	printf("  %-24s %12s %12s %12s %+14lld\n", "total", "", "", "", (long long) total);
+}
+
+static void print_header(void)
+{
+	printf("%-8s %-7s %-6s %-14s %12s %12s %10s %10s %10s %10s %10s\n",
+		"threads", "mode", "op", "ctrl", "ops", "ops/s",
+		"mean(ns)", "p50(ns)", "p99(ns)", "p999(ns)", "misses");
+}
+
+static void ctrl_string(unsigned int ctrl, char *buf, size_t len)
+{
+	unsigned int i;
+
+	snprintf(buf, len, "%s", ctrl ? "" : "real");
+	for (i = 0; i < sizeof(ctrl_names) / sizeof(ctrl_names[0]); i++) {
+		if (ctrl & (1 << i))
+			snprintf(buf + strlen(buf), len - strlen(buf), "%s%s",
+				buf[0] ? "," : "", ctrl_names[i]);
+	}
+}
+
+static int run(unsigned int nr_threads)
+{
+	struct thread *threads;
+	struct hist *hists;
+	uint64_t start, elapsed, done = 0, errors = 0, misses = 0, corrupt = 0;
+	char ctrl[64];
+	unsigned int i, op;
+	int ret = 0;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	hists = calloc(NR_OPS, sizeof(*hists));
+	if (!threads || !hists) {
+		free(threads);
+		free(hists);
+		return -ENOMEM;
+	}
+
+	stop = false;
+	pthread_barrier_init(&ready_barrier, NULL, nr_threads + 1);
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].id = i;
+		threads[i].nr_threads = nr_threads;
+		threads[i].fd = -1;
+		threads[i].rand = 0x9E3779B97F4A7C15ULL * (i + 1);
+
+		if (pthread_create(&threads[i].pthread, NULL, thread_fn, &threads[i])) {
+			fprintf(stderr, "could not start thread %u\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&ready_barrier);
+	if (cfg.slab) {
+		ret = slab_snapshot(&slab_before);
+		if (ret) {
+			fprintf(stderr, "could not read %s: %s\n", SLAB_DIR, strerror(-ret));
+			cfg.slab = false;
+			ret = 0;
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+
+	if (!cfg.ops) {
+		sleep(cfg.duration);
+		stop = true;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].pthread, NULL);
+
+	elapsed = now_ns() - start;
+
+	/* Before the files are closed, which may free what the device kept for them */
+	if (cfg.slab && slab_snapshot(&slab_after) < 0)
+		cfg.slab = false;
+
+	for (i = 0; i < nr_threads; i++) {
+		for (op = 0; op < NR_OPS; op++)
+			hist_merge(&hists[op], &threads[i].hists[op]);
+
+		done += threads[i].done;
+		errors += threads[i].errors;
+		misses += threads[i].misses;
+		corrupt += threads[i].corrupt;
+		if (threads[i].failed)
+			ret = -EIO;
+		thread_cleanup(&threads[i]);
+	}
+
+	ctrl_string(cfg.ctrl, ctrl, sizeof(ctrl));
+
+	printf("%-8u %-7s %-6s %-14s %12llu %12.0f\n", nr_threads, mode_names[cfg.mode],
+		"all", ctrl, (unsigned long long) done, done * 1e9 / elapsed);
+
+	for (op = 0; op < NR_OPS; op++) {
+		if (!hists[op].count)
+			continue;
+
+		printf("%-8u %-7s %-6s %-14s %12llu %12.0f %10llu %10llu %10llu %10llu %10llu\n",
+			nr_threads, mode_names[cfg.mode], op_names[op], ctrl,
+			(unsigned long long) hists[op].count, hists[op].count * 1e9 / elapsed,
+			(unsigned long long) (hists[op].sum / hists[op].count),
+			(unsigned long long) hist_percentile(&hists[op], 50),
+			(unsigned long long) hist_percentile(&hists[op], 99),
+			(unsigned long long) hist_percentile(&hists[op], 99.9),
+			(unsigned long long) (op == OP_GET ? misses : 0));
+	}
+
+	if (cfg.slab)
+		slab_report(&slab_before, &slab_after, done);
+
+	if (errors || corrupt) {
+		fprintf(stderr, "%llu operations failed, %llu gets returned the wrong value\n",
+			(unsigned long long) errors, (unsigned long long) corrupt);
+		ret = -EIO;
+	}
+
+	pthread_barrier_destroy(&ready_barrier);
+	pthread_barrier_destroy(&start_barrier);
+	free(hists);
+	free(threads);
+
+	return ret;
+}
+
+static int parse_name(const char *arg, const char * const *names, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!strcmp(arg, names[i]))
+			return i;
+	}
+
+	fprintf(stderr, "unknown value %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned int parse_ctrl(char *arg)
+{
+	unsigned int ctrl = 0;
+	char *name;
+
+	for (name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+		if (strcmp(name, "real"))
+			ctrl |= 1 << parse_name(name, ctrl_names, 4);
+	}
+
+	return ctrl;
+}
+
+static void parse_threads(char *arg)
+{
+	char *count;
+
+	cfg.nr_threads = 0;
+	for (count = strtok(arg, ","); count; count = strtok(NULL, ",")) {
+		if (cfg.nr_threads == sizeof(cfg.threads) / sizeof(cfg.threads[0]))
+			break;
+
+		cfg.threads[cfg.nr_threads] = strtoul(count, NULL, 0);
+		if (!cfg.threads[cfg.nr_threads] || cfg.threads[cfg.nr_threads] > MAX_THREADS) {
+			fprintf(stderr, "thread counts go from 1 to %u\n", MAX_THREADS);
+			exit(EXIT_FAILURE);
+		}
+		cfg.nr_threads++;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -t N[,N...]     threads, one run per count (1)\n"
+		"  -m MODE         single, batch, ring or staged (single)\n"
+		"  -b N            operations per batch or ring round (32)\n"
+		"  -w WORKLOAD     mix, or swap: put, get and drop windows of keys (mix)\n"
+		"  -r GET:PUT      percentage of gets and puts in mix, the rest invalidates (70:25)\n"
+		"  -k N            number of keys (16384)\n"
+		"  -s N            value size in bytes (4096)\n"
+		"  -D DIST         key distribution: uniform, zipf or seq (uniform)\n"
+		"  -z THETA        zipf skew, below 1 (0.99)\n"
+		"  -d SECONDS      duration of every run (5)\n"
+		"  -n N            operations per thread, instead of a duration\n"
+		"  -c BITS         control bits: real, or any of dummy,silent,generate,sleepy\n"
+		"  -x              break the cost down: syscall, then copies, then the backend\n"
+		"  -S              report slab allocations per operation and the memory left behind\n"
+		"  -F              do not put every key before a mix run\n"
+		"  -a              pin threads to CPUs\n"
+		"  -f PATH         device (%s)\n",
+		prog, TMEM_BENCH_DEV);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	/*
+	 * Dummy skips the backend, generate skips copying values in and out;
+	 * a get in dummy mode already returns nothing
+	 */
+	static const unsigned int breakdown[] = { CTRL_DUMMY | CTRL_GENERATE, CTRL_DUMMY, 0 };
+	unsigned int i, j;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:m:b:w:r:k:s:D:z:d:n:c:xSFaf:h")) != -1) {
+		switch (opt) {
+		case 't':
+			parse_threads(optarg);
+			break;
+		case 'm':
+			cfg.mode = parse_name(optarg, mode_names, 4);
+			break;
+		case 'b':
+			cfg.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.workload = parse_name(optarg, workload_names, 2);
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u:%u", &cfg.get_pct, &cfg.put_pct) != 2 ||
+			    cfg.get_pct + cfg.put_pct > 100)
+				usage(argv[0]);
+			break;
+		case 'k':
+			cfg.keys = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.value_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			cfg.dist = parse_name(optarg, dist_names, 3);
+			break;
+		case 'z':
+			cfg.theta = strtod(optarg, NULL);
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.ops = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.ctrl = parse_ctrl(optarg);
+			break;
+		case 'x':
+			cfg.breakdown = true;
+			break;
+		case 'S':
+			cfg.slab = true;
+			break;
+		case 'F':
+			cfg.prefill = false;
+			break;
+		case 'a':
+			cfg.pin = true;
+			break;
+		case 'f':
+			cfg.dev = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!cfg.depth || cfg.depth > MAX_DEPTH) {
+		fprintf(stderr, "batches and ring rounds hold 1 to %u operations\n", MAX_DEPTH);
+		return EXIT_FAILURE;
+	}
+
+	if (cfg.value_size < sizeof(uint64_t) || cfg.value_size > TMEM_MAX) {
+		fprintf(stderr, "values are %zu to %zu bytes\n", sizeof(uint64_t), (size_t) TMEM_MAX);
+		return EXIT_FAILURE;
+	}
+
+	if (!cfg.keys || cfg.theta <= 0 || cfg.theta >= 1) {
+		fprintf(stderr, "there must be keys, and the zipf skew is in (0, 1)\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < cfg.nr_threads; i++) {
+		if (cfg.workload == WORKLOAD_SWAP && cfg.keys < (uint64_t) cfg.threads[i] * cfg.depth) {
+			fprintf(stderr, "swap needs a window of %u keys per thread\n", cfg.depth);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (cfg.dist == DIST_ZIPF)
+		zipf_setup(cfg.keys, cfg.theta);
+
+	print_header();
+
+	for (i = 0; i < cfg.nr_threads; i++) {
+		if (!cfg.breakdown) {
+			ret |= run(cfg.threads[i]);
+			continue;
+		}
+
+		for (j = 0; j < sizeof(breakdown) / sizeof(breakdown[0]); j++) {
+			cfg.ctrl = breakdown[j];
+			ret |= run(cfg.threads[i]);
+		}
+	}
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
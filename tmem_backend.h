@@ -0,0 +1,173 @@
+#ifndef _TMEM_BACKEND_H
+#define _TMEM_BACKEND_H
+
+/*
+ * What the in-memory backends have in common: an rhashtable index keyed
+ * on the full key, sharded locks for the updates of a key, the check for
+ * values of one repeated word, and entry points that trace every call
+ * whichever way it returns
+ */
+
+#include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/rhashtable.h>
+
+/* Keys up to this size are stored in the entry itself */
+#define TMEM_INLINE_KEY_LEN (16)
+
+/* Keys are variable length, so lookups go through this instead of a raw pointer */
+struct tmem_key {
+	const void *key;
+	size_t key_len;
+};
+
+static inline u32 tmem_key_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct tmem_key *tmem_key = data;
+
+	return jhash(tmem_key->key, tmem_key->key_len, seed);
+}
+
+/* The object side of the index, for entries of type holding their key in key and key_len */
+#define TMEM_DEFINE_OBJ_FNS(type)						\
+static u32 tmem_obj_hashfn(const void *data, u32 len, u32 seed)		\
+{										\
+	const type *entry = data;						\
+										\
+	return jhash(entry->key, entry->key_len, seed);				\
+}										\
+										\
+static int tmem_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)	\
+{										\
+	const struct tmem_key *tmem_key = arg->key;				\
+	const type *entry = obj;						\
+										\
+	if (entry->key_len != tmem_key->key_len)				\
+		return 1;							\
+										\
+	return memcmp(entry->key, tmem_key->key, tmem_key->key_len);		\
+}
+
+/*
+ * Gets only need RCU, puts and invalidates of the
+ * same key serialize on one of these shards
+ */
+#define TMEM_LOCK_SHARDS_SHIFT (8)
+#define TMEM_LOCK_SHARDS (1 << TMEM_LOCK_SHARDS_SHIFT)
+
+struct tmem_lock_shard {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+static inline spinlock_t *tmem_key_lock(struct tmem_lock_shard *locks,
+		const void *key, size_t key_len)
+{
+	u32 hash = jhash(key, key_len, 0);
+
+	return &locks[hash_32(hash, TMEM_LOCK_SHARDS_SHIFT)].lock;
+}
+
+/* 
+ * Checks if the value is a single word repeated. The kernel cannot use 
+ * the vector units here, so compare a few words at a time without 
+ * branching on each one, starting from the last word since most 
+ * pages that are not same-filled differ there already
+ */
+static inline bool tmem_same_filled(void *value, size_t len, unsigned long *fill)
+{
+	unsigned long *words = value;
+	size_t nr = len / sizeof(*words);
+	unsigned long pattern;
+	size_t i;
+
+	if (!nr || len % sizeof(*words))
+		return false;
+
+	pattern = words[0];
+	if (words[nr - 1] != pattern)
+		return false;
+
+	for (i = 0; i + 4 <= nr; i += 4) {
+		if ((words[i] ^ pattern) | (words[i + 1] ^ pattern) |
+		    (words[i + 2] ^ pattern) | (words[i + 3] ^ pattern))
+			return false;
+	}
+
+	for (; i < nr; i++) {
+		if (words[i] != pattern)
+			return false;
+	}
+
+	*fill = pattern;
+
+	return true;
+}
+
+/*
+ * Define the entry points name_put_page(), name_get_page() and
+ * name_invalidate_page() over the __name_ ones, traced as a whole.
+ * The key is hashed for the trace before the call, since some
+ * backends take it over
+ */
+#define TMEM_DEFINE_TRACED_OPS(name)						\
+int name##_put_page(void *key, size_t key_len, void *value, size_t value_len)	\
+{										\
+	u32 key_hash = tmem_trace_key_hash(tmem_put, key, key_len);		\
+	int ret = __##name##_put_page(key, key_len, value, value_len);		\
+										\
+	trace_tmem_put(KBUILD_MODNAME, TMEM_POOL_DEFAULT, key_hash, value_len, ret);	\
+	return ret;								\
+}										\
+										\
+int name##_get_page(void *key, size_t key_len, void *value, size_t *value_len)	\
+{										\
+	u32 key_hash = tmem_trace_key_hash(tmem_get, key, key_len);		\
+	int ret = __##name##_get_page(key, key_len, value, value_len);		\
+										\
+	trace_tmem_get(KBUILD_MODNAME, TMEM_POOL_DEFAULT, key_hash, ret ? 0 : *value_len, ret);	\
+	return ret;								\
+}										\
+										\
+void name##_invalidate_page(void *key, size_t key_len)				\
+{										\
+	u32 key_hash = tmem_trace_key_hash(tmem_invalidate, key, key_len);	\
+										\
+	__##name##_invalidate_page(key, key_len);				\
+	trace_tmem_invalidate(KBUILD_MODNAME, TMEM_POOL_DEFAULT, key_hash, 0, 0);	\
+}
+
+/* Same, for name_pool_put_page() and the rest of the pool operations */
+#define TMEM_DEFINE_TRACED_POOL_OPS(name)					\
+int name##_pool_put_page(int pool_id, void *key, size_t key_len,		\
+		void *value, size_t value_len)					\
+{										\
+	u32 key_hash = tmem_trace_key_hash(tmem_put, key, key_len);		\
+	int ret = __##name##_pool_put_page(pool_id, key, key_len, value, value_len);	\
+										\
+	trace_tmem_put(KBUILD_MODNAME, pool_id, key_hash, value_len, ret);	\
+	return ret;								\
+}										\
+										\
+int name##_pool_get_page(int pool_id, void *key, size_t key_len,		\
+		void *value, size_t *value_len)					\
+{										\
+	u32 key_hash = tmem_trace_key_hash(tmem_get, key, key_len);		\
+	int ret = __##name##_pool_get_page(pool_id, key, key_len, value, value_len);	\
+										\
+	trace_tmem_get(KBUILD_MODNAME, pool_id, key_hash, ret ? 0 : *value_len, ret);	\
+	return ret;								\
+}										\
+										\
+void name##_pool_invalidate_page(int pool_id, void *key, size_t key_len)	\
+{										\
+	u32 key_hash = tmem_trace_key_hash(tmem_invalidate, key, key_len);	\
+										\
+	__##name##_pool_invalidate_page(pool_id, key, key_len);			\
+	trace_tmem_invalidate(KBUILD_MODNAME, pool_id, key_hash, 0, 0);		\
+}
+
+#endif /* _TMEM_BACKEND_H */
@@ -0,0 +1,510 @@
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/cleancache.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/xarray.h>
+#include <linux/jhash.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+
+#include <tmem/tmem_ops.h>
+
+#include "tmem_pool.h"
+#include "tmem_trace.h"
+
+/*
+ * Clean pages are handed to us with the page cache locked and interrupts
+ * off, while the backends may sleep. Puts and invalidates are therefore
+ * queued, in order, and run from a work item; gets run the queue first,
+ * so they never see a page that was invalidated or overwritten since
+ */
+#define TMEM_CLEANCACHE_MAX_PENDING (1024)
+
+struct tmem_cleancache_key {
+	struct cleancache_filekey filekey;
+	u64 index;
+};
+
+/*
+ * The backend cannot look keys up by inode, so we remember the indexes
+ * put for every inode, and invalidate a whole inode page by page. The
+ * backend may have dropped some of them already, which is harmless.
+ * Records go away with their inode, which the page cache invalidates
+ * before evicting it, so they are bounded by the inodes in memory
+ */
+struct tmem_cleancache_inode {
+	struct hlist_node node;
+	int pool_id;
+	struct cleancache_filekey filekey;
+	struct xarray indexes;
+};
+
+#define TMEM_CLEANCACHE_INODES_BITS (10)
+
+/* Under drain_lock */
+static DEFINE_HASHTABLE(inodes, TMEM_CLEANCACHE_INODES_BITS);
+
+enum tmem_cleancache_cmd {
+	TMEM_CLEANCACHE_PUT,
+	TMEM_CLEANCACHE_INVAL_PAGE,
+	TMEM_CLEANCACHE_INVAL_INODE,
+};
+
+struct tmem_cleancache_op {
+	struct list_head list;
+	enum tmem_cleancache_cmd cmd;
+	int pool_id;
+	struct cleancache_filekey filekey;
+	pgoff_t index;
+	/* A copy of the page, for puts */
+	struct page *page;
+};
+
+static LIST_HEAD(pending);
+static DEFINE_SPINLOCK(pending_lock);
+static unsigned int nr_pending;
+/* Queued operations not applied yet, including the ones a drain is running */
+static atomic_t unapplied;
+
+/* Pools that lost an invalidation, and must be flushed before the next get */
+static DECLARE_BITMAP(lost, TMEM_MAX_POOLS);
+
+/* Serializes running the queue, and protects the inode records */
+static DEFINE_MUTEX(drain_lock);
+static struct tmem_cleancache_key drain_key;
+
+static atomic64_t puts;
+static atomic64_t dropped_puts;
+static atomic64_t gets;
+static atomic64_t hits;
+static atomic64_t flushes;
+
+/* Gets can sleep in the backend, so each one allocates its key, see tmem_frontswap.c */
+static struct kmem_cache *key_cache;
+
+static u32 tmem_cleancache_hash(int pool_id, struct cleancache_filekey *filekey)
+{
+	return jhash(filekey, sizeof(*filekey), pool_id);
+}
+
+static struct tmem_cleancache_inode *tmem_cleancache_inode(int pool_id,
+		struct cleancache_filekey *filekey)
+{
+	struct tmem_cleancache_inode *inode;
+
+	hash_for_each_possible(inodes, inode, node, tmem_cleancache_hash(pool_id, filekey)) {
+		if (inode->pool_id == pool_id &&
+		    !memcmp(&inode->filekey, filekey, sizeof(*filekey)))
+			return inode;
+	}
+
+	return NULL;
+}
+
+static void tmem_cleancache_build_key(struct tmem_cleancache_key *key,
+		struct cleancache_filekey *filekey, pgoff_t index)
+{
+	key->filekey = *filekey;
+	key->index = index;
+}
+
+static void tmem_cleancache_inode_free(struct tmem_cleancache_inode *inode)
+{
+	hash_del(&inode->node);
+	xa_destroy(&inode->indexes);
+	kfree(inode);
+}
+
+/* A page the backend does not know about cannot go stale, so puts we cannot record are dropped */
+static int tmem_cleancache_track(int pool_id, struct cleancache_filekey *filekey, pgoff_t index)
+{
+	struct tmem_cleancache_inode *inode;
+	int ret;
+
+	inode = tmem_cleancache_inode(pool_id, filekey);
+	if (!inode) {
+		inode = kzalloc(sizeof(*inode), GFP_KERNEL);
+		if (!inode)
+			return -ENOMEM;
+
+		inode->pool_id = pool_id;
+		inode->filekey = *filekey;
+		xa_init(&inode->indexes);
+		hash_add(inodes, &inode->node, tmem_cleancache_hash(pool_id, filekey));
+	}
+
+	ret = xa_err(xa_store(&inode->indexes, index, xa_mk_value(0), GFP_KERNEL));
+	if (ret && xa_empty(&inode->indexes))
+		tmem_cleancache_inode_free(inode);
+
+	return ret;
+}
+
+/* Once the pool holds none of their pages anymore, with drain_lock held */
+static void tmem_cleancache_forget_inodes(int pool_id)
+{
+	struct tmem_cleancache_inode *inode;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(inodes, bkt, tmp, inode, node) {
+		if (inode->pool_id == pool_id)
+			tmem_cleancache_inode_free(inode);
+	}
+}
+
+static void tmem_cleancache_inval_inode(int pool_id, struct cleancache_filekey *filekey)
+{
+	struct tmem_cleancache_inode *inode;
+	unsigned long index;
+	u32 key_hash;
+	void *entry;
+
+	inode = tmem_cleancache_inode(pool_id, filekey);
+	if (!inode)
+		return;
+
+	xa_for_each(&inode->indexes, index, entry) {
+		tmem_cleancache_build_key(&drain_key, filekey, index);
+		key_hash = tmem_trace_key_hash(tmem_invalidate, &drain_key, sizeof(drain_key));
+		tmem_pool_invalidate(pool_id, &drain_key, sizeof(drain_key));
+		trace_tmem_invalidate(KBUILD_MODNAME, pool_id, key_hash, 0, 0);
+		cond_resched();
+	}
+
+	tmem_cleancache_inode_free(inode);
+}
+
+static void tmem_cleancache_run(struct tmem_cleancache_op *op)
+{
+	struct tmem_cleancache_inode *inode;
+	u32 key_hash;
+	void *value;
+	int ret;
+
+	switch (op->cmd) {
+	case TMEM_CLEANCACHE_PUT:
+
+		if (tmem_cleancache_track(op->pool_id, &op->filekey, op->index)) {
+			atomic64_inc(&dropped_puts);
+			break;
+		}
+
+		tmem_cleancache_build_key(&drain_key, &op->filekey, op->index);
+		value = kmap(op->page);
+		key_hash = tmem_trace_key_hash(tmem_put, &drain_key, sizeof(drain_key));
+		ret = tmem_pool_put(op->pool_id, &drain_key, sizeof(drain_key), value, PAGE_SIZE);
+		trace_tmem_put(KBUILD_MODNAME, op->pool_id, key_hash, PAGE_SIZE, ret);
+		kunmap(op->page);
+		break;
+
+	case TMEM_CLEANCACHE_INVAL_PAGE:
+
+		inode = tmem_cleancache_inode(op->pool_id, &op->filekey);
+		if (!inode || !xa_erase(&inode->indexes, op->index))
+			break;
+
+		if (xa_empty(&inode->indexes))
+			tmem_cleancache_inode_free(inode);
+
+		tmem_cleancache_build_key(&drain_key, &op->filekey, op->index);
+		key_hash = tmem_trace_key_hash(tmem_invalidate, &drain_key, sizeof(drain_key));
+		tmem_pool_invalidate(op->pool_id, &drain_key, sizeof(drain_key));
+		trace_tmem_invalidate(KBUILD_MODNAME, op->pool_id, key_hash, 0, 0);
+		break;
+
+	case TMEM_CLEANCACHE_INVAL_INODE:
+
+		tmem_cleancache_inval_inode(op->pool_id, &op->filekey);
+		break;
+	}
+}
+
+static void tmem_cleancache_op_free(struct tmem_cleancache_op *op)
+{
+	if (op->page)
+		__free_page(op->page);
+
+	kfree(op);
+}
+
+/* Called with drain_lock held */
+static void __tmem_cleancache_drain(void)
+{
+	struct tmem_cleancache_op *op, *tmp;
+	unsigned long flags;
+	LIST_HEAD(ops);
+	int pool_id;
+
+	spin_lock_irqsave(&pending_lock, flags);
+	list_splice_init(&pending, &ops);
+	nr_pending = 0;
+	spin_unlock_irqrestore(&pending_lock, flags);
+
+	list_for_each_entry_safe(op, tmp, &ops, list) {
+		tmem_cleancache_run(op);
+		list_del(&op->list);
+		tmem_cleancache_op_free(op);
+		smp_mb__before_atomic();
+		atomic_dec(&unapplied);
+	}
+
+	for_each_set_bit(pool_id, lost, TMEM_MAX_POOLS) {
+		if (test_and_clear_bit(pool_id, lost)) {
+			tmem_pool_invalidate_all(pool_id);
+			trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+			atomic64_inc(&flushes);
+			tmem_cleancache_forget_inodes(pool_id);
+		}
+	}
+}
+
+static void tmem_cleancache_drain(void)
+{
+	mutex_lock(&drain_lock);
+	__tmem_cleancache_drain();
+	mutex_unlock(&drain_lock);
+}
+
+static void tmem_cleancache_drain_work(struct work_struct *work)
+{
+	tmem_cleancache_drain();
+}
+
+static DECLARE_WORK(drain_work, tmem_cleancache_drain_work);
+
+static bool tmem_cleancache_queue(struct tmem_cleancache_op *op, bool droppable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pending_lock, flags);
+	if (droppable && nr_pending >= TMEM_CLEANCACHE_MAX_PENDING) {
+		spin_unlock_irqrestore(&pending_lock, flags);
+		return false;
+	}
+	list_add_tail(&op->list, &pending);
+	nr_pending++;
+	atomic_inc(&unapplied);
+	spin_unlock_irqrestore(&pending_lock, flags);
+
+	schedule_work(&drain_work);
+
+	return true;
+}
+
+/* Invalidations cannot be dropped, so losing one flushes the whole pool */
+static void tmem_cleancache_queue_inval(enum tmem_cleancache_cmd cmd, int pool_id,
+		struct cleancache_filekey *filekey, pgoff_t index)
+{
+	struct tmem_cleancache_op *op;
+
+	if (pool_id <= TMEM_POOL_DEFAULT || pool_id >= TMEM_MAX_POOLS)
+		return;
+
+	op = kzalloc(sizeof(*op), GFP_NOWAIT | __GFP_NOWARN);
+	if (!op) {
+		set_bit(pool_id, lost);
+		schedule_work(&drain_work);
+		return;
+	}
+
+	op->cmd = cmd;
+	op->pool_id = pool_id;
+	op->filekey = *filekey;
+	op->index = index;
+
+	tmem_cleancache_queue(op, false);
+}
+
+/*
+ * A pool of our own for every filesystem. Without pool support in the
+ * backend, filesystems would share one keyspace with stale pages of
+ * each other, so cleancache stays off for them
+ */
+static int tmem_cleancache_init_fs(size_t pagesize)
+{
+	int pool_id;
+
+	if (pagesize != PAGE_SIZE)
+		return -EINVAL;
+
+	pool_id = tmem_pool_create(0, TMEM_POOL_EPHEMERAL);
+	if (pool_id == TMEM_POOL_DEFAULT)
+		return -ENODEV;
+
+	return pool_id;
+}
+
+static int tmem_cleancache_init_shared_fs(uuid_t *uuid, size_t pagesize)
+{
+	return tmem_cleancache_init_fs(pagesize);
+}
+
+static int tmem_cleancache_get_page(int pool_id, struct cleancache_filekey filekey,
+		pgoff_t index, struct page *page)
+{
+	u32 key_hash;
+	struct tmem_cleancache_key *key;
+	size_t value_len;
+	void *value;
+	int ret;
+
+	if (pool_id <= TMEM_POOL_DEFAULT || pool_id >= TMEM_MAX_POOLS)
+		return -1;
+
+	atomic64_inc(&gets);
+
+	/* An empty queue is not enough, a drain may still be running what it took */
+	if (atomic_read(&unapplied) || test_bit(pool_id, lost))
+		tmem_cleancache_drain();
+
+	/* A miss is always fine here, the page is read from the filesystem */
+	key = kmem_cache_alloc(key_cache, GFP_NOIO | __GFP_NOWARN);
+	if (!key)
+		return -1;
+
+	tmem_cleancache_build_key(key, &filekey, index);
+
+	value = kmap(page);
+	key_hash = tmem_trace_key_hash(tmem_get, key, sizeof(*key));
+	ret = tmem_pool_get(pool_id, key, sizeof(*key), value, &value_len);
+	trace_tmem_get(KBUILD_MODNAME, pool_id, key_hash, ret ? 0 : value_len, ret);
+	kunmap(page);
+	kmem_cache_free(key_cache, key);
+
+	if (ret < 0 || value_len != PAGE_SIZE)
+		return -1;
+
+	atomic64_inc(&hits);
+
+	return 0;
+}
+
+/* Clean pages can always be read back from the filesystem, so these are dropped freely */
+static void tmem_cleancache_put_page(int pool_id, struct cleancache_filekey filekey,
+		pgoff_t index, struct page *page)
+{
+	struct tmem_cleancache_op *op;
+
+	if (pool_id <= TMEM_POOL_DEFAULT || pool_id >= TMEM_MAX_POOLS)
+		return;
+
+	atomic64_inc(&puts);
+
+	op = kzalloc(sizeof(*op), GFP_NOWAIT | __GFP_NOWARN);
+	if (!op)
+		goto out_drop;
+
+	op->page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+	if (!op->page)
+		goto out_free;
+
+	copy_highpage(op->page, page);
+	op->cmd = TMEM_CLEANCACHE_PUT;
+	op->pool_id = pool_id;
+	op->filekey = filekey;
+	op->index = index;
+
+	if (tmem_cleancache_queue(op, true))
+		return;
+
+out_free:
+
+	tmem_cleancache_op_free(op);
+
+out_drop:
+
+	atomic64_inc(&dropped_puts);
+}
+
+static void tmem_cleancache_invalidate_page(int pool_id, struct cleancache_filekey filekey,
+		pgoff_t index)
+{
+	tmem_cleancache_queue_inval(TMEM_CLEANCACHE_INVAL_PAGE, pool_id, &filekey, index);
+}
+
+static void tmem_cleancache_invalidate_inode(int pool_id, struct cleancache_filekey filekey)
+{
+	tmem_cleancache_queue_inval(TMEM_CLEANCACHE_INVAL_INODE, pool_id, &filekey, 0);
+}
+
+static void tmem_cleancache_invalidate_fs(int pool_id)
+{
+	if (pool_id <= TMEM_POOL_DEFAULT || pool_id >= TMEM_MAX_POOLS)
+		return;
+
+	/* Nothing queued for the pool may run after it is gone */
+	mutex_lock(&drain_lock);
+	__tmem_cleancache_drain();
+	tmem_pool_destroy(pool_id);
+	trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+	clear_bit(pool_id, lost);
+	tmem_cleancache_forget_inodes(pool_id);
+	mutex_unlock(&drain_lock);
+}
+
+static const struct cleancache_ops tmem_cleancache_ops = {
+	.init_fs = tmem_cleancache_init_fs,
+	.init_shared_fs = tmem_cleancache_init_shared_fs,
+	.get_page = tmem_cleancache_get_page,
+	.put_page = tmem_cleancache_put_page,
+	.invalidate_page = tmem_cleancache_invalidate_page,
+	.invalidate_inode = tmem_cleancache_invalidate_inode,
+	.invalidate_fs = tmem_cleancache_invalidate_fs,
+};
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+static int __init tmem_cleancache_init(void)
+{
+	struct dentry *root;
+	int ret;
+
+	key_cache = KMEM_CACHE(tmem_cleancache_key, 0);
+	if (!key_cache)
+		return -ENOMEM;
+
+	ret = cleancache_register_ops(&tmem_cleancache_ops);
+	if (ret) {
+		pr_err("cleancache operations could not be registered\n");
+		kmem_cache_destroy(key_cache);
+		return ret;
+	}
+	pr_debug("registration successful");
+
+	root = debugfs_create_dir("tmem_cleancache", NULL);
+	if (IS_ERR_OR_NULL(root)) {
+		pr_err("debugfs directory could not be set up\n");
+		return 0;
+	}
+
+	if (!debugfs_create_file("puts", S_IRUGO, root, &puts, &atomic_stat_fops) ||
+	    !debugfs_create_file("dropped_puts", S_IRUGO, root, &dropped_puts, &atomic_stat_fops) ||
+	    !debugfs_create_file("gets", S_IRUGO, root, &gets, &atomic_stat_fops) ||
+	    !debugfs_create_file("hits", S_IRUGO, root, &hits, &atomic_stat_fops) ||
+	    !debugfs_create_file("flushes", S_IRUGO, root, &flushes, &atomic_stat_fops))
+		pr_err("debugfs entry could not be set up\n");
+
+	return 0;
+}
+
+
+
+module_init(tmem_cleancache_init);
+MODULE_AUTHOR("Aimilios Tsalapatis");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,557 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/kref.h>
+#include <linux/percpu.h>
+#include <linux/crypto.h>
+#include <linux/zpool.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+
+#include <tmem/tmem_ops.h>
+
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
+/*
+ * Values are compressed before being stored in a zpool, so the
+ * pool size limits the memory actually used, not what was put
+ */
+#define TMEM_POOL_SIZE (1024 * 1024 * 1024)
+
+static char *compressor = "lzo";
+module_param(compressor, charp, S_IRUGO);
+MODULE_PARM_DESC(compressor, "Compression algorithm used for values (lzo, lz4, zstd...)");
+
+static char *zpool_type = "zsmalloc";
+module_param_named(zpool, zpool_type, charp, S_IRUGO);
+MODULE_PARM_DESC(zpool, "Allocator holding the compressed values (zsmalloc, zbud...)");
+
+static struct zpool *pool;
+
+static DEFINE_PER_CPU(struct crypto_comp *, compress_tfm);
+static DEFINE_PER_CPU(u8 *, compress_buffer);
+
+/* Pages in the pool, how many of those did not compress, and how many are one word repeated */
+static atomic64_t stored_pages;
+static atomic64_t raw_pages;
+static atomic64_t same_filled_pages;
+/* Bytes put by the frontends, and bytes of the pool they ended up using */
+static atomic64_t stored_bytes;
+static atomic64_t compressed_bytes;
+
+struct compress_entry {
+	struct rhash_head hash_node;
+	struct rcu_head rcu;
+	struct kref refcount;
+	void *key;
+	size_t key_len;
+	unsigned long handle;
+	size_t length;
+	size_t value_len;
+	bool raw;
+	/* Empty and same-filled values only keep the word, and have no handle */
+	bool filled;
+	unsigned long fill;
+	u8 inline_key[TMEM_INLINE_KEY_LEN];
+};
+
+static struct kmem_cache *compress_entry_cache;
+
+TMEM_DEFINE_OBJ_FNS(struct compress_entry)
+
+static const struct rhashtable_params used_pages_params = {
+	.head_offset = offsetof(struct compress_entry, hash_node),
+	.hashfn = tmem_key_hashfn,
+	.obj_hashfn = tmem_obj_hashfn,
+	.obj_cmpfn = tmem_obj_cmpfn,
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable used_pages;
+
+static struct tmem_lock_shard used_locks[TMEM_LOCK_SHARDS];
+
+static struct compress_entry *compress_entry_alloc(void *key, size_t key_len)
+{
+	struct compress_entry *entry;
+
+	entry = kmem_cache_alloc(compress_entry_cache, GFP_KERNEL);
+	if (!entry)
+		return NULL;
+
+	if (key_len <= TMEM_INLINE_KEY_LEN) {
+		entry->key = entry->inline_key;
+	} else {
+		entry->key = kmalloc(key_len, GFP_KERNEL);
+		if (!entry->key) {
+			kmem_cache_free(compress_entry_cache, entry);
+			return NULL;
+		}
+	}
+
+	memcpy(entry->key, key, key_len);
+	entry->key_len = key_len;
+	kref_init(&entry->refcount);
+
+	return entry;
+}
+
+static void compress_entry_free(struct compress_entry *entry)
+{
+	if (entry->key != entry->inline_key)
+		kfree(entry->key);
+
+	kmem_cache_free(compress_entry_cache, entry);
+}
+
+static void compress_entry_free_rcu(struct rcu_head *rcu)
+{
+	compress_entry_free(container_of(rcu, struct compress_entry, rcu));
+}
+
+/*
+ * The pool memory goes away with the last reference, the entry itself
+ * only after a grace period since lookups do not hold any locks
+ */
+static void compress_entry_release(struct kref *kref)
+{
+	struct compress_entry *entry = container_of(kref, struct compress_entry, refcount);
+
+	if (entry->filled)
+		atomic64_dec(&same_filled_pages);
+	else
+		zpool_free(pool, entry->handle);
+
+	atomic64_dec(&stored_pages);
+	if (entry->raw)
+		atomic64_dec(&raw_pages);
+	atomic64_sub(entry->value_len, &stored_bytes);
+	atomic64_sub(entry->length, &compressed_bytes);
+
+	call_rcu(&entry->rcu, compress_entry_free_rcu);
+}
+
+static int compress_store(struct compress_entry *entry, void *value, size_t len)
+{
+	gfp_t gfp = __GFP_NORETRY | __GFP_NOWARN | __GFP_KSWAPD_RECLAIM;
+	unsigned int dlen = PAGE_SIZE * 2;
+	struct crypto_comp *tfm;
+	u8 *dst, *src;
+	void *buf;
+	int ret;
+
+	/* zsmalloc refuses empty allocations, and these compress to nothing anyway */
+	entry->fill = 0;
+	entry->filled = !len || tmem_same_filled(value, len, &entry->fill);
+	if (entry->filled) {
+		entry->raw = false;
+		entry->length = 0;
+
+		atomic64_inc(&stored_pages);
+		atomic64_inc(&same_filled_pages);
+		atomic64_add(entry->value_len, &stored_bytes);
+
+		return 0;
+	}
+
+	dst = get_cpu_var(compress_buffer);
+	tfm = this_cpu_read(compress_tfm);
+
+	/* Pages that do not compress are stored as they are */
+	ret = crypto_comp_compress(tfm, value, len, dst, &dlen);
+	if (ret || dlen >= len) {
+		entry->raw = true;
+		src = value;
+		dlen = len;
+	} else {
+		entry->raw = false;
+		src = dst;
+	}
+
+	if (zpool_get_total_size(pool) + dlen > TMEM_POOL_SIZE) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = zpool_malloc(pool, dlen, gfp, &entry->handle);
+	if (ret)
+		goto out;
+
+	buf = zpool_map_handle(pool, entry->handle, ZPOOL_MM_WO);
+	memcpy(buf, src, dlen);
+	zpool_unmap_handle(pool, entry->handle);
+
+	entry->length = dlen;
+
+	atomic64_inc(&stored_pages);
+	if (entry->raw)
+		atomic64_inc(&raw_pages);
+	atomic64_add(entry->value_len, &stored_bytes);
+	atomic64_add(entry->length, &compressed_bytes);
+
+out:
+	put_cpu_var(compress_buffer);
+
+	return ret;
+}
+
+static int compress_load(struct compress_entry *entry, void *value)
+{
+	unsigned int dlen = PAGE_SIZE;
+	struct crypto_comp *tfm;
+	u8 *src;
+	int ret = 0;
+
+	if (entry->filled) {
+		memset_l(value, entry->fill, entry->value_len / sizeof(unsigned long));
+		return 0;
+	}
+
+	src = zpool_map_handle(pool, entry->handle, ZPOOL_MM_RO);
+	if (entry->raw) {
+		memcpy(value, src, entry->length);
+	} else {
+		tfm = get_cpu_var(compress_tfm);
+		ret = crypto_comp_decompress(tfm, src, entry->length, value, &dlen);
+		put_cpu_var(compress_tfm);
+	}
+	zpool_unmap_handle(pool, entry->handle);
+
+	if (ret) {
+		pr_err("decompression failed\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int __tmem_compress_put_page(void *key, size_t key_len, void *value, size_t value_len)
+{
+	struct compress_entry *entry, *old_entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+	int ret;
+
+	pr_debug("entering put_page\n");
+
+	/* The compression buffers only hold a page */
+	if (value_len > PAGE_SIZE)
+		return -EINVAL;
+
+	entry = compress_entry_alloc(key, key_len);
+	if (!entry) {
+		pr_err("leaving put_page - not enough memory\n");
+		return -ENOMEM;
+	}
+
+	entry->value_len = value_len;
+	ret = compress_store(entry, value, value_len);
+	if (ret) {
+		compress_entry_free(entry);
+		pr_debug("leaving put_page - failed\n");
+		return ret;
+	}
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+
+	old_entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (old_entry)
+		ret = rhashtable_replace_fast(&used_pages, &old_entry->hash_node,
+				&entry->hash_node, used_pages_params);
+	else
+		ret = rhashtable_insert_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+
+	spin_unlock(lock);
+
+	if (ret) {
+		pr_err("leaving put_page - could not add the page\n");
+		kref_put(&entry->refcount, compress_entry_release);
+		return ret;
+	}
+
+	/* Gets that already found the old entry still hold a reference */
+	if (old_entry)
+		kref_put(&old_entry->refcount, compress_entry_release);
+
+	pr_debug("leaving put_page\n");
+
+	return 0;
+}
+
+static int __tmem_compress_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+{
+	struct compress_entry *entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	int ret;
+
+	pr_debug("entering get_page\n");
+
+	rcu_read_lock();
+	entry = rhashtable_lookup(&used_pages, &tmem_key, used_pages_params);
+	if (entry && !kref_get_unless_zero(&entry->refcount))
+		entry = NULL;
+	rcu_read_unlock();
+
+	if (!entry) {
+		*value_len = 0;
+		return -EINVAL;
+	}
+
+	/* Decompression can take a while, so it is done outside of RCU */
+	ret = compress_load(entry, value);
+	*value_len = ret ? 0 : entry->value_len;
+
+	kref_put(&entry->refcount, compress_entry_release);
+
+	pr_debug("leaving get_page\n");
+
+	return ret;
+}
+
+static void __tmem_compress_invalidate_page(void *key, size_t key_len)
+{
+	struct compress_entry *entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+
+	pr_debug("entering invalidate_page\n");
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+	entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (entry && !rhashtable_remove_fast(&used_pages, &entry->hash_node,
+				used_pages_params)) {
+		spin_unlock(lock);
+
+		kref_put(&entry->refcount, compress_entry_release);
+
+		pr_debug("leaving invalidate_page\n");
+
+		return;
+	}
+	spin_unlock(lock);
+
+	pr_debug("leaving invalidate_page - key not present\n");
+}
+
+void tmem_compress_invalidate_area(void)
+{
+	struct compress_entry *entry;
+	struct rhashtable_iter iter;
+	spinlock_t *lock;
+	int ret;
+
+	pr_debug("entering invalidate_area\n");
+	trace_tmem_invalidate_area(KBUILD_MODNAME, TMEM_POOL_DEFAULT);
+
+	rhashtable_walk_enter(&used_pages, &iter);
+	rhashtable_walk_start(&iter);
+
+	while ((entry = rhashtable_walk_next(&iter)) != NULL) {
+		/* The table got resized under us, keep going from where we are */
+		if (IS_ERR(entry)) {
+			if (PTR_ERR(entry) == -EAGAIN)
+				continue;
+			break;
+		}
+
+		/* Do not race with a put replacing this same entry */
+		lock = tmem_key_lock(used_locks, entry->key, entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (!ret)
+			kref_put(&entry->refcount, compress_entry_release);
+	}
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+
+	pr_debug("leaving invalidate_area\n");
+}
+
+TMEM_DEFINE_TRACED_OPS(tmem_compress)
+
+struct tmem_ops tmem_compress_ops = {
+	.get = tmem_compress_get_page,
+	.put = tmem_compress_put_page,
+	.invalidate = tmem_compress_invalidate_page,
+	.invalidate_all = tmem_compress_invalidate_area,
+};
+
+static void compress_free_percpu(void)
+{
+	struct crypto_comp *tfm;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		tfm = per_cpu(compress_tfm, cpu);
+		if (!IS_ERR_OR_NULL(tfm))
+			crypto_free_comp(tfm);
+
+		kfree(per_cpu(compress_buffer, cpu));
+	}
+}
+
+static int compress_alloc_percpu(void)
+{
+	struct crypto_comp *tfm;
+	u8 *buf;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(compressor, 0, 0);
+		if (IS_ERR(tfm))
+			goto out_fail;
+		per_cpu(compress_tfm, cpu) = tfm;
+
+		/* Incompressible input can come out larger than it went in */
+		buf = kmalloc_node(PAGE_SIZE * 2, GFP_KERNEL, cpu_to_node(cpu));
+		if (!buf)
+			goto out_fail;
+		per_cpu(compress_buffer, cpu) = buf;
+	}
+
+	return 0;
+
+out_fail:
+
+	compress_free_percpu();
+
+	return -ENOMEM;
+}
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+static int current_memory_get(void *data, u64 *val)
+{
+	*val = zpool_get_total_size(pool);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(current_memory_fops, current_memory_get, NULL, "%llu\n");
+
+/* Bytes stored per hundred bytes of pool memory */
+static int efficiency_get(void *data, u64 *val)
+{
+	u64 total = zpool_get_total_size(pool);
+
+	*val = total ? div64_u64(atomic64_read(&stored_bytes) * 100, total) : 0;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(efficiency_fops, efficiency_get, NULL, "%llu\n");
+
+static int __init tmem_compress_init(void)
+{
+	struct dentry *root;
+	int ret, i;
+
+	if (!crypto_has_comp(compressor, 0, 0)) {
+		pr_err("compressor %s not available\n", compressor);
+		return -ENOENT;
+	}
+
+	if (!zpool_has_pool(zpool_type)) {
+		pr_err("zpool %s not available\n", zpool_type);
+		return -ENOENT;
+	}
+
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++)
+		spin_lock_init(&used_locks[i].lock);
+
+	compress_entry_cache = kmem_cache_create("tmem_compress_entry",
+			sizeof(struct compress_entry), 0, 0, NULL);
+	if (!compress_entry_cache)
+		return -ENOMEM;
+
+	pool = zpool_create_pool(zpool_type, "tmem",
+			__GFP_NORETRY | __GFP_NOWARN | __GFP_KSWAPD_RECLAIM, NULL);
+	if (!pool) {
+		ret = -ENOMEM;
+		goto out_pool;
+	}
+
+	ret = compress_alloc_percpu();
+	if (ret)
+		goto out_percpu;
+
+	ret = rhashtable_init(&used_pages, &used_pages_params);
+	if (ret)
+		goto out_rhashtable;
+
+	register_tmem_backend(&tmem_compress_ops, NULL);
+	register_tmem_tier_ops(KBUILD_MODNAME, &tmem_compress_ops);
+
+	pr_info("using %s compressor over %s\n", compressor, zpool_get_type(pool));
+
+	root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root)) {
+		pr_err("debugfs directory could not be set up\n");
+		goto out;
+	}
+
+	if (!debugfs_create_file("current_memory", S_IRUGO, root, NULL, &current_memory_fops) ||
+	    !debugfs_create_file("stored_pages", S_IRUGO, root, &stored_pages, &atomic_stat_fops) ||
+	    !debugfs_create_file("raw_pages", S_IRUGO, root, &raw_pages, &atomic_stat_fops) ||
+	    !debugfs_create_file("same_filled_pages", S_IRUGO, root, &same_filled_pages, &atomic_stat_fops) ||
+	    !debugfs_create_file("stored_bytes", S_IRUGO, root, &stored_bytes, &atomic_stat_fops) ||
+	    !debugfs_create_file("compressed_bytes", S_IRUGO, root, &compressed_bytes, &atomic_stat_fops) ||
+	    !debugfs_create_file("efficiency", S_IRUGO, root, NULL, &efficiency_fops))
+		pr_err("debugfs entry could not be set up\n");
+
+out:
+
+	return 0;
+
+out_rhashtable:
+
+	compress_free_percpu();
+
+out_percpu:
+
+	zpool_destroy_pool(pool);
+
+out_pool:
+
+	kmem_cache_destroy(compress_entry_cache);
+
+	return ret;
+}
+
+
+
+module_init(tmem_compress_init);
+MODULE_AUTHOR("Aimilios Tsalapatis");
+MODULE_LICENSE("GPL");
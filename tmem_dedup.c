@@ -0,0 +1,510 @@
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/xxhash.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+
+#include <tmem/tmem_ops.h>
+
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
+#define TMEM_POOL_SIZE (1024 * 1024 * 1024)
+
+/*
+ * Every distinct value is stored once, and all the keys that were
+ * put with that content point to it. Values are never modified, so
+ * putting a new value under a key never affects the other keys
+ */
+struct dedup_value {
+	struct rhlist_head hash_node;
+	struct rcu_head rcu;
+	u64 fingerprint;
+	/* Protected by the shard lock of the fingerprint */
+	unsigned int refcount;
+	size_t len;
+	void *data;
+};
+
+struct dedup_entry {
+	struct rhash_head hash_node;
+	struct rcu_head rcu;
+	void *key;
+	size_t key_len;
+	struct dedup_value *value;
+	size_t value_len;
+	u8 inline_key[TMEM_INLINE_KEY_LEN];
+};
+
+static struct kmem_cache *dedup_entry_cache;
+static struct kmem_cache *dedup_value_cache;
+static struct kmem_cache *dedup_data_cache;
+
+/* Keys put, and distinct values backing them */
+static atomic64_t stored_pages;
+static atomic64_t unique_pages;
+/* Bytes put, and bytes of the distinct values */
+static atomic64_t stored_bytes;
+static atomic64_t unique_bytes;
+/* A page of dedup_data_cache for every distinct value, whatever its length; the pool size limits it */
+static atomic64_t current_memory;
+
+TMEM_DEFINE_OBJ_FNS(struct dedup_entry)
+
+static const struct rhashtable_params used_pages_params = {
+	.head_offset = offsetof(struct dedup_entry, hash_node),
+	.hashfn = tmem_key_hashfn,
+	.obj_hashfn = tmem_obj_hashfn,
+	.obj_cmpfn = tmem_obj_cmpfn,
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable used_pages;
+
+/* Different contents can share a fingerprint, hence the list table */
+static const struct rhashtable_params used_values_params = {
+	.head_offset = offsetof(struct dedup_value, hash_node),
+	.key_offset = offsetof(struct dedup_value, fingerprint),
+	.key_len = sizeof(u64),
+	.automatic_shrinking = true,
+};
+
+static struct rhltable used_values;
+
+/*
+ * Besides the key shards, lookups and reference drops of values
+ * with the same fingerprint serialize on one of the value shards
+ */
+static struct tmem_lock_shard used_locks[TMEM_LOCK_SHARDS], value_locks[TMEM_LOCK_SHARDS];
+
+static spinlock_t *tmem_value_lock(u64 fingerprint)
+{
+	return &value_locks[hash_64(fingerprint, TMEM_LOCK_SHARDS_SHIFT)].lock;
+}
+
+static void dedup_value_free(struct dedup_value *dedup_value)
+{
+	kmem_cache_free(dedup_data_cache, dedup_value->data);
+	kmem_cache_free(dedup_value_cache, dedup_value);
+}
+
+static void dedup_value_free_rcu(struct rcu_head *rcu)
+{
+	dedup_value_free(container_of(rcu, struct dedup_value, rcu));
+}
+
+/* Must be called with the value shard lock held */
+static struct dedup_value *dedup_value_find(void *value, size_t len, u64 fingerprint)
+{
+	struct dedup_value *dedup_value;
+	struct rhlist_head *list, *pos;
+
+	list = rhltable_lookup(&used_values, &fingerprint, used_values_params);
+	rhl_for_each_entry_rcu(dedup_value, pos, list, hash_node) {
+		/* A fingerprint match is not enough, the contents have to be the same */
+		if (dedup_value->len == len && !memcmp(dedup_value->data, value, len)) {
+			dedup_value->refcount++;
+			return dedup_value;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns a referenced value with the given contents, storing it if it is new */
+static struct dedup_value *dedup_value_get(void *value, size_t len)
+{
+	struct dedup_value *dedup_value, *found;
+	u64 fingerprint = xxh64(value, len, 0);
+	spinlock_t *lock = tmem_value_lock(fingerprint);
+	int ret = 0;
+
+	rcu_read_lock();
+	spin_lock(lock);
+	found = dedup_value_find(value, len, fingerprint);
+	spin_unlock(lock);
+	rcu_read_unlock();
+
+	if (found)
+		return found;
+
+	/* Charged up front, so that concurrent puts cannot all get past the limit */
+	if (atomic64_add_return(PAGE_SIZE, &current_memory) > TMEM_POOL_SIZE) {
+		atomic64_sub(PAGE_SIZE, &current_memory);
+		return ERR_PTR(-ENOSPC);
+	}
+
+	dedup_value = kmem_cache_alloc(dedup_value_cache, GFP_KERNEL);
+	if (!dedup_value) {
+		atomic64_sub(PAGE_SIZE, &current_memory);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	dedup_value->data = kmem_cache_alloc(dedup_data_cache, GFP_KERNEL);
+	if (!dedup_value->data) {
+		kmem_cache_free(dedup_value_cache, dedup_value);
+		atomic64_sub(PAGE_SIZE, &current_memory);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	memcpy(dedup_value->data, value, len);
+	dedup_value->len = len;
+	dedup_value->fingerprint = fingerprint;
+	dedup_value->refcount = 1;
+
+	/* Someone may have stored the same contents while we were copying */
+	rcu_read_lock();
+	spin_lock(lock);
+	found = dedup_value_find(value, len, fingerprint);
+	if (!found) {
+		ret = rhltable_insert(&used_values, &dedup_value->hash_node,
+				used_values_params);
+		if (!ret) {
+			atomic64_inc(&unique_pages);
+			atomic64_add(len, &unique_bytes);
+		}
+	}
+	spin_unlock(lock);
+	rcu_read_unlock();
+
+	if (found || ret) {
+		dedup_value_free(dedup_value);
+		atomic64_sub(PAGE_SIZE, &current_memory);
+		return found ? found : ERR_PTR(ret);
+	}
+
+	return dedup_value;
+}
+
+static void dedup_value_put(struct dedup_value *dedup_value)
+{
+	spinlock_t *lock = tmem_value_lock(dedup_value->fingerprint);
+
+	spin_lock(lock);
+	if (--dedup_value->refcount) {
+		spin_unlock(lock);
+		return;
+	}
+
+	rhltable_remove(&used_values, &dedup_value->hash_node, used_values_params);
+	spin_unlock(lock);
+
+	atomic64_dec(&unique_pages);
+	atomic64_sub(dedup_value->len, &unique_bytes);
+	atomic64_sub(PAGE_SIZE, &current_memory);
+	call_rcu(&dedup_value->rcu, dedup_value_free_rcu);
+}
+
+static struct dedup_entry *dedup_entry_alloc(void *key, size_t key_len)
+{
+	struct dedup_entry *entry;
+
+	entry = kmem_cache_alloc(dedup_entry_cache, GFP_KERNEL);
+	if (!entry)
+		return NULL;
+
+	if (key_len <= TMEM_INLINE_KEY_LEN) {
+		entry->key = entry->inline_key;
+	} else {
+		entry->key = kmalloc(key_len, GFP_KERNEL);
+		if (!entry->key) {
+			kmem_cache_free(dedup_entry_cache, entry);
+			return NULL;
+		}
+	}
+
+	memcpy(entry->key, key, key_len);
+	entry->key_len = key_len;
+
+	return entry;
+}
+
+static void dedup_entry_free(struct dedup_entry *entry)
+{
+	if (entry->key != entry->inline_key)
+		kfree(entry->key);
+
+	kmem_cache_free(dedup_entry_cache, entry);
+}
+
+static void dedup_entry_free_rcu(struct rcu_head *rcu)
+{
+	dedup_entry_free(container_of(rcu, struct dedup_entry, rcu));
+}
+
+/* The entry is out of the index, gets may still read the value until a grace period passes */
+static void dedup_entry_release(struct dedup_entry *entry)
+{
+	atomic64_dec(&stored_pages);
+	atomic64_sub(entry->value_len, &stored_bytes);
+	dedup_value_put(entry->value);
+	call_rcu(&entry->rcu, dedup_entry_free_rcu);
+}
+
+static int __tmem_dedup_put_page(void *key, size_t key_len, void *value, size_t value_len)
+{
+	struct dedup_entry *entry, *old_entry;
+	struct dedup_value *dedup_value;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+	int ret;
+
+	pr_debug("entering put_page\n");
+
+	/* Values are stored in page sized buffers */
+	if (value_len > PAGE_SIZE)
+		return -EINVAL;
+
+	entry = dedup_entry_alloc(key, key_len);
+	if (!entry) {
+		pr_err("leaving put_page - not enough memory\n");
+		return -ENOMEM;
+	}
+
+	dedup_value = dedup_value_get(value, value_len);
+	if (IS_ERR(dedup_value)) {
+		dedup_entry_free(entry);
+		pr_debug("leaving put_page - failed\n");
+		return PTR_ERR(dedup_value);
+	}
+
+	entry->value = dedup_value;
+	entry->value_len = value_len;
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+
+	old_entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (old_entry)
+		ret = rhashtable_replace_fast(&used_pages, &old_entry->hash_node,
+				&entry->hash_node, used_pages_params);
+	else
+		ret = rhashtable_insert_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+
+	spin_unlock(lock);
+
+	if (ret) {
+		dedup_value_put(dedup_value);
+		dedup_entry_free(entry);
+		pr_err("leaving put_page - could not add the page\n");
+		return ret;
+	}
+
+	atomic64_inc(&stored_pages);
+	atomic64_add(value_len, &stored_bytes);
+
+	/* Only this key stops using the old contents, the other keys keep them */
+	if (old_entry)
+		dedup_entry_release(old_entry);
+
+	pr_debug("leaving put_page\n");
+
+	return 0;
+}
+
+static int __tmem_dedup_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+{
+	struct dedup_entry *entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+
+	pr_debug("entering get_page\n");
+
+	/* Entries and values are only freed after a grace period */
+	rcu_read_lock();
+	entry = rhashtable_lookup(&used_pages, &tmem_key, used_pages_params);
+	if (entry) {
+		*value_len = entry->value_len;
+		memcpy(value, entry->value->data, entry->value->len);
+		rcu_read_unlock();
+
+		pr_debug("leaving get_page\n");
+
+		return 0;
+	}
+	rcu_read_unlock();
+
+	*value_len = 0;
+
+	return -EINVAL;
+}
+
+static void __tmem_dedup_invalidate_page(void *key, size_t key_len)
+{
+	struct dedup_entry *entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+
+	pr_debug("entering invalidate_page\n");
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+	entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (entry && !rhashtable_remove_fast(&used_pages, &entry->hash_node,
+				used_pages_params)) {
+		spin_unlock(lock);
+
+		dedup_entry_release(entry);
+
+		pr_debug("leaving invalidate_page\n");
+
+		return;
+	}
+	spin_unlock(lock);
+
+	pr_debug("leaving invalidate_page - key not present\n");
+}
+
+void tmem_dedup_invalidate_area(void)
+{
+	struct dedup_entry *entry;
+	struct rhashtable_iter iter;
+	spinlock_t *lock;
+	int ret;
+
+	pr_debug("entering invalidate_area\n");
+	trace_tmem_invalidate_area(KBUILD_MODNAME, TMEM_POOL_DEFAULT);
+
+	rhashtable_walk_enter(&used_pages, &iter);
+	rhashtable_walk_start(&iter);
+
+	while ((entry = rhashtable_walk_next(&iter)) != NULL) {
+		/* The table got resized under us, keep going from where we are */
+		if (IS_ERR(entry)) {
+			if (PTR_ERR(entry) == -EAGAIN)
+				continue;
+			break;
+		}
+
+		/* Do not race with a put replacing this same entry */
+		lock = tmem_key_lock(used_locks, entry->key, entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (!ret)
+			dedup_entry_release(entry);
+	}
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+
+	pr_debug("leaving invalidate_area\n");
+}
+
+TMEM_DEFINE_TRACED_OPS(tmem_dedup)
+
+struct tmem_ops tmem_dedup_ops = {
+	.get = tmem_dedup_get_page,
+	.put = tmem_dedup_put_page,
+	.invalidate = tmem_dedup_invalidate_page,
+	.invalidate_all = tmem_dedup_invalidate_area,
+};
+
+/* What storing every key separately, a page each, would have cost on top of current_memory */
+static int saved_memory_get(void *data, u64 *val)
+{
+	s64 saved = atomic64_read(&stored_pages) * PAGE_SIZE - atomic64_read(&current_memory);
+
+	*val = saved > 0 ? saved : 0;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(saved_memory_fops, saved_memory_get, NULL, "%llu\n");
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+static int __init tmem_dedup_init(void)
+{
+	struct dentry *root;
+	int ret, i;
+
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++) {
+		spin_lock_init(&used_locks[i].lock);
+		spin_lock_init(&value_locks[i].lock);
+	}
+
+	dedup_entry_cache = kmem_cache_create("tmem_dedup_entry",
+			sizeof(struct dedup_entry), 0, 0, NULL);
+	dedup_value_cache = kmem_cache_create("tmem_dedup_value",
+			sizeof(struct dedup_value), 0, 0, NULL);
+	dedup_data_cache = kmem_cache_create("tmem_dedup_data",
+			PAGE_SIZE, PAGE_SIZE, 0, NULL);
+	if (!dedup_entry_cache || !dedup_value_cache || !dedup_data_cache) {
+		ret = -ENOMEM;
+		goto out_caches;
+	}
+
+	ret = rhashtable_init(&used_pages, &used_pages_params);
+	if (ret)
+		goto out_caches;
+
+	ret = rhltable_init(&used_values, &used_values_params);
+	if (ret)
+		goto out_values;
+
+	register_tmem_backend(&tmem_dedup_ops, NULL);
+	register_tmem_tier_ops(KBUILD_MODNAME, &tmem_dedup_ops);
+
+	root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root)) {
+		pr_err("debugfs directory could not be set up\n");
+		goto out;
+	}
+
+	if (!debugfs_create_file("current_memory", S_IRUGO, root, &current_memory, &atomic_stat_fops) ||
+	    !debugfs_create_file("saved_memory", S_IRUGO, root, NULL, &saved_memory_fops) ||
+	    !debugfs_create_file("stored_pages", S_IRUGO, root, &stored_pages, &atomic_stat_fops) ||
+	    !debugfs_create_file("unique_pages", S_IRUGO, root, &unique_pages, &atomic_stat_fops) ||
+	    !debugfs_create_file("stored_bytes", S_IRUGO, root, &stored_bytes, &atomic_stat_fops) ||
+	    !debugfs_create_file("unique_bytes", S_IRUGO, root, &unique_bytes, &atomic_stat_fops))
+		pr_err("debugfs entry could not be set up\n");
+
+out:
+
+	return 0;
+
+out_values:
+
+	rhashtable_destroy(&used_pages);
+
+out_caches:
+
+	kmem_cache_destroy(dedup_data_cache);
+	kmem_cache_destroy(dedup_value_cache);
+	kmem_cache_destroy(dedup_entry_cache);
+
+	return ret;
+}
+
+
+
+module_init(tmem_dedup_init);
+MODULE_AUTHOR("Aimilios Tsalapatis");
+MODULE_LICENSE("GPL");
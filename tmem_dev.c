@@ -4,7 +4,7 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/device.h>
-#include <linux/semaphore.h>
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/miscdevice.h>
 #include <linux/debugfs.h>
@@ -12,82 +12,176 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/eventfd.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
 
 #include <tmem/tmem_ops.h> 
 
+#include "tmem_dev.h"
+#include "tmem_pool.h"
+#include "tmem_hist.h"
+#include "tmem_trace.h"
+
+struct tmem_ring {
+	/* Both rings live in one vmalloc area, mapped by userspace */
+	void *mem;
+	size_t size;
+	struct tmem_ring_header *sq;
+	struct tmem_ring_header *cq;
+	struct tmem_ring_sqe *sqes;
+	struct tmem_ring_cqe *cqes;
+	/* Our own copies, userspace can scribble over the shared ones */
+	u32 sq_entries;
+	u32 cq_entries;
+	u32 sq_head;
+	u32 cq_tail;
+	wait_queue_head_t wait;
+	struct eventfd_ctx *eventfd;
+};
+
+/* 
+ * Every open file gets its own device, so only the 
+ * threads sharing a file ever wait for each other
+ */
+struct tmem_dev {
+	struct mutex lock;
+	void *buf;
+	u64 flags;
+	u64 generated_size;
+	struct tmem_ring *ring;
+	void *staging;
+	size_t staging_size;
+	/* Every operation of the file goes to this pool */
+	int pool_id;
+	/* The pools this file created, destroyed along with it */
+	DECLARE_BITMAP(pools, TMEM_MAX_POOLS);
+	struct tmem_dev_stats stats;
+};
+
+static void tmem_ring_free(struct tmem_ring *ring)
+{
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+
+	vfree(ring->mem);
+	kfree(ring);
+}
+
 #ifdef CONFIG_DEBUG_FS
-static u64 tmem_put_counter;
-static u64 tmem_get_counter;
-static u64 tmem_control_counter;
-static u64 tmem_invalidate_counter;
-static u64 tmem_generate_counter;
+/* Per-CPU, so that files on different CPUs do not fight over them */
+struct tmem_dev_counters {
+	u64 puts;
+	u64 gets;
+	u64 controls;
+	u64 invalidates;
+	u64 generates;
+	u64 batches;
+	u64 hcall_puts;
+	u64 hcall_gets;
+	u64 hcall_invalidates;
+};
 
-static u64 hcall_put_counter;
-static u64 hcall_get_counter;
-static u64 hcall_invalidate_counter;
+static DEFINE_PER_CPU(struct tmem_dev_counters, counters);
 
-static inline void inc_tmem_put(void){ 
-	tmem_put_counter++; 
+static inline void inc_tmem_put(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.puts++;
+	this_cpu_inc(counters.puts);
 }
 
-static inline void inc_tmem_get(void){ 
-	tmem_get_counter++; 
+static inline void inc_tmem_get(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.gets++;
+	this_cpu_inc(counters.gets);
 }
 
-static inline void inc_tmem_control(void){ 
-	tmem_control_counter++; 
+static inline void inc_tmem_control(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.controls++;
+	this_cpu_inc(counters.controls);
 }
 
-static inline void inc_tmem_invalidate(void){ 
-	tmem_invalidate_counter++; 
+static inline void inc_tmem_invalidate(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.invalidates++;
+	this_cpu_inc(counters.invalidates);
 }
 
 
-static inline void inc_tmem_generate(void){ 
-	tmem_generate_counter++; 
+static inline void inc_tmem_generate(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.generates++;
+	this_cpu_inc(counters.generates);
 }
 
-static inline void inc_hcall_put(void){ 
-	hcall_put_counter++; 
+static inline void inc_tmem_batch(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.batches++;
+	this_cpu_inc(counters.batches);
 }
 
-static inline void inc_hcall_get(void){ 
-	hcall_get_counter++; 
+static inline void inc_hcall_put(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.hcall_puts++;
+	this_cpu_inc(counters.hcall_puts);
 }
 
-static inline void inc_hcall_invalidate(void){ 
-	hcall_invalidate_counter++; 
+static inline void inc_hcall_get(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.hcall_gets++;
+	this_cpu_inc(counters.hcall_gets);
 }
 
-#else
-static inline void inc_tmem_put(void) {} 
-static inline void inc_tmem_get(void) {} 
-static inline void inc_tmem_control(void) {} 
-static inline void inc_tmem_invalidate(void) {} 
-static inline void inc_tmem_generate(void) {} 
-static inline void inc_hcall_put(void) {} 
-static inline void inc_hcall_get(void) {} 
-static inline void inc_hcall_invalidate(void) {}
+static inline void inc_hcall_invalidate(struct tmem_dev *tmem_dev){ 
+	tmem_dev->stats.hcall_invalidates++;
+	this_cpu_inc(counters.hcall_invalidates);
+}
 
-#endif /* CONFIG_DEBUG_FS */
+/* The file data is the offset of the counter in struct tmem_dev_counters */
+static int counter_get(void *data, u64 *val)
+{
+	size_t offset = (size_t) data;
+	int cpu;
 
+	*val = 0;
+	for_each_possible_cpu(cpu)
+		*val += READ_ONCE(*(u64 *) ((void *) per_cpu_ptr(&counters, cpu) + offset));
 
-struct tmem_dev {
-	void *buf;
-	u64 flags;
-	u64 generated_size;
-};
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(counter_fops, counter_get, NULL, "%llu\n");
 
-struct tmem_dev *tmem_dev;
+#else
+static inline void inc_tmem_put(struct tmem_dev *tmem_dev) { tmem_dev->stats.puts++; }
+static inline void inc_tmem_get(struct tmem_dev *tmem_dev) { tmem_dev->stats.gets++; }
+static inline void inc_tmem_control(struct tmem_dev *tmem_dev) { tmem_dev->stats.controls++; }
+static inline void inc_tmem_invalidate(struct tmem_dev *tmem_dev) { tmem_dev->stats.invalidates++; }
+static inline void inc_tmem_generate(struct tmem_dev *tmem_dev) { tmem_dev->stats.generates++; }
+static inline void inc_tmem_batch(struct tmem_dev *tmem_dev) { tmem_dev->stats.batches++; }
+static inline void inc_hcall_put(struct tmem_dev *tmem_dev) { tmem_dev->stats.hcall_puts++; }
+static inline void inc_hcall_get(struct tmem_dev *tmem_dev) { tmem_dev->stats.hcall_gets++; }
+static inline void inc_hcall_invalidate(struct tmem_dev *tmem_dev) { tmem_dev->stats.hcall_invalidates++; }
+
+#endif /* CONFIG_DEBUG_FS */
 
-/* 
- * This can be removed, if we assign "namespaces" to each 
- * process opening it
- */
-DEFINE_SEMAPHORE(lock); 
 
 int tmem_chrdev_open(struct inode *inode, struct file *filp)
 {
+	struct tmem_dev *tmem_dev;
+
+	/* Allocation and Initialization of the tmem_dev of this file */
+	tmem_dev = kzalloc(sizeof(struct tmem_dev), GFP_KERNEL);
+	if (!tmem_dev)
+		return -ENOMEM;
+
+	tmem_dev->buf = kmalloc(TMEM_MAX, GFP_KERNEL);
+	if (!tmem_dev->buf) {
+		kfree(tmem_dev);
+		return -ENOMEM;
+	}
+
+	mutex_init(&tmem_dev->lock);
+	tmem_dev->flags = 0x00000000;
+	tmem_dev->generated_size = 0;
+	tmem_dev->pool_id = TMEM_POOL_DEFAULT;
+
 	filp->private_data = tmem_dev;
 
 	return 0;
@@ -95,10 +189,21 @@ int tmem_chrdev_open(struct inode *inode, struct file *filp)
 
 int tmem_chrdev_release(struct inode *inode, struct file *filp)
 {
-	/*
-	 * We do not release the device's resources because 
-	 * it's now a singleton;
-	 */
+	struct tmem_dev *tmem_dev = (struct tmem_dev *) filp->private_data;
+	int pool_id;
+
+	for_each_set_bit(pool_id, tmem_dev->pools, TMEM_MAX_POOLS) {
+		tmem_pool_destroy(pool_id);
+		trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+	}
+
+	/* Nobody else can reach the device of this file anymore */
+	if (tmem_dev->ring)
+		tmem_ring_free(tmem_dev->ring);
+
+	vfree(tmem_dev->staging);
+	kfree(tmem_dev->buf);
+	kfree(tmem_dev);
 
 	return 0;
 }
@@ -131,9 +236,10 @@ int tmem_chrdev_put(struct tmem_dev *tmem_dev, struct tmem_put_request put_reque
 	void *key, *value;
 	size_t key_len, value_len;
 	int ret = 0;
+	u32 key_hash;
 
 
-	inc_tmem_put();	
+	inc_tmem_put(tmem_dev);	
 
 	key_len = put_request.key_len;
 	ret = get_key(&key, put_request.key, key_len);
@@ -163,12 +269,15 @@ int tmem_chrdev_put(struct tmem_dev *tmem_dev, struct tmem_put_request put_reque
 	if (flags & TCTRL_DUMMY_BIT)
 		goto put_out;
 
-	if (tmem_put(key, key_len, value, value_len) < 0) {
+	key_hash = tmem_trace_key_hash(tmem_put, key, key_len);
+	ret = tmem_pool_put(tmem_dev->pool_id, key, key_len, value, value_len);
+	trace_tmem_put(KBUILD_MODNAME, tmem_dev->pool_id, key_hash, value_len, ret);
+	if (ret < 0) {
 		pr_debug("TMEM_PUT command failed");
 		ret = -EINVAL;
 	}
 
-	inc_hcall_put();	
+	inc_hcall_put(tmem_dev);	
 
 
 put_out:
@@ -183,9 +292,10 @@ int tmem_chrdev_get(struct tmem_dev *tmem_dev, struct tmem_get_request get_reque
 	void *key, *value;
 	size_t key_len, value_len;
 	int ret = 0;
+	u32 key_hash;
 
 
-	inc_tmem_get();	
+	inc_tmem_get(tmem_dev);	
 
 
 	key_len = get_request.key_len;
@@ -197,9 +307,11 @@ int tmem_chrdev_get(struct tmem_dev *tmem_dev, struct tmem_get_request get_reque
 
 	/* Only actually do the operation if not in dummy or generate mode */
 	if (!(flags & (TCTRL_DUMMY_BIT | TCTRL_GENERATE_BIT))) {
-		ret = tmem_get(key, key_len, value, &value_len); 
+		key_hash = tmem_trace_key_hash(tmem_get, key, key_len);
+		ret = tmem_pool_get(tmem_dev->pool_id, key, key_len, value, &value_len);
+		trace_tmem_get(KBUILD_MODNAME, tmem_dev->pool_id, key_hash, ret ? 0 : value_len, ret);
 
-		inc_hcall_get();	
+		inc_hcall_get(tmem_dev);	
 
 		if (ret < 0 && ret != -EINVAL)
 			goto get_out;
@@ -230,14 +342,15 @@ get_out:
 
 }
 
-int tmem_chrdev_inval(struct tmem_invalidate_request invalidate_request, long flags) {
+int tmem_chrdev_inval(struct tmem_dev *tmem_dev, struct tmem_invalidate_request invalidate_request, long flags) {
 
 	void *key;
 	size_t key_len;
 	int ret;
+	u32 key_hash;
 
 
-	inc_tmem_invalidate();	
+	inc_tmem_invalidate(tmem_dev);	
 
 	key_len = invalidate_request.key_len;
 	ret = get_key(&key, invalidate_request.key, key_len);
@@ -248,9 +361,11 @@ int tmem_chrdev_inval(struct tmem_invalidate_request invalidate_request, long fl
 		goto inval_out;
 
 	
-	tmem_invalidate(key, key_len);
+	key_hash = tmem_trace_key_hash(tmem_invalidate, key, key_len);
+	tmem_pool_invalidate(tmem_dev->pool_id, key, key_len);
+	trace_tmem_invalidate(KBUILD_MODNAME, tmem_dev->pool_id, key_hash, 0, 0);
 
-	inc_hcall_invalidate();	
+	inc_hcall_invalidate(tmem_dev);	
 
 
 inval_out:
@@ -262,10 +377,575 @@ inval_out:
 }
 
 
+/* Returns where [off, off + len) lives in the staging area, if it fits */
+static void *tmem_staged(struct tmem_dev *tmem_dev, unsigned long off, size_t len)
+{
+	if (!tmem_dev->staging || off > tmem_dev->staging_size || 
+	    len > tmem_dev->staging_size - off)
+		return NULL;
+
+	return tmem_dev->staging + off;
+}
+
+/* Same as get_key(), only from the staging area */
+int get_staged_key(struct tmem_dev *tmem_dev, void **local_key, unsigned long off, size_t key_len)
+{
+	void *staged_key, *key;
+
+	staged_key = tmem_staged(tmem_dev, off, key_len);
+	if (!staged_key)
+		return -EINVAL;
+
+	key = kmalloc(max(key_len, sizeof(long)), GFP_KERNEL);
+	if (!key)
+		return -ENOMEM;
+
+	/* 
+	 * Keys are still copied, the index hashes them and must 
+	 * not see them change under it; they are tiny anyway
+	 */
+	memcpy(key, staged_key, key_len);
+
+	if (sizeof(long) > key_len)
+		memset(key + key_len, 0, sizeof(long) - key_len);
+
+	*local_key = key;
+	return 0;
+}
+
+
+int tmem_chrdev_staged_put(struct tmem_dev *tmem_dev, struct tmem_put_request put_request, long flags) {
+
+	void *key, *value;
+	size_t key_len, value_len;
+	int ret = 0;
+	u32 key_hash;
+
+
+	inc_tmem_put(tmem_dev);	
+
+	key_len = put_request.key_len;
+	value_len = put_request.value_len;
+
+	if (value_len > TMEM_MAX) 
+		return -ENOMEM;
+
+	value = tmem_staged(tmem_dev, (unsigned long) put_request.value, value_len);
+	if (!value)
+		return -EINVAL;
+
+	/* If we are in generate mode, the value is not userspace's */
+	if (flags & TCTRL_GENERATE_BIT)
+		value = tmem_dev->buf;
+
+	ret = get_staged_key(tmem_dev, &key, (unsigned long) put_request.key, key_len);
+	if (ret < 0) 
+		return ret;
+
+	/* If the dummy bit is set, skip the actual operation */
+	if (flags & TCTRL_DUMMY_BIT)
+		goto staged_put_out;
+
+	/* The backend takes its copy straight from the staging area */
+	key_hash = tmem_trace_key_hash(tmem_put, key, key_len);
+	ret = tmem_pool_put(tmem_dev->pool_id, key, key_len, value, value_len);
+	trace_tmem_put(KBUILD_MODNAME, tmem_dev->pool_id, key_hash, value_len, ret);
+	if (ret < 0) {
+		pr_debug("TMEM_STAGED_PUT command failed");
+		ret = -EINVAL;
+	}
+
+	inc_hcall_put(tmem_dev);	
+
+
+staged_put_out:
+	kfree(key);
+	
+	return ret;
+}
+
+
+int tmem_chrdev_staged_get(struct tmem_dev *tmem_dev, struct tmem_get_request get_request, long flags) {
+
+	void *key, *value;
+	size_t *value_lenp;
+	size_t key_len, value_len = 0;
+	int ret = 0;
+	u32 key_hash;
+
+
+	inc_tmem_get(tmem_dev);	
+
+	/* The backend may write up to the largest value there is */
+	value = tmem_staged(tmem_dev, (unsigned long) get_request.value, TMEM_MAX);
+	value_lenp = tmem_staged(tmem_dev, (unsigned long) get_request.value_lenp, sizeof(*value_lenp));
+	if (!value || !value_lenp)
+		return -EINVAL;
+
+	key_len = get_request.key_len;
+	ret = get_staged_key(tmem_dev, &key, (unsigned long) get_request.key, key_len);
+	if (ret < 0) 
+		return ret;
+
+	/* Only actually do the operation if not in dummy or generate mode */
+	if (!(flags & (TCTRL_DUMMY_BIT | TCTRL_GENERATE_BIT))) {
+		/* The value lands where the client reads it, no copy_to_user() */
+		key_hash = tmem_trace_key_hash(tmem_get, key, key_len);
+		ret = tmem_pool_get(tmem_dev->pool_id, key, key_len, value, &value_len);
+		trace_tmem_get(KBUILD_MODNAME, tmem_dev->pool_id, key_hash, ret ? 0 : value_len, ret);
+
+		inc_hcall_get(tmem_dev);	
+
+		if (ret < 0 && ret != -EINVAL)
+			goto staged_get_out;
+	}
+
+	if (flags & TCTRL_GENERATE_BIT) {
+		value_len = min_t(size_t, tmem_dev->generated_size, TMEM_MAX);
+		memcpy(value, tmem_dev->buf, value_len);
+	}
+
+	/* In case the key is not in the store, or we are in silent or dummy mode, we return a value of length 0 */
+	if (ret == -EINVAL || (flags & (TCTRL_DUMMY_BIT | TCTRL_SILENT_BIT))) {
+		ret = 0;
+		value_len = 0;
+	} 
+
+	*value_lenp = value_len;
+
+staged_get_out:
+	kfree(key);
+
+	return ret;
+}
+
+int tmem_chrdev_staged_inval(struct tmem_dev *tmem_dev, struct tmem_invalidate_request invalidate_request, long flags) {
+
+	void *key;
+	size_t key_len;
+	int ret;
+	u32 key_hash;
+
+
+	inc_tmem_invalidate(tmem_dev);	
+
+	key_len = invalidate_request.key_len;
+	ret = get_staged_key(tmem_dev, &key, (unsigned long) invalidate_request.key, key_len);
+	if (ret < 0) 
+		return ret;
+	
+	if (!(flags & TCTRL_DUMMY_BIT)) {
+		key_hash = tmem_trace_key_hash(tmem_invalidate, key, key_len);
+		tmem_pool_invalidate(tmem_dev->pool_id, key, key_len);
+		trace_tmem_invalidate(KBUILD_MODNAME, tmem_dev->pool_id, key_hash, 0, 0);
+
+		inc_hcall_invalidate(tmem_dev);	
+	}
+
+	kfree(key);
+
+	return 0;
+}
+
+int tmem_chrdev_staging_setup(struct tmem_dev *tmem_dev, u64 __user *usrsize) {
+
+	void *staging;
+	u64 size;
+
+
+	if (tmem_dev->staging)
+		return -EBUSY;
+
+	if (get_user(size, usrsize))
+		return -EFAULT;
+
+	size = PAGE_ALIGN(size);
+	if (!size || size > TMEM_STAGING_MAX)
+		return -EINVAL;
+
+	staging = vmalloc_user(size);
+	if (!staging)
+		return -ENOMEM;
+
+	tmem_dev->staging_size = size;
+	smp_store_release(&tmem_dev->staging, staging);
+
+	return 0;
+}
+
+int tmem_chrdev_pool_create(struct tmem_dev *tmem_dev, struct tmem_pool_params __user *usrparams) {
+
+	struct tmem_pool_params params;
+	int pool_id;
+
+
+	if (copy_from_user(&params, usrparams, sizeof(params)))
+		return -EFAULT;
+
+	if (params.flags & ~TMEM_POOL_EPHEMERAL)
+		return -EINVAL;
+
+	pool_id = tmem_pool_create(params.limit, params.flags);
+	if (pool_id < 0)
+		return pool_id;
+
+	/* Without pool support in the backend everything is the default pool */
+	if (pool_id != TMEM_POOL_DEFAULT)
+		set_bit(pool_id, tmem_dev->pools);
+
+	return pool_id;
+}
+
+int tmem_chrdev_pool(struct tmem_dev *tmem_dev, unsigned int cmd, __s32 __user *usrpool) {
+
+	__s32 pool_id;
+	int ret;
+
+
+	if (get_user(pool_id, usrpool))
+		return -EFAULT;
+
+	if (pool_id < 0 || pool_id >= TMEM_MAX_POOLS)
+		return -EINVAL;
+
+	/* Other pools belong to other files, or to frontswap and cleancache */
+	if (pool_id != TMEM_POOL_DEFAULT && !test_bit(pool_id, tmem_dev->pools) &&
+	    cmd != TMEM_POOL_DESTROY)
+		return -EPERM;
+
+	switch (cmd) {
+	case TMEM_POOL_SELECT:
+
+		tmem_dev->pool_id = pool_id;
+		return 0;
+
+	case TMEM_POOL_FLUSH:
+
+		if (tmem_dev->flags & TCTRL_DUMMY_BIT)
+			return 0;
+
+		ret = tmem_pool_invalidate_all(pool_id);
+		if (!ret)
+			trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+		return ret;
+
+	case TMEM_POOL_DESTROY:
+
+		/* Files only get to destroy the pools they created */
+		if (!test_and_clear_bit(pool_id, tmem_dev->pools))
+			return -EPERM;
+
+		tmem_pool_destroy(pool_id);
+		trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+		if (tmem_dev->pool_id == pool_id)
+			tmem_dev->pool_id = TMEM_POOL_DEFAULT;
+		return 0;
+	}
+
+	return -ENOSYS;
+}
+
+
+/* Time spent on every operation of the device, copies included */
+static DEFINE_PER_CPU(struct tmem_hists, latency);
+
+static int __tmem_chrdev_dispatch(struct tmem_dev *tmem_dev, u32 cmd, struct tmem_request *request, long flags) {
+
+	switch (cmd) {
+	case TMEM_GET:
+		return tmem_chrdev_get(tmem_dev, request->get, flags);
+
+	case TMEM_PUT:
+		return tmem_chrdev_put(tmem_dev, request->put, flags);
+
+	case TMEM_INVAL:
+		return tmem_chrdev_inval(tmem_dev, request->inval, flags);
+
+	case TMEM_STAGED_GET:
+		return tmem_chrdev_staged_get(tmem_dev, request->get, flags);
+
+	case TMEM_STAGED_PUT:
+		return tmem_chrdev_staged_put(tmem_dev, request->put, flags);
+
+	case TMEM_STAGED_INVAL:
+		return tmem_chrdev_staged_inval(tmem_dev, request->inval, flags);
+
+	default:
+		return -ENOSYS;
+	}
+}
+
+/* Runs one operation, on its own or coming from a batch or a ring */
+int tmem_chrdev_dispatch(struct tmem_dev *tmem_dev, u32 cmd, struct tmem_request *request, long dev_flags) {
+
+	u64 start = ktime_get_ns();
+	long flags;
+	int ret;
+
+	/* Same as for single operations, a nonzero flags argument overrides the device */
+	flags = request->flags ? request->flags : dev_flags;
+
+	ret = __tmem_chrdev_dispatch(tmem_dev, cmd, request, flags);
+
+	if (cmd == TMEM_GET || cmd == TMEM_STAGED_GET)
+		tmem_hist_record(&latency, TMEM_HIST_GET, start);
+	else if (cmd == TMEM_PUT || cmd == TMEM_STAGED_PUT)
+		tmem_hist_record(&latency, TMEM_HIST_PUT, start);
+	else if (cmd == TMEM_INVAL || cmd == TMEM_STAGED_INVAL)
+		tmem_hist_record(&latency, TMEM_HIST_INVALIDATE, start);
+
+	return ret;
+}
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	return tmem_hist_show(m, &latency);
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+
+/* Operations are copied in from userspace this many at a time */
+#define TMEM_BATCH_CHUNK (32)
+
+int tmem_chrdev_batch(struct tmem_dev *tmem_dev, struct tmem_batch __user *usrbatch, long dev_flags) {
+
+	struct tmem_batch batch;
+	struct tmem_batch_op *ops;
+	struct tmem_batch_op __user *usrops;
+	s32 __user *usrresults;
+	s32 results[TMEM_BATCH_CHUNK];
+	size_t i, j, nr;
+	int ret;
+
+
+	inc_tmem_batch(tmem_dev);
+
+	if (copy_from_user(&batch, usrbatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.nr_ops > TMEM_BATCH_MAX)
+		return -EINVAL;
+
+	usrops = u64_to_user_ptr(batch.ops);
+	usrresults = u64_to_user_ptr(batch.results);
+
+	ops = kmalloc_array(TMEM_BATCH_CHUNK, sizeof(*ops), GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+
+	for (i = 0; i < batch.nr_ops; i += nr) {
+		nr = min_t(size_t, batch.nr_ops - i, TMEM_BATCH_CHUNK);
+
+		if (copy_from_user(ops, usrops + i, nr * sizeof(*ops))) {
+			ret = -EFAULT;
+			goto batch_out;
+		}
+
+		for (j = 0; j < nr; j++)
+			results[j] = tmem_chrdev_dispatch(tmem_dev, ops[j].cmd, &ops[j].request, dev_flags);
+
+		if (copy_to_user(usrresults + i, results, nr * sizeof(*results))) {
+			ret = -EFAULT;
+			goto batch_out;
+		}
+	}
+
+	ret = i;
+
+batch_out:
+
+	kfree(ops);
+
+	return ret;
+}
+
+
+int tmem_chrdev_ring_setup(struct tmem_dev *tmem_dev, struct tmem_ring_params __user *usrparams) {
+
+	struct tmem_ring_params params;
+	struct tmem_ring *ring;
+	int ret;
+
+
+	if (tmem_dev->ring)
+		return -EBUSY;
+
+	if (copy_from_user(&params, usrparams, sizeof(params)))
+		return -EFAULT;
+
+	if (!params.sq_entries || params.sq_entries > TMEM_RING_MAX_ENTRIES)
+		return -EINVAL;
+
+	if (!params.cq_entries)
+		params.cq_entries = params.sq_entries * 2;
+
+	if (params.cq_entries > TMEM_RING_MAX_ENTRIES * 2)
+		return -EINVAL;
+
+	params.sq_entries = roundup_pow_of_two(params.sq_entries);
+	params.cq_entries = roundup_pow_of_two(params.cq_entries);
+
+	/* The headers get a cache line each, since the two sides write to them */
+	params.sq_off = 0;
+	params.cq_off = SMP_CACHE_BYTES;
+	params.sqes_off = 2 * SMP_CACHE_BYTES;
+	params.cqes_off = params.sqes_off + 
+		L1_CACHE_ALIGN(params.sq_entries * sizeof(struct tmem_ring_sqe));
+	params.size = PAGE_ALIGN(params.cqes_off + 
+		params.cq_entries * sizeof(struct tmem_ring_cqe));
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->mem = vmalloc_user(params.size);
+	if (!ring->mem) {
+		ret = -ENOMEM;
+		goto setup_err;
+	}
+
+	if (params.eventfd != -1) {
+		ring->eventfd = eventfd_ctx_fdget(params.eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			ret = PTR_ERR(ring->eventfd);
+			ring->eventfd = NULL;
+			goto setup_err;
+		}
+	}
+
+	ring->size = params.size;
+	ring->sq = ring->mem + params.sq_off;
+	ring->cq = ring->mem + params.cq_off;
+	ring->sqes = ring->mem + params.sqes_off;
+	ring->cqes = ring->mem + params.cqes_off;
+	ring->sq_entries = params.sq_entries;
+	ring->cq_entries = params.cq_entries;
+	init_waitqueue_head(&ring->wait);
+
+	if (copy_to_user(usrparams, &params, sizeof(params))) {
+		ret = -EFAULT;
+		goto setup_err;
+	}
+
+	smp_store_release(&tmem_dev->ring, ring);
+
+	return 0;
+
+setup_err:
+
+	tmem_ring_free(ring);
+
+	return ret;
+}
+
+int tmem_chrdev_enter(struct tmem_dev *tmem_dev, struct tmem_ring_enter __user *usrenter, long dev_flags) {
+
+	struct tmem_ring *ring = tmem_dev->ring;
+	struct tmem_ring_enter enter;
+	struct tmem_ring_sqe sqe;
+	struct tmem_ring_cqe *cqe;
+	u32 sq_tail, submitted = 0;
+	int res;
+
+
+	if (!ring)
+		return -ENXIO;
+
+	if (copy_from_user(&enter, usrenter, sizeof(enter)))
+		return -EFAULT;
+
+	sq_tail = smp_load_acquire(&ring->sq->tail);
+
+	while (submitted < enter.to_submit && ring->sq_head != sq_tail) {
+		/* Every submission needs a free completion slot */
+		if (ring->cq_tail - smp_load_acquire(&ring->cq->head) >= ring->cq_entries)
+			break;
+
+		/* Userspace can keep writing to the ring, so work on a copy */
+		sqe = ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+		ring->sq_head++;
+
+		res = tmem_chrdev_dispatch(tmem_dev, sqe.cmd, &sqe.request, dev_flags);
+
+		cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+		cqe->user_data = sqe.user_data;
+		cqe->res = res;
+		ring->cq_tail++;
+
+		/* Reapers in other threads can start on it right away */
+		smp_store_release(&ring->cq->tail, ring->cq_tail);
+
+		submitted++;
+	}
+
+	smp_store_release(&ring->sq->head, ring->sq_head);
+
+	if (submitted) {
+		wake_up_interruptible(&ring->wait);
+		if (ring->eventfd)
+			eventfd_signal(ring->eventfd, 1);
+	}
+
+	return submitted;
+}
+
+int tmem_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct tmem_dev *tmem_dev = (struct tmem_dev *) filp->private_data;
+	size_t size = vma->vm_end - vma->vm_start;
+	struct tmem_ring *ring;
+	void *staging;
+
+	/* The offset picks what gets mapped: the rings, or the staging area */
+	switch (vma->vm_pgoff) {
+	case 0:
+		ring = smp_load_acquire(&tmem_dev->ring);
+		if (!ring)
+			return -ENXIO;
+
+		if (size > ring->size)
+			return -EINVAL;
+
+		return remap_vmalloc_range(vma, ring->mem, 0);
+
+	case TMEM_STAGING_OFF >> PAGE_SHIFT:
+		staging = smp_load_acquire(&tmem_dev->staging);
+		if (!staging)
+			return -ENXIO;
+
+		if (size > tmem_dev->staging_size)
+			return -EINVAL;
+
+		return remap_vmalloc_range(vma, staging, 0);
+
+	default:
+		return -EINVAL;
+	}
+}
+
+__poll_t tmem_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	struct tmem_dev *tmem_dev = (struct tmem_dev *) filp->private_data;
+	struct tmem_ring *ring = smp_load_acquire(&tmem_dev->ring);
+	__poll_t mask = 0;
+
+	if (!ring)
+		return EPOLLERR;
+
+	poll_wait(filp, &ring->wait, wait);
+
+	/* Completions are waiting to be reaped */
+	if (READ_ONCE(ring->cq->head) != READ_ONCE(ring->cq_tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+
 long tmem_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct tmem_dev *tmem_dev;
-	struct tmem_request tmem_request;
+	struct tmem_request tmem_request = { .flags = 0 };
 	long __user * usrflags;
 	size_t __user *usrgensize;
 	size_t gensize;
@@ -274,15 +954,18 @@ long tmem_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	tmem_dev = (struct tmem_dev *) filp->private_data;
 
-	if (down_trylock(&lock)) {
-		return -EBUSY;
-	}
+	/* Only threads sharing this file can be holding it */
+	if (mutex_lock_interruptible(&tmem_dev->lock))
+		return -ERESTARTSYS;
 
 
 	/* There only is a request for calls corresponding to real tmem ops*/
-	if (cmd != TMEM_GENERATE_SIZE && cmd != TMEM_CONTROL) { 
-		if (copy_from_user(&tmem_request, (struct tmem_request *) arg, sizeof(tmem_request))) 
-			return -ERESTARTSYS;	
+	if (cmd == TMEM_GET || cmd == TMEM_PUT || cmd == TMEM_INVAL || 
+	    cmd == TMEM_STAGED_GET || cmd == TMEM_STAGED_PUT || cmd == TMEM_STAGED_INVAL) { 
+		if (copy_from_user(&tmem_request, (struct tmem_request *) arg, sizeof(tmem_request))) {
+			ret = -ERESTARTSYS;	
+			goto ioctl_out;
+		}
 	} 
 
 	/* If the request has a nonzero flags argument, override the settings of the device */
@@ -299,22 +982,60 @@ long tmem_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	switch (cmd) {
 	case TMEM_GET:	
-	
-		ret = tmem_chrdev_get(tmem_dev, tmem_request.get, flags);
+	case TMEM_PUT:
+	case TMEM_INVAL:
+	case TMEM_STAGED_GET:
+	case TMEM_STAGED_PUT:
+	case TMEM_STAGED_INVAL:
+
+		ret = tmem_chrdev_dispatch(tmem_dev, cmd, &tmem_request, flags);
 		goto ioctl_out;
 
-	case TMEM_PUT:
+	case TMEM_STAGING_SETUP:
 
-		ret = tmem_chrdev_put(tmem_dev, tmem_request.put, flags);
+		ret = tmem_chrdev_staging_setup(tmem_dev, (u64 __user *) arg);
 		goto ioctl_out;
 
-	case TMEM_INVAL:
+	case TMEM_POOL_CREATE:
+
+		ret = tmem_chrdev_pool_create(tmem_dev, (struct tmem_pool_params __user *) arg);
+		goto ioctl_out;
+
+	case TMEM_POOL_SELECT:
+	case TMEM_POOL_FLUSH:
+	case TMEM_POOL_DESTROY:
+
+		ret = tmem_chrdev_pool(tmem_dev, cmd, (__s32 __user *) arg);
+		goto ioctl_out;
+
+	case TMEM_BATCH:
+
+		ret = tmem_chrdev_batch(tmem_dev, (struct tmem_batch __user *) arg, flags);
+		goto ioctl_out;
+
+	case TMEM_RING_SETUP:
 
-		ret = tmem_chrdev_inval(tmem_request.inval, flags);
+		ret = tmem_chrdev_ring_setup(tmem_dev, (struct tmem_ring_params __user *) arg);
+		goto ioctl_out;
+
+	case TMEM_ENTER:
+
+		ret = tmem_chrdev_enter(tmem_dev, (struct tmem_ring_enter __user *) arg, flags);
+		goto ioctl_out;
+
+	case TMEM_GET_STATS:
+
+		/* The flags and generated size are only visible from here now */
+		tmem_dev->stats.flags = tmem_dev->flags;
+		tmem_dev->stats.generated_size = tmem_dev->generated_size;
+		tmem_dev->stats.pool_id = tmem_dev->pool_id;
+
+		if (copy_to_user((struct tmem_dev_stats __user *) arg, &tmem_dev->stats, sizeof(tmem_dev->stats)))
+			ret = -EFAULT;
 		goto ioctl_out;
 
 	case TMEM_CONTROL:
-		inc_tmem_control();	
+		inc_tmem_control(tmem_dev);	
 
 		usrflags = (__user long *) arg;
 		ret = get_user(flags, usrflags);
@@ -353,7 +1074,7 @@ long tmem_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		goto ioctl_out;
 
 	case TMEM_GENERATE_SIZE:
-		inc_tmem_generate();	
+		inc_tmem_generate(tmem_dev);	
 
 		usrgensize = (__user size_t *) arg;
 		ret = get_user(gensize, usrgensize);
@@ -376,7 +1097,7 @@ long tmem_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 
 ioctl_out:
-	up(&lock);
+	mutex_unlock(&tmem_dev->lock);
 
 	return ret;
 }
@@ -386,6 +1107,8 @@ const struct file_operations tmem_fops = {
 	.open = tmem_chrdev_open,
 	.release = tmem_chrdev_release,
 	.unlocked_ioctl = tmem_chrdev_ioctl,
+	.mmap = tmem_chrdev_mmap,
+	.poll = tmem_chrdev_poll,
 };
 
 
@@ -402,24 +1125,8 @@ static int __init init_func(void)
 	int ret = 0;
 	struct dentry *root; 
 
-	pr_err("IOCTL Numbers for get, put, invalidate, control: %lu %lu %lu %lu\n",
-		TMEM_GET, TMEM_PUT, TMEM_INVAL, TMEM_CONTROL);
-
-	/* Allocation and Initialization of the global tmem_dev, shared among files */
-	tmem_dev = kmalloc(sizeof(struct tmem_dev), GFP_KERNEL);
-	if (!tmem_dev) {
-		return -ENOMEM;
-	}
-
-	tmem_dev->buf = kmalloc(TMEM_MAX, GFP_KERNEL);
-	if (!tmem_dev->buf) {
-		kfree(tmem_dev);
-		return -ENOMEM;
-	}
-
-	tmem_dev->flags = 0x00000000;
-	tmem_dev->generated_size = 0;
-
+	pr_err("IOCTL Numbers for get, put, invalidate, control, batch: %lu %lu %lu %lu %lu\n",
+		TMEM_GET, TMEM_PUT, TMEM_INVAL, TMEM_CONTROL, (unsigned long) TMEM_BATCH);
 
 	/* Device registration */
 	ret = misc_register(&tmem_chrdev);
@@ -430,19 +1137,28 @@ static int __init init_func(void)
 #ifdef CONFIG_DEBUG_FS
 	
 	root = debugfs_create_dir("tmem_dev", NULL);
-	if (!root) 
+	if (IS_ERR_OR_NULL(root)) 
 		goto debugfs_err;
 
-	debugfs_create_u64("puts", S_IRUGO, root, &tmem_put_counter);
-	debugfs_create_u64("gets", S_IRUGO, root, &tmem_get_counter);
-	debugfs_create_u64("invalidates", S_IRUGO, root, &tmem_invalidate_counter);
-	debugfs_create_u64("controls", S_IRUGO, root, &tmem_control_counter);
-	debugfs_create_u64("generates", S_IRUGO, root, &tmem_generate_counter);
-	debugfs_create_u64("hcall_puts", S_IRUGO, root, &hcall_put_counter);
-	debugfs_create_u64("hcall_gets", S_IRUGO, root, &hcall_get_counter);
-	debugfs_create_u64("hcall_invalidates", S_IRUGO, root, &hcall_invalidate_counter);
-	debugfs_create_x64("flags", S_IRUGO, root, &tmem_dev->flags);
-	debugfs_create_u64("gensize", S_IRUGO, root, &tmem_dev->generated_size);
+	debugfs_create_file("puts", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, puts), &counter_fops);
+	debugfs_create_file("gets", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, gets), &counter_fops);
+	debugfs_create_file("invalidates", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, invalidates), &counter_fops);
+	debugfs_create_file("controls", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, controls), &counter_fops);
+	debugfs_create_file("generates", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, generates), &counter_fops);
+	debugfs_create_file("batches", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, batches), &counter_fops);
+	debugfs_create_file("hcall_puts", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, hcall_puts), &counter_fops);
+	debugfs_create_file("hcall_gets", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, hcall_gets), &counter_fops);
+	debugfs_create_file("hcall_invalidates", S_IRUGO, root, 
+		(void *) offsetof(struct tmem_dev_counters, hcall_invalidates), &counter_fops);
+	debugfs_create_file("latency", S_IRUGO, root, NULL, &latency_fops);
 
 #endif /* CONFIG_DEBUG_FS */
 
@@ -464,8 +1180,6 @@ register_err:
 static void __exit exit_func(void)
 {
 	misc_deregister(&tmem_chrdev);
-	kfree(tmem_dev->buf);
-	kfree(tmem_dev);
 }
 
 
@@ -0,0 +1,157 @@
+#ifndef _TMEM_DEV_H
+#define _TMEM_DEV_H
+
+/*
+ * Extensions to the /dev/tmem_dev interface, on top of the
+ * requests and ioctls defined in tmem/tmem_ops.h
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#include <tmem/tmem_ops.h>
+
+#define TMEM_DEV_IOC_MAGIC (0xB7)
+
+/* Maximum number of operations in a single TMEM_BATCH call */
+#define TMEM_BATCH_MAX (1024)
+
+/*
+ * One operation of a batch, in the same format as the single operation
+ * ioctls; cmd is TMEM_GET, TMEM_PUT or TMEM_INVAL
+ */
+struct tmem_batch_op {
+	__u32 cmd;
+	__u32 pad;
+	struct tmem_request request;
+};
+
+/*
+ * The operations are executed in order, and the status of each one is
+ * written in the matching slot of results. The ioctl itself returns the
+ * number of operations executed, or an error if the batch was unusable
+ */
+struct tmem_batch {
+	__u64 nr_ops;
+	__u64 ops;		/* struct tmem_batch_op * */
+	__u64 results;		/* __s32 * */
+};
+
+#define TMEM_BATCH _IOW(TMEM_DEV_IOC_MAGIC, 0x01, struct tmem_batch)
+
+/*
+ * Submission and completion rings, shared with the kernel through mmap().
+ *
+ * Userspace fills the submission entry at sqes[tail & (sq_entries - 1)]
+ * and then publishes it by advancing the submission tail; the kernel
+ * consumes entries on TMEM_ENTER and advances the submission head. The
+ * kernel posts a completion for every submission at the completion tail,
+ * and userspace advances the completion head once it has reaped it.
+ * Heads and tails are free running counters.
+ */
+#define TMEM_RING_MAX_ENTRIES (4096)
+
+struct tmem_ring_header {
+	__u32 head;
+	__u32 tail;
+};
+
+struct tmem_ring_sqe {
+	__u32 cmd;		/* TMEM_GET, TMEM_PUT or TMEM_INVAL */
+	__u32 pad;
+	__u64 user_data;	/* Passed back untouched in the completion */
+	struct tmem_request request;
+};
+
+struct tmem_ring_cqe {
+	__u64 user_data;
+	__s32 res;
+	__u32 pad;
+};
+
+/*
+ * Entry counts are rounded up to a power of two, and a zero cq_entries
+ * means twice sq_entries. If eventfd is not -1, it gets signalled every
+ * time completions are posted. The kernel fills in the offsets of the
+ * ring parts, and the size to mmap() at offset 0
+ */
+struct tmem_ring_params {
+	__u32 sq_entries;
+	__u32 cq_entries;
+	__s32 eventfd;
+	__u32 pad;
+	__u64 sq_off;
+	__u64 cq_off;
+	__u64 sqes_off;
+	__u64 cqes_off;
+	__u64 size;
+};
+
+/* Returns the number of submissions consumed */
+struct tmem_ring_enter {
+	__u32 to_submit;
+	__u32 pad;
+};
+
+#define TMEM_RING_SETUP _IOWR(TMEM_DEV_IOC_MAGIC, 0x02, struct tmem_ring_params)
+#define TMEM_ENTER _IOW(TMEM_DEV_IOC_MAGIC, 0x03, struct tmem_ring_enter)
+
+/*
+ * A staging area private to each open file, mapped with mmap() at
+ * TMEM_STAGING_OFF. The TMEM_STAGED_* operations take the same requests
+ * as TMEM_GET, TMEM_PUT and TMEM_INVAL, except that every pointer in
+ * them is an offset into the staging area; values are then read and
+ * written by the backend in place, without going through a bounce
+ * buffer. A get needs room for TMEM_MAX bytes at its value offset.
+ * They can also be used as the cmd of batched and ring operations
+ */
+#define TMEM_STAGING_MAX (64UL << 20)
+#define TMEM_STAGING_OFF (1ULL << 32)
+
+/* Takes the size of the staging area, rounded up to whole pages */
+#define TMEM_STAGING_SETUP _IOW(TMEM_DEV_IOC_MAGIC, 0x04, __u64)
+
+#define TMEM_STAGED_GET _IOW(TMEM_DEV_IOC_MAGIC, 0x05, struct tmem_request)
+#define TMEM_STAGED_PUT _IOW(TMEM_DEV_IOC_MAGIC, 0x06, struct tmem_request)
+#define TMEM_STAGED_INVAL _IOW(TMEM_DEV_IOC_MAGIC, 0x07, struct tmem_request)
+
+/* Counters of one open file, along with its current settings */
+struct tmem_dev_stats {
+	__u64 puts;
+	__u64 gets;
+	__u64 invalidates;
+	__u64 controls;
+	__u64 generates;
+	__u64 batches;
+	__u64 hcall_puts;
+	__u64 hcall_gets;
+	__u64 hcall_invalidates;
+	__u64 flags;
+	__u64 generated_size;
+	__u64 pool_id;
+};
+
+#define TMEM_GET_STATS _IOR(TMEM_DEV_IOC_MAGIC, 0x08, struct tmem_dev_stats)
+
+/*
+ * Pools, see tmem_pool.h. Every open file starts on the default pool, and
+ * all of its operations go to the pool it last selected. TMEM_POOL_CREATE
+ * takes a memory limit in bytes (0 for the backend default) and the pool
+ * flags, and returns the id of the new pool; pools are destroyed along
+ * with the file that created them, and only that file can select, flush
+ * or destroy them; other files get -EPERM. The default pool is shared by
+ * everybody, so it cannot be flushed or destroyed (-EPERM), and neither
+ * can anything when the backend has no pools (-EOPNOTSUPP)
+ */
+struct tmem_pool_params {
+	__u64 limit;
+	__u32 flags;		/* TMEM_POOL_EPHEMERAL */
+	__u32 pad;
+};
+
+#define TMEM_POOL_CREATE _IOW(TMEM_DEV_IOC_MAGIC, 0x09, struct tmem_pool_params)
+#define TMEM_POOL_SELECT _IOW(TMEM_DEV_IOC_MAGIC, 0x0A, __s32)
+#define TMEM_POOL_FLUSH _IOW(TMEM_DEV_IOC_MAGIC, 0x0B, __s32)
+#define TMEM_POOL_DESTROY _IOW(TMEM_DEV_IOC_MAGIC, 0x0C, __s32)
+
+#endif /* _TMEM_DEV_H */
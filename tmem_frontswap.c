@@ -7,48 +7,133 @@
 #include <linux/list.h>
 #include <linux/hashtable.h>
 #include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/percpu.h>
+#include <linux/mempool.h>
+#include <linux/seq_file.h>
 
 #include <tmem/tmem_ops.h>
 
+#include "tmem_pool.h"
+#include "tmem_hist.h"
+#include "tmem_trace.h"
+
 /* 
- * This is needed because we need to pass values held in the kernel's 
- * pages to the tmem_* functions, and offset is in the stack
+ * Keys have to be passed to the tmem_* functions in memory the backend 
+ * can translate, and the stack is not. Stores and loads may sleep in the 
+ * backend, so each one gets a key of its own from a mempool: a load that 
+ * failed for lack of memory would lose the page, since it is not on disk
  */
-static pgoff_t *key;
+struct tmem_frontswap_key {
+	u32 type;
+	u32 pad;
+	u64 offset;
+};
+
+#define TMEM_FRONTSWAP_MIN_KEYS (64)
+
+static struct kmem_cache *key_cache;
+static mempool_t *key_pool;
+
+/* Invalidations come with the swap device locked and cannot sleep */
+static DEFINE_PER_CPU(struct tmem_frontswap_key, inval_keys);
+
+static struct tmem_frontswap_key *tmem_frontswap_key(unsigned int type, pgoff_t offset)
+{
+	/* Waits for a key to come back rather than fail */
+	struct tmem_frontswap_key *key = mempool_alloc(key_pool, GFP_NOIO);
+
+	key->type = type;
+	key->pad = 0;
+	key->offset = offset;
+
+	return key;
+}
+
+/* Every swap device gets its own pool, so swapoff only flushes its own pages */
+static int pools[MAX_SWAPFILES];
+
+/* Time spent on each swap operation, key setup and waits included */
+static DEFINE_PER_CPU(struct tmem_hists, latency);
 
 static int tmem_frontswap_store(unsigned int type, pgoff_t offset,
 				struct page *page)
 {
+	u32 key_hash;
 	void *value= (void *) page_address(page);
+	struct tmem_frontswap_key *key;
+	u64 start = ktime_get_ns();
+	int ret;
 
-	memcpy(key, &offset, sizeof(offset));
-	return tmem_put(key, sizeof(key), value, PAGE_SIZE);
+	key = tmem_frontswap_key(type, offset);
+	key_hash = tmem_trace_key_hash(tmem_put, key, sizeof(*key));
+	ret = tmem_pool_put(pools[type], key, sizeof(*key), value, PAGE_SIZE);
+	trace_tmem_put(KBUILD_MODNAME, pools[type], key_hash, PAGE_SIZE, ret);
+	mempool_free(key, key_pool);
+
+	tmem_hist_record(&latency, TMEM_HIST_PUT, start);
+
+	return ret;
 }
 
 static int tmem_frontswap_load(unsigned int type, pgoff_t offset,
 				struct page *page)
 {
+	u32 key_hash;
 	void *value= (void *) page_address(page);
 	/* In frontswap we already know the length of the value*/
 	size_t ignored;
+	struct tmem_frontswap_key *key;
+	u64 start = ktime_get_ns();
+	int ret;
+
+	key = tmem_frontswap_key(type, offset);
+	key_hash = tmem_trace_key_hash(tmem_get, key, sizeof(*key));
+	ret = tmem_pool_get(pools[type], key, sizeof(*key), value, &ignored);
+	trace_tmem_get(KBUILD_MODNAME, pools[type], key_hash, ret ? 0 : ignored, ret);
+	mempool_free(key, key_pool);
 
-	memcpy(key, &offset, sizeof(offset));
-	return tmem_get(key, sizeof(key), value, &ignored);
+	tmem_hist_record(&latency, TMEM_HIST_GET, start);
+
+	return ret;
 }
 
 static void tmem_frontswap_invalidate_page(unsigned int type, pgoff_t offset)
 {
-	memcpy(key, &offset, sizeof(offset));
-	tmem_invalidate(key, sizeof(key));
+	u32 key_hash;
+	struct tmem_frontswap_key *key;
+	u64 start = ktime_get_ns();
+
+	key = get_cpu_ptr(&inval_keys);
+	key->type = type;
+	key->pad = 0;
+	key->offset = offset;
+	key_hash = tmem_trace_key_hash(tmem_invalidate, key, sizeof(*key));
+	tmem_pool_invalidate(pools[type], key, sizeof(*key));
+	trace_tmem_invalidate(KBUILD_MODNAME, pools[type], key_hash, 0, 0);
+	tmem_hist_record(&latency, TMEM_HIST_INVALIDATE, start);
+	put_cpu_ptr(&inval_keys);
 }
 
 static void tmem_frontswap_invalidate_area(unsigned int type)
 {
-	tmem_invalidate_area();
+	tmem_pool_destroy(pools[type]);
+	trace_tmem_invalidate_area(KBUILD_MODNAME, pools[type]);
+	pools[type] = TMEM_POOL_DEFAULT;
 }
 
-static void tmem_frontswap_init(unsigned int ignored)
+static void tmem_frontswap_init(unsigned int type)
 {
+	int pool_id;
+
+	/* Fall back to sharing the default pool, stores still work there */
+	pool_id = tmem_pool_create(0, 0);
+	if (pool_id < 0) {
+		pr_err("could not create a pool for swap device %u\n", type);
+		pool_id = TMEM_POOL_DEFAULT;
+	}
+
+	pools[type] = pool_id;
 }
 
 static struct frontswap_ops tmem_frontswap_ops = {
@@ -59,16 +144,33 @@ static struct frontswap_ops tmem_frontswap_ops = {
 	.init = tmem_frontswap_init,
 };
 
+static int latency_show(struct seq_file *m, void *v)
+{
+	return tmem_hist_show(m, &latency);
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
 static int __init tmem_init(void)
 {
-	key = kmalloc(sizeof(*key), GFP_KERNEL);
-	if (!key)
+	struct dentry *root;
+
+	key_cache = KMEM_CACHE(tmem_frontswap_key, 0);
+	if (!key_cache)
+		return -ENOMEM;
+
+	key_pool = mempool_create_slab_pool(TMEM_FRONTSWAP_MIN_KEYS, key_cache);
+	if (!key_pool) {
+		kmem_cache_destroy(key_cache);
 		return -ENOMEM;
+	}
 
 	frontswap_writethrough(false);
 	frontswap_register_ops(&tmem_frontswap_ops);
 	pr_debug("registration successful");
 
+	root = debugfs_create_dir("tmem_frontswap", NULL);
+	if (IS_ERR_OR_NULL(root) || !debugfs_create_file("latency", S_IRUGO, root, NULL, &latency_fops))
+		pr_err("debugfs entry could not be set up\n");
 
 	return 0;
 }
@@ -0,0 +1,80 @@
+#ifndef _TMEM_HIST_H
+#define _TMEM_HIST_H
+
+/*
+ * Per-CPU latency histograms for put, get and invalidate. Bucket i counts
+ * the operations that took [2^i, 2^(i+1)) nanoseconds, and the CPUs are
+ * only summed up when the histograms get read
+ */
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#define TMEM_HIST_BUCKETS (32)
+
+enum tmem_hist_op {
+	TMEM_HIST_PUT,
+	TMEM_HIST_GET,
+	TMEM_HIST_INVALIDATE,
+	TMEM_HIST_OPS,
+};
+
+struct tmem_hist {
+	u64 buckets[TMEM_HIST_BUCKETS];
+	u64 sum;
+};
+
+struct tmem_hists {
+	struct tmem_hist ops[TMEM_HIST_OPS];
+};
+
+static inline void tmem_hist_record(struct tmem_hists __percpu *hists, enum tmem_hist_op op, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), TMEM_HIST_BUCKETS - 1) : 0;
+
+	this_cpu_inc(hists->ops[op].buckets[bucket]);
+	this_cpu_add(hists->ops[op].sum, ns);
+}
+
+/* One line per operation with its count and mean, then every nonempty bucket */
+static inline int tmem_hist_show(struct seq_file *m, struct tmem_hists __percpu *hists)
+{
+	static const char * const names[TMEM_HIST_OPS] = { "put", "get", "invalidate" };
+	u64 buckets[TMEM_HIST_BUCKETS];
+	struct tmem_hist *hist;
+	u64 count, sum;
+	int op, cpu, i;
+
+	for (op = 0; op < TMEM_HIST_OPS; op++) {
+		memset(buckets, 0, sizeof(buckets));
+		count = sum = 0;
+
+		for_each_possible_cpu(cpu) {
+			hist = &per_cpu_ptr(hists, cpu)->ops[op];
+			for (i = 0; i < TMEM_HIST_BUCKETS; i++)
+				buckets[i] += READ_ONCE(hist->buckets[i]);
+			sum += READ_ONCE(hist->sum);
+		}
+
+		for (i = 0; i < TMEM_HIST_BUCKETS; i++)
+			count += buckets[i];
+
+		seq_printf(m, "%s %llu %llu\n", names[op], count, count ? div64_u64(sum, count) : 0);
+
+		for (i = 0; i < TMEM_HIST_BUCKETS; i++) {
+			if (buckets[i])
+				seq_printf(m, "  %llu %llu\n", 1ULL << i, buckets[i]);
+		}
+	}
+
+	return 0;
+}
+
+#endif /* _TMEM_HIST_H */
@@ -8,74 +8,502 @@
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/jhash.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
 #include <asm/page.h>
 
 #include <tmem/tmem_ops.h> 
 #include <uapi/linux/kvm_para.h>
 
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
 
 #define TMEM_POOL_SIZE (64 * 1024 * 1024) 
 
 
 static u64 current_memory; 
-static struct tmem_request request;
 
-static struct page *page = NULL;
-static size_t *value_len_ptr = NULL;
+/* 
+ * What the host reads on a hypercall. Every CPU has its own page for it, 
+ * filled in and handed over with preemption disabled, so that vCPUs can 
+ * all be in a hypercall at the same time
+ */
+struct tmem_kvm_params {
+	struct tmem_request request;
+	size_t value_len;
+};
+
+static DEFINE_PER_CPU(struct tmem_kvm_params *, params);
+
+
+/* 
+ * How requests get to the host. Hypercalls exit on every call; the ring 
+ * lets the host poll for requests instead, and mixed uses the ring while 
+ * it has room, and hypercalls when it is full
+ */
+enum tmem_kvm_transport {
+	TMEM_KVM_HYPERCALL,
+	TMEM_KVM_RING,
+	TMEM_KVM_MIXED,
+};
+
+static const char * const tmem_kvm_transport_names[] = {
+	[TMEM_KVM_HYPERCALL] = "hypercall",
+	[TMEM_KVM_RING] = "ring",
+	[TMEM_KVM_MIXED] = "mixed",
+};
+
+static char *transport = "hypercall";
+module_param(transport, charp, 0444);
+MODULE_PARM_DESC(transport, "How requests reach the host: hypercall, ring or mixed");
+
+static unsigned int ring_entries = 256;
+module_param(ring_entries, uint, 0444);
+MODULE_PARM_DESC(ring_entries, "Number of ring slots, rounded up to a power of two");
+
+/* 
+ * Serve the ring from a thread of this same kernel, with a store of its 
+ * own, so that the ring can be exercised without a hypervisor
+ */
+static bool loopback;
+module_param(loopback, bool, 0444);
+MODULE_PARM_DESC(loopback, "Complete ring requests in this kernel instead of the host");
+
+static enum tmem_kvm_transport tmem_kvm_transport;
+
+static atomic64_t hypercalls;
+static atomic64_t ring_calls;
+static atomic64_t ring_fallbacks;
+static atomic64_t ring_timeouts;
+static atomic64_t loopback_ops;
+
+/* 
+ * The ring is one physically contiguous area shared with the host. The 
+ * guest reserves the slot at the tail, fills it in and posts it; the host 
+ * completes slots in order from the head, and the guest frees its slot 
+ * once it has read the result. Heads and tails are free running
+ */
+enum {
+	TMEM_KVM_SLOT_FREE,
+	TMEM_KVM_SLOT_POSTED,
+	TMEM_KVM_SLOT_DONE,
+	/* Taken by the host, which then owns the buffers until it is DONE */
+	TMEM_KVM_SLOT_BUSY,
+	/* Given up by the guest before the host took it; the host frees it */
+	TMEM_KVM_SLOT_CANCELLED,
+};
+
+/* How long the guest spins for a slot, and for the host to take it */
+#define TMEM_KVM_RING_SPINS (1 << 20)
+
+struct tmem_kvm_slot {
+	u32 state;
+	u32 op;
+	s32 ret;
+	u32 pad;
+	struct tmem_kvm_params params;
+} ____cacheline_aligned;
+
+struct tmem_kvm_ring {
+	u32 head ____cacheline_aligned;		/* Advanced by the host */
+	u32 tail ____cacheline_aligned;		/* Advanced by the guest */
+	struct tmem_kvm_slot slots[];
+};
+
+#define TMEM_KVM_RING_MAX (4096U)
+
+static struct tmem_kvm_ring *ring;
+static size_t ring_size;
+static DEFINE_SPINLOCK(ring_lock);
+
+static struct task_struct *loopback_thread;
+static DECLARE_WAIT_QUEUE_HEAD(loopback_wait);
+
+static int tmem_kvm_hypercall(unsigned long op, struct tmem_request *request, 
+		size_t *value_lenp)
+{
+	struct tmem_kvm_params *cpu_params;
+	int ret;
+
+	cpu_params = get_cpu_var(params);
+	cpu_params->request = *request;
+	if (op == PV_TMEM_GET_OP) {
+		cpu_params->value_len = *value_lenp;
+		cpu_params->request.get.value_lenp = (void *) virt_to_phys(&cpu_params->value_len);
+	}
+
+	ret = kvm_hypercall2(KVM_HC_TMEM, op, virt_to_phys(cpu_params));
+
+	if (op == PV_TMEM_GET_OP)
+		*value_lenp = cpu_params->value_len;
+	put_cpu_var(params);
+
+	atomic64_inc(&hypercalls);
+
+	return ret;
+}
+
+static struct tmem_kvm_slot *tmem_kvm_ring_reserve(void)
+{
+	struct tmem_kvm_slot *slot;
+	u32 tail;
+
+	spin_lock(&ring_lock);
+
+	tail = ring->tail;
+	slot = &ring->slots[tail & (ring_entries - 1)];
+
+	/* Full, or the last owner of the slot has not read its result yet */
+	if (tail - smp_load_acquire(&ring->head) >= ring_entries || 
+	    smp_load_acquire(&slot->state) != TMEM_KVM_SLOT_FREE) {
+		spin_unlock(&ring_lock);
+		return NULL;
+	}
+
+	WRITE_ONCE(ring->tail, tail + 1);
+	spin_unlock(&ring_lock);
+
+	return slot;
+}
+
+/* A stuck ring falls back to the hypercall, except in loopback mode where there is none */
+static int tmem_kvm_ring_fallback(unsigned long op, struct tmem_request *request, 
+		size_t *value_lenp)
+{
+	if (loopback)
+		return -EBUSY;
+
+	atomic64_inc(&ring_fallbacks);
+	return tmem_kvm_hypercall(op, request, value_lenp);
+}
+
+/* 
+ * The host is polling, so nothing but the loopback thread needs waking. 
+ * Callers may not be able to sleep, so neither the wait for a slot nor 
+ * the wait for the host to take the request is unbounded; once the host 
+ * has taken it, it writes to our buffers and has to be waited for
+ */
+static int tmem_kvm_ring_call(unsigned long op, struct tmem_request *request, 
+		size_t *value_lenp)
+{
+	struct tmem_kvm_slot *slot;
+	unsigned int spins = 0;
+	int ret;
 
+	while (!(slot = tmem_kvm_ring_reserve())) {
+		if (tmem_kvm_transport == TMEM_KVM_MIXED || ++spins == TMEM_KVM_RING_SPINS)
+			return tmem_kvm_ring_fallback(op, request, value_lenp);
+		cpu_relax();
+	}
+
+	slot->op = op;
+	slot->params.request = *request;
+	if (op == PV_TMEM_GET_OP) {
+		slot->params.value_len = *value_lenp;
+		slot->params.request.get.value_lenp = (void *) virt_to_phys(&slot->params.value_len);
+	}
+	smp_store_release(&slot->state, TMEM_KVM_SLOT_POSTED);
+
+	if (loopback && wq_has_sleeper(&loopback_wait))
+		wake_up(&loopback_wait);
+
+	for (spins = 0; smp_load_acquire(&slot->state) != TMEM_KVM_SLOT_DONE; spins++) {
+		if (spins >= TMEM_KVM_RING_SPINS &&
+		    cmpxchg(&slot->state, TMEM_KVM_SLOT_POSTED, TMEM_KVM_SLOT_CANCELLED) ==
+		    TMEM_KVM_SLOT_POSTED) {
+			atomic64_inc(&ring_timeouts);
+			return tmem_kvm_ring_fallback(op, request, value_lenp);
+		}
+		cpu_relax();
+	}
+
+	ret = slot->ret;
+	if (op == PV_TMEM_GET_OP)
+		*value_lenp = slot->params.value_len;
+	smp_store_release(&slot->state, TMEM_KVM_SLOT_FREE);
+
+	atomic64_inc(&ring_calls);
+
+	return ret;
+}
+
+static int tmem_kvm_call(unsigned long op, struct tmem_request *request, size_t *value_lenp)
+{
+	if (tmem_kvm_transport == TMEM_KVM_HYPERCALL)
+		return tmem_kvm_hypercall(op, request, value_lenp);
+
+	return tmem_kvm_ring_call(op, request, value_lenp);
+}
+
+/* 
+ * An optional cache of values in the guest, so that gets of hot keys do 
+ * not leave it. It is direct mapped: a key can only live in the slot its 
+ * hash picks, and takes it over from whatever was there. Puts write 
+ * through and invalidates drop the key, both after the host has seen 
+ * them. Every change to a slot bumps its sequence, so that a value read 
+ * from the host is only cached if nothing changed the slot meanwhile
+ */
+static unsigned int cache_entries;
+module_param(cache_entries, uint, 0444);
+MODULE_PARM_DESC(cache_entries, "Number of values cached in the guest, 0 to turn it off");
+
+#define TMEM_KVM_CACHE_MAX_VALUE (PAGE_SIZE)
+
+struct tmem_kvm_cached {
+	struct rcu_head rcu;
+	size_t key_len;
+	size_t value_len;
+	u8 data[];		/* The key, then the value */
+};
+
+struct tmem_kvm_cache_slot {
+	spinlock_t lock;
+	unsigned long seq;
+	struct tmem_kvm_cached __rcu *cached;
+};
+
+static struct tmem_kvm_cache_slot *cache;
+
+struct tmem_kvm_cache_stats {
+	u64 hits;
+	u64 misses;
+};
+
+static DEFINE_PER_CPU(struct tmem_kvm_cache_stats, cache_stats);
+
+static struct tmem_kvm_cache_slot *tmem_kvm_cache_slot(void *key, size_t key_len)
+{
+	return &cache[jhash(key, key_len, 0) & (cache_entries - 1)];
+}
+
+static bool tmem_kvm_cached_match(struct tmem_kvm_cached *cached, void *key, size_t key_len)
+{
+	return cached && cached->key_len == key_len && !memcmp(cached->data, key, key_len);
+}
+
+static bool tmem_kvm_cache_get(struct tmem_kvm_cache_slot *slot, void *key, size_t key_len, 
+		void *value, size_t *value_lenp)
+{
+	struct tmem_kvm_cached *cached;
+
+	rcu_read_lock();
+	cached = rcu_dereference(slot->cached);
+	if (!tmem_kvm_cached_match(cached, key, key_len)) {
+		rcu_read_unlock();
+		this_cpu_inc(cache_stats.misses);
+		return false;
+	}
+
+	memcpy(value, cached->data + key_len, cached->value_len);
+	*value_lenp = cached->value_len;
+	rcu_read_unlock();
+
+	this_cpu_inc(cache_stats.hits);
+
+	return true;
+}
+
+/* Returns the sequence to pass to tmem_kvm_cache_fill(), bumped for puts */
+static unsigned long tmem_kvm_cache_seq(struct tmem_kvm_cache_slot *slot, bool bump)
+{
+	unsigned long seq;
+
+	spin_lock(&slot->lock);
+	if (bump)
+		slot->seq++;
+	seq = slot->seq;
+	spin_unlock(&slot->lock);
+
+	return seq;
+}
+
+/* 
+ * Caches the value if the slot did not change since seq was taken, and 
+ * otherwise makes sure that no older value of the key stays cached
+ */
+static void tmem_kvm_cache_fill(struct tmem_kvm_cache_slot *slot, unsigned long seq, 
+		void *key, size_t key_len, void *value, size_t value_len)
+{
+	struct tmem_kvm_cached *cached = NULL, *old = NULL;
+
+	if (value_len <= TMEM_KVM_CACHE_MAX_VALUE) {
+		cached = kmalloc(sizeof(*cached) + key_len + value_len, GFP_NOWAIT | __GFP_NOWARN);
+		if (cached) {
+			cached->key_len = key_len;
+			cached->value_len = value_len;
+			memcpy(cached->data, key, key_len);
+			memcpy(cached->data + key_len, value, value_len);
+		}
+	}
+
+	spin_lock(&slot->lock);
+	old = rcu_dereference_protected(slot->cached, lockdep_is_held(&slot->lock));
+	if (cached && slot->seq == seq) {
+		rcu_assign_pointer(slot->cached, cached);
+		cached = NULL;
+	} else if (tmem_kvm_cached_match(old, key, key_len)) {
+		RCU_INIT_POINTER(slot->cached, NULL);
+	} else {
+		old = NULL;
+	}
+	spin_unlock(&slot->lock);
+
+	kfree(cached);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static void tmem_kvm_cache_drop(struct tmem_kvm_cache_slot *slot, void *key, size_t key_len)
+{
+	struct tmem_kvm_cached *old;
+
+	spin_lock(&slot->lock);
+	slot->seq++;
+	old = rcu_dereference_protected(slot->cached, lockdep_is_held(&slot->lock));
+	if (tmem_kvm_cached_match(old, key, key_len))
+		RCU_INIT_POINTER(slot->cached, NULL);
+	else
+		old = NULL;
+	spin_unlock(&slot->lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static int tmem_kvm_cache_setup(void)
+{
+	unsigned int i;
+
+	cache_entries = roundup_pow_of_two(cache_entries);
+	cache = vzalloc(array_size(cache_entries, sizeof(*cache)));
+	if (!cache)
+		return -ENOMEM;
+
+	for (i = 0; i < cache_entries; i++)
+		spin_lock_init(&cache[i].lock);
+
+	return 0;
+}
+
+/* 
+ * The host reaches values through their physical address, which only 
+ * linear memory has; others, like the staging area of tmem_dev, are 
+ * bounced through a buffer of len bytes
+ */
+static void *tmem_kvm_linear(void *value, size_t len)
+{
+	if (!is_vmalloc_addr(value))
+		return value;
+
+	return kmalloc(len, GFP_NOIO);
+}
 
-int tmem_kvm_put_page(void *key, size_t key_len, void *value, size_t value_len)
+static int __tmem_kvm_put_page(void *key, size_t key_len, void *value, size_t value_len)
 {
+	struct tmem_kvm_cache_slot *slot = NULL;
+	unsigned long seq = 0;
+	struct tmem_request request = { .flags = 0 };
 	int ret;
 
 	struct tmem_put_request put_request = {
 		.key = (void *) virt_to_phys(key),
 		.key_len = key_len,
-		.value = (void *) virt_to_phys(value),
 		.value_len = value_len,
 	};
+	void *linear = tmem_kvm_linear(value, value_len);
+
+	if (!linear)
+		return -ENOMEM;
+	if (linear != value)
+		memcpy(linear, value, value_len);
+
+	put_request.value = (void *) virt_to_phys(linear);
 	request.put = put_request;
-	
-	*((struct tmem_request *)(page_to_virt(page))) = request;
 
+	if (cache) {
+		slot = tmem_kvm_cache_slot(key, key_len);
+		seq = tmem_kvm_cache_seq(slot, true);
+	}
 
-	ret = kvm_hypercall2(KVM_HC_TMEM, PV_TMEM_PUT_OP, page_to_phys(page));
+	ret = tmem_kvm_call(PV_TMEM_PUT_OP, &request, NULL);
 	if (ret)
 		pr_err("Hypercall failed");
+
+	if (linear != value)
+		kfree(linear);
+
+	if (slot) {
+		if (ret)
+			tmem_kvm_cache_drop(slot, key, key_len);
+		else
+			tmem_kvm_cache_fill(slot, seq, key, key_len, value, value_len);
+	}
+
 	return ret;
 }
 
-int tmem_kvm_get_page(void *key, size_t key_len, void *value, size_t *value_lenp)
+static int __tmem_kvm_get_page(void *key, size_t key_len, void *value, size_t *value_lenp)
 {
+	struct tmem_kvm_cache_slot *slot = NULL;
+	struct tmem_request request = { .flags = 0 };
+	unsigned long seq = 0;
 	int ret;
-	struct tmem_request request;
-
-	*value_len_ptr = *value_lenp;
 
 	struct tmem_get_request get_request = {
 		.key = (void *) virt_to_phys(key),
 		.key_len = key_len,
-		.value = (void *) virt_to_phys(value),
-		.value_lenp = (void *) virt_to_phys(value_len_ptr),
 	};
-	request.get = get_request;
+	void *linear;
+
+	if (cache) {
+		slot = tmem_kvm_cache_slot(key, key_len);
+		if (tmem_kvm_cache_get(slot, key, key_len, value, value_lenp))
+			return 0;
+
+		seq = tmem_kvm_cache_seq(slot, false);
+	}
 
-	*((struct tmem_request *)(page_to_virt(page))) = request;
+	linear = tmem_kvm_linear(value, TMEM_MAX);
+	if (!linear)
+		return -ENOMEM;
 
-	ret = kvm_hypercall2(KVM_HC_TMEM, PV_TMEM_GET_OP, page_to_phys(page));
+	get_request.value = (void *) virt_to_phys(linear);
+	request.get = get_request;
+
+	ret = tmem_kvm_call(PV_TMEM_GET_OP, &request, value_lenp);
 	if (ret && ret != -EINVAL)
 		pr_err("Hypercall failed");
 
-	*value_lenp = *value_len_ptr;
+	if (linear != value) {
+		if (!ret)
+			memcpy(value, linear, *value_lenp);
+		kfree(linear);
+	}
+
+	if (slot && !ret)
+		tmem_kvm_cache_fill(slot, seq, key, key_len, value, *value_lenp);
 
 	return ret;
 
 }
 
-void tmem_kvm_invalidate_page(void *key, size_t key_len)
+static void __tmem_kvm_invalidate_page(void *key, size_t key_len)
 {
+	struct tmem_request request = { .flags = 0 };
 	int ret;
-	struct tmem_request request;
 
 
 	struct tmem_invalidate_request invalidate_request = {
@@ -84,18 +512,208 @@ void tmem_kvm_invalidate_page(void *key, size_t key_len)
 	};
 	request.inval = invalidate_request;
 
-	*((struct tmem_request *)(page_to_virt(page))) = request;
-
-	ret = kvm_hypercall2(KVM_HC_TMEM, PV_TMEM_INVALIDATE_OP, page_to_phys(page));
+	ret = tmem_kvm_call(PV_TMEM_INVALIDATE_OP, &request, NULL);
 	if (ret)
 		pr_err("Hypercall failed");
+
+	if (cache)
+		tmem_kvm_cache_drop(tmem_kvm_cache_slot(key, key_len), key, key_len);
 }
 
-void tmem_kvm_invalidate_area(void) {
+/* 
+ * The loopback host. Only its thread touches the store, and it reads 
+ * the guest's memory through the physical addresses in the requests, 
+ * just like the real host would
+ */
+#define TMEM_KVM_LOOPBACK_BITS (10)
+#define TMEM_KVM_LOOPBACK_SPINS (10000)
+
+struct tmem_kvm_loopback_entry {
+	struct hlist_node node;
+	size_t key_len;
+	size_t value_len;
+	u8 data[];		/* The key, then the value */
+};
+
+static DEFINE_HASHTABLE(loopback_store, TMEM_KVM_LOOPBACK_BITS);
+
+static struct tmem_kvm_loopback_entry *tmem_kvm_loopback_lookup(void *key, size_t key_len)
+{
+	struct tmem_kvm_loopback_entry *entry;
+
+	hash_for_each_possible(loopback_store, entry, node, jhash(key, key_len, 0)) {
+		if (entry->key_len == key_len && !memcmp(entry->data, key, key_len))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static int tmem_kvm_loopback_handle(u32 op, struct tmem_kvm_params *slot_params)
+{
+	struct tmem_request *request = &slot_params->request;
+	struct tmem_kvm_loopback_entry *entry;
+	void *key;
+	size_t key_len, *value_lenp;
+
+	atomic64_inc(&loopback_ops);
+
+	switch (op) {
+	case PV_TMEM_PUT_OP:
+
+		key = phys_to_virt((phys_addr_t) request->put.key);
+		key_len = request->put.key_len;
+
+		entry = tmem_kvm_loopback_lookup(key, key_len);
+		if (entry) {
+			hash_del(&entry->node);
+			kfree(entry);
+		}
+
+		entry = kmalloc(sizeof(*entry) + key_len + request->put.value_len, GFP_KERNEL);
+		if (!entry)
+			return -ENOMEM;
+
+		entry->key_len = key_len;
+		entry->value_len = request->put.value_len;
+		memcpy(entry->data, key, key_len);
+		memcpy(entry->data + key_len, phys_to_virt((phys_addr_t) request->put.value), 
+				entry->value_len);
+		hash_add(loopback_store, &entry->node, jhash(key, key_len, 0));
+
+		return 0;
+
+	case PV_TMEM_GET_OP:
+
+		key = phys_to_virt((phys_addr_t) request->get.key);
+		key_len = request->get.key_len;
+		value_lenp = phys_to_virt((phys_addr_t) request->get.value_lenp);
+
+		entry = tmem_kvm_loopback_lookup(key, key_len);
+		if (!entry) {
+			*value_lenp = 0;
+			return -EINVAL;
+		}
+
+		memcpy(phys_to_virt((phys_addr_t) request->get.value), entry->data + key_len, 
+				entry->value_len);
+		*value_lenp = entry->value_len;
+
+		return 0;
+
+	case PV_TMEM_INVALIDATE_OP:
+
+		key = phys_to_virt((phys_addr_t) request->inval.key);
+		key_len = request->inval.key_len;
+
+		entry = tmem_kvm_loopback_lookup(key, key_len);
+		if (entry) {
+			hash_del(&entry->node);
+			kfree(entry);
+		}
+
+		return 0;
+	}
+
+	return -ENOSYS;
+}
+
+static bool tmem_kvm_ring_pending(void)
+{
+	return READ_ONCE(ring->head) != READ_ONCE(ring->tail);
+}
+
+/* Completes what has been posted so far, and returns how many requests that was */
+static unsigned int tmem_kvm_ring_poll(void)
+{
+	struct tmem_kvm_slot *slot;
+	unsigned int done = 0;
+	u32 head = ring->head;
+
+	while (head != READ_ONCE(ring->tail)) {
+		slot = &ring->slots[head & (ring_entries - 1)];
+
+		/* Taken before the guest can give up on it */
+		if (smp_load_acquire(&slot->state) == TMEM_KVM_SLOT_POSTED &&
+		    cmpxchg(&slot->state, TMEM_KVM_SLOT_POSTED, TMEM_KVM_SLOT_BUSY) ==
+		    TMEM_KVM_SLOT_POSTED) {
+			slot->ret = tmem_kvm_loopback_handle(slot->op, &slot->params);
+			smp_store_release(&slot->state, TMEM_KVM_SLOT_DONE);
+		} else if (smp_load_acquire(&slot->state) == TMEM_KVM_SLOT_CANCELLED) {
+			smp_store_release(&slot->state, TMEM_KVM_SLOT_FREE);
+		} else {
+			/* Reserved, but not filled in yet */
+			break;
+		}
+
+		head++;
+		smp_store_release(&ring->head, head);
+		done++;
+	}
+
+	return done;
+}
+
+/* Polls like the host would, and only sleeps after a while without requests */
+static int tmem_kvm_loopback_fn(void *data)
+{
+	unsigned int idle = 0;
+
+	while (!kthread_should_stop()) {
+		if (tmem_kvm_ring_poll()) {
+			idle = 0;
+		} else if (++idle < TMEM_KVM_LOOPBACK_SPINS) {
+			cpu_relax();
+		} else {
+			wait_event_interruptible(loopback_wait, 
+					tmem_kvm_ring_pending() || kthread_should_stop());
+			idle = 0;
+		}
+
+		cond_resched();
+	}
+
+	return 0;
+}
 
+static int tmem_kvm_ring_setup(void)
+{
+	ring_entries = roundup_pow_of_two(clamp(ring_entries, 2U, TMEM_KVM_RING_MAX));
+	ring_size = PAGE_ALIGN(sizeof(*ring) + ring_entries * sizeof(struct tmem_kvm_slot));
+
+	ring = alloc_pages_exact(ring_size, GFP_KERNEL | __GFP_ZERO);
+	if (!ring)
+		return -ENOMEM;
+
+	if (loopback) {
+		loopback_thread = kthread_run(tmem_kvm_loopback_fn, NULL, "tmem_kvm_loopback");
+		if (IS_ERR(loopback_thread)) {
+			free_pages_exact(ring, ring_size);
+			return PTR_ERR(loopback_thread);
+		}
+
+		return 0;
+	}
+
+#ifdef PV_TMEM_RING_SETUP_OP
+	if (kvm_hypercall2(KVM_HC_TMEM, PV_TMEM_RING_SETUP_OP, virt_to_phys(ring)) == 0)
+		return 0;
+#endif
+
+	/* The host interface has no way of being handed a ring */
+	pr_err("the host cannot serve a ring, load with loopback=1\n");
+	free_pages_exact(ring, ring_size);
 
+	return -EINVAL;
 }
 
+void tmem_kvm_invalidate_area(void) {
+
+	trace_tmem_invalidate_area(KBUILD_MODNAME, TMEM_POOL_DEFAULT);
+}
+
+TMEM_DEFINE_TRACED_OPS(tmem_kvm)
+
 struct tmem_ops tmem_kvm_ops = {
 	.get = tmem_kvm_get_page,
 	.put = tmem_kvm_put_page,
@@ -103,26 +721,104 @@ struct tmem_ops tmem_kvm_ops = {
 	.invalidate_all = tmem_kvm_invalidate_area,
 };
 
+static void tmem_kvm_free_params(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(params, cpu))
+			free_page((unsigned long) per_cpu(params, cpu));
+	}
+}
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+/* Hits, misses, and the percentage of gets that did not leave the guest */
+static int cache_show(struct seq_file *m, void *v)
+{
+	struct tmem_kvm_cache_stats *stats;
+	u64 hits = 0, misses = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(&cache_stats, cpu);
+		hits += READ_ONCE(stats->hits);
+		misses += READ_ONCE(stats->misses);
+	}
+
+	seq_printf(m, "%llu %llu %llu\n", hits, misses, 
+			hits + misses ? div64_u64(hits * 100, hits + misses) : 0);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cache);
+
 static int __init tmem_kvm_init(void)
 {
 	struct dentry *root;
+	struct page *page;
+	int cpu, ret;
+
+	ret = match_string(tmem_kvm_transport_names, ARRAY_SIZE(tmem_kvm_transport_names), 
+			transport);
+	if (ret < 0) {
+		pr_err("unknown transport %s\n", transport);
+		return ret;
+	}
+	tmem_kvm_transport = ret;
+
+	BUILD_BUG_ON(sizeof(struct tmem_kvm_params) > PAGE_SIZE);
+
+	/* Each page on the node of its CPU, the host only ever needs its address */
+	for_each_possible_cpu(cpu) {
+		page = alloc_pages_node(cpu_to_node(cpu), GFP_KERNEL | __GFP_ZERO, 0);
+		if (!page)
+			goto out_fail;
 
-	page = alloc_page(GFP_KERNEL);
-	value_len_ptr = kmalloc(sizeof(size_t), GFP_KERNEL);
-	if (!page || !value_len_ptr)
-		goto out_fail;
+		per_cpu(params, cpu) = page_address(page);
+	}
+
+	if (cache_entries) {
+		ret = tmem_kvm_cache_setup();
+		if (ret) {
+			tmem_kvm_free_params();
+			return ret;
+		}
+	}
+
+	if (tmem_kvm_transport != TMEM_KVM_HYPERCALL) {
+		ret = tmem_kvm_ring_setup();
+		if (ret) {
+			vfree(cache);
+			tmem_kvm_free_params();
+			return ret;
+		}
+	}
 
 	current_memory = 0;
 
-	register_tmem_ops(&tmem_kvm_ops);	
+	register_tmem_backend(&tmem_kvm_ops, NULL);
+	register_tmem_tier_ops(KBUILD_MODNAME, &tmem_kvm_ops);
 
-	root = debugfs_create_dir("tmem", NULL);
-	if (!root) {
+	root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root)) {
 		pr_err("debugfs directory could not be set up\n");
 		goto out;
 	}
 
-	if (!debugfs_create_u64("current_memory", S_IRUGO, root, &current_memory)) 
+	if (!debugfs_create_u64("current_memory", S_IRUGO, root, &current_memory) ||
+	    !debugfs_create_file("hypercalls", S_IRUGO, root, &hypercalls, &atomic_stat_fops) ||
+	    !debugfs_create_file("ring_calls", S_IRUGO, root, &ring_calls, &atomic_stat_fops) ||
+	    !debugfs_create_file("ring_fallbacks", S_IRUGO, root, &ring_fallbacks, &atomic_stat_fops) ||
+	    !debugfs_create_file("loopback_ops", S_IRUGO, root, &loopback_ops, &atomic_stat_fops) ||
+	    !debugfs_create_file("ring_timeouts", S_IRUGO, root, &ring_timeouts, &atomic_stat_fops) ||
+	    !debugfs_create_file("cache", S_IRUGO, root, NULL, &cache_fops)) 
 		pr_err("debugfs entry could not be set up\n");
 
 out:
@@ -131,11 +827,7 @@ out:
 
 out_fail:
 
-	if (page)
-		__free_page(page);
-
-	if (value_len_ptr)
-		kfree(value_len_ptr);
+	tmem_kvm_free_params();
     
 	return -ENOMEM;
 }
@@ -4,83 +4,653 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/list.h>
-#include <linux/hashtable.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
 #include <linux/string.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/shrinker.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
 
 #include <tmem/tmem_ops.h> 
 
-static u64 current_memory; 
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
+/* Same-filled values currently stored, and puts that turned out to be one */
+static atomic64_t same_filled_pages;
+static atomic64_t same_filled_puts;
+
+static atomic64_t evictions;
+
+/* 
+ * Values go to the node of the CPU doing the put, if it has room. Hits 
+ * are counted per CPU, and summed up per node when they are read
+ */
+struct tmem_numa_stats {
+	u64 local_hits;
+	u64 remote_hits;
+};
+
+static DEFINE_PER_CPU(struct tmem_numa_stats, numa_stats);
+static atomic64_t node_memory[MAX_NUMNODES];
+static atomic64_t numa_fallbacks;
+
+/* How ephemeral pools pick the entries to drop when they are full */
+enum tmem_evict_policy {
+	TMEM_EVICT_LRU,
+	TMEM_EVICT_CLOCK,
+	TMEM_EVICT_S3FIFO,
+};
+
+static const char * const tmem_evict_names[] = {
+	[TMEM_EVICT_LRU] = "lru",
+	[TMEM_EVICT_CLOCK] = "clock",
+	[TMEM_EVICT_S3FIFO] = "s3fifo",
+};
+
+/* 
+ * LRU moves the entry on every get, under the lock its pool takes for 
+ * every put and eviction too, so it has to be asked for
+ */
+static char *eviction = "clock";
+module_param(eviction, charp, 0444);
+MODULE_PARM_DESC(eviction, "Eviction policy of ephemeral pools: clock (default), s3fifo, "
+		 "or lru, which takes a pool-wide lock on gets");
+
+static enum tmem_evict_policy tmem_eviction;
 
 struct page_list {
-	struct hlist_node hash_node;
+	struct rhash_head hash_node;
+	struct rcu_head rcu;
 	void *key;
 	size_t key_len;
 	void *value;
 	size_t value_len;
+	/* Used instead of value when the value is one word repeated */
+	unsigned long fill;
+	/* Node the value lives on, and where it was allocated from */
+	int nid;
+	u32 value_size;
+	u8 value_class;
+	/* Place in the eviction queues, for entries of ephemeral pools */
+	struct list_head lru;
+	u32 hash;
+	u8 freq;
+	u8 queue;
+	u8 inline_key[TMEM_INLINE_KEY_LEN];
 };
 
-DEFINE_SPINLOCK(used_lock); 
-DEFINE_HASHTABLE(used_pages, 10);   
+static struct kmem_cache *page_list_cache;
+
+/* 
+ * Values are packed in size classes, spaced closely enough that at most 
+ * a third of a value's allocation is wasted. Anything above a page is 
+ * allocated on its own, and counted with what the allocator really used
+ */
+static const unsigned int tmem_value_sizes[] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096,
+};
+
+#define TMEM_VALUE_CLASSES ARRAY_SIZE(tmem_value_sizes)
+#define TMEM_VALUE_LARGE TMEM_VALUE_CLASSES
+
+static struct kmem_cache *page_value_caches[TMEM_VALUE_CLASSES];
+static char page_value_names[TMEM_VALUE_CLASSES][32];
+
+TMEM_DEFINE_OBJ_FNS(struct page_list)
+
+/* 
+ * The whole key is hashed, and the table grows and shrinks 
+ * with the number of entries it holds
+ */
+static const struct rhashtable_params used_pages_params = {
+	.head_offset = offsetof(struct page_list, hash_node),
+	.hashfn = tmem_key_hashfn,
+	.obj_hashfn = tmem_obj_hashfn,
+	.obj_cmpfn = tmem_obj_cmpfn,
+	.automatic_shrinking = true,
+};
 
-#define TMEM_POOL_ID (0) 
-#define TMEM_OBJ_ID (0) 
 #define TMEM_POOL_SIZE (1024 * 1024 * 1024) 
 
-int tmem_local_put_page(void *key, size_t key_len, void *value, size_t value_len)
+/* 
+ * S3-FIFO keeps about a tenth of the entries in a small probation queue, 
+ * and remembers the hashes of what got evicted from there in a ghost 
+ * table, so that keys coming back go straight to the main queue
+ */
+#define TMEM_S3FIFO_SMALL_RATIO (10)
+#define TMEM_S3FIFO_MAX_FREQ (3)
+#define TMEM_GHOST_BITS (12)
+
+enum {
+	TMEM_QUEUE_MAIN,
+	TMEM_QUEUE_SMALL,
+};
+
+/* Bounds the work of picking one victim, when most entries keep getting hit */
+#define TMEM_EVICT_SCAN (1024)
+
+/* Every pool has its own index, so flushing one does not walk the others */
+struct tmem_pool {
+	struct rhashtable used_pages;
+	atomic64_t current_memory;
+	u64 limit;
+	u32 flags;
+	/* Eviction queues, only used by ephemeral pools */
+	spinlock_t evict_lock;
+	struct list_head main;
+	struct list_head small;
+	unsigned long nr_main;
+	unsigned long nr_small;
+	u32 *ghost;
+};
+
+/* 
+ * Operations find their pool under RCU; creating and destroying 
+ * pools, as well as flushing them, is serialized by pools_lock
+ */
+static struct tmem_pool __rcu *pools[TMEM_MAX_POOLS];
+static DEFINE_MUTEX(pools_lock);
+
+static int pool_size_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops pool_size_ops = {
+	.set = pool_size_set,
+	.get = param_get_ulong,
+};
+
+/* The limit of the default pool, and of new pools that do not ask for one */
+static unsigned long pool_size = TMEM_POOL_SIZE;
+module_param_cb(pool_size, &pool_size_ops, &pool_size, 0644);
+MODULE_PARM_DESC(pool_size, "Memory limit of pools in bytes, can be changed at runtime");
+
+static int pool_size_set(const char *val, const struct kernel_param *kp)
 {
-	struct page_list *page_entry = NULL;
-	int already_exists = 0;
-	unsigned long flags;
-	int ret = -1;
+	struct tmem_pool *pool;
+	int ret;
 
-	pr_debug("entering put_page\n");
+	mutex_lock(&pools_lock);
+	ret = param_set_ulong(val, kp);
+	if (!ret) {
+		pool = rcu_dereference_protected(pools[TMEM_POOL_DEFAULT], 
+				lockdep_is_held(&pools_lock));
+		if (pool)
+			WRITE_ONCE(pool->limit, pool_size);
+	}
+	mutex_unlock(&pools_lock);
+
+	return ret;
+}
+
+/* Pool ids come from the frontends, so they are checked on every call */
+static bool tmem_pool_valid(int pool_id)
+{
+	return pool_id >= 0 && pool_id < TMEM_MAX_POOLS;
+}
+
+static struct tmem_lock_shard used_locks[TMEM_LOCK_SHARDS];
+
+static struct page_list *page_list_alloc(void *key, size_t key_len)
+{
+	struct page_list *page_entry;
 
+	page_entry = kmem_cache_alloc_node(page_list_cache, GFP_KERNEL, numa_node_id());
+	if (!page_entry)
+		return NULL;
+
+	if (key_len <= TMEM_INLINE_KEY_LEN) {
+		page_entry->key = page_entry->inline_key;
+	} else {
+		page_entry->key = kmalloc(key_len, GFP_KERNEL);
+		if (!page_entry->key) {
+			kmem_cache_free(page_list_cache, page_entry);
+			return NULL;
+		}
+	}
+
+	memcpy(page_entry->key, key, key_len);
+	page_entry->key_len = key_len;
+	page_entry->value = NULL;
+	INIT_LIST_HEAD(&page_entry->lru);
+	page_entry->hash = jhash(key, key_len, 0);
+	page_entry->freq = 0;
+	page_entry->queue = TMEM_QUEUE_MAIN;
+
+	return page_entry;
+}
+
+static unsigned int page_value_class(size_t len)
+{
+	unsigned int class;
+
+	for (class = 0; class < TMEM_VALUE_CLASSES; class++) {
+		if (len <= tmem_value_sizes[class] && page_value_caches[class])
+			return class;
+	}
+
+	return TMEM_VALUE_LARGE;
+}
+
+/* 
+ * Only try the local node while it has free memory; reclaiming there to 
+ * make room is worse than a remote value, so fall back to any node instead
+ */
+static void *page_value_alloc(struct page_list *page_entry, size_t len)
+{
+	unsigned int class = page_value_class(len);
+	gfp_t local_gfp = GFP_NOWAIT | __GFP_THISNODE | __GFP_NOWARN;
+	void *value;
+
+	if (class == TMEM_VALUE_LARGE) {
+		value = kmalloc_node(len, local_gfp, numa_node_id());
+		if (!value) {
+			value = kvmalloc(len, GFP_KERNEL);
+			if (!value)
+				return NULL;
+
+			atomic64_inc(&numa_fallbacks);
+		}
+
+		if (is_vmalloc_addr(value)) {
+			page_entry->value_size = PAGE_ALIGN(len);
+			page_entry->nid = page_to_nid(vmalloc_to_page(value));
+		} else {
+			page_entry->value_size = ksize(value);
+			page_entry->nid = page_to_nid(virt_to_page(value));
+		}
+	} else {
+		value = kmem_cache_alloc_node(page_value_caches[class], local_gfp, numa_node_id());
+		if (!value) {
+			value = kmem_cache_alloc(page_value_caches[class], GFP_KERNEL);
+			if (!value)
+				return NULL;
+
+			atomic64_inc(&numa_fallbacks);
+		}
+
+		page_entry->value_size = tmem_value_sizes[class];
+		page_entry->nid = page_to_nid(virt_to_page(value));
+	}
+
+	page_entry->value_class = class;
+
+	return value;
+}
+
+static void page_value_free(struct page_list *page_entry)
+{
+	if (page_entry->value_class == TMEM_VALUE_LARGE)
+		kvfree(page_entry->value);
+	else
+		kmem_cache_free(page_value_caches[page_entry->value_class], page_entry->value);
+}
+
+static void page_list_free(struct page_list *page_entry)
+{
+	if (page_entry->value)
+		page_value_free(page_entry);
+
+	if (page_entry->key != page_entry->inline_key)
+		kfree(page_entry->key);
+
+	kmem_cache_free(page_list_cache, page_entry);
+}
+
+static void page_list_free_rcu(struct rcu_head *rcu)
+{
+	page_list_free(container_of(rcu, struct page_list, rcu));
+}
+
+/* Same-filled entries do not have a value allocation */
+static long page_list_size(struct page_list *page_entry)
+{
+	return page_entry->value ? page_entry->value_size : 0;
+}
 
-	/* If the page already exists, update it */
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each_possible(used_pages, page_entry, hash_node, *(char *) key) {
-        /* TODO: Is this correct? The lengths seem weird */
-		if (!memcmp(page_entry->key, key, min(page_entry->key_len, key_len))) { 
-			already_exists = 1;
+static void page_list_unaccount(struct tmem_pool *pool, struct page_list *page_entry)
+{
+	atomic64_sub(page_list_size(page_entry), &pool->current_memory);
+
+	if (page_entry->value)
+		atomic64_sub(page_list_size(page_entry), &node_memory[page_entry->nid]);
+	else
+		atomic64_dec(&same_filled_pages);
+}
+
+static bool tmem_ghost_test(struct tmem_pool *pool, u32 hash)
+{
+	return pool->ghost[hash_32(hash, TMEM_GHOST_BITS)] == hash;
+}
+
+static void tmem_ghost_add(struct tmem_pool *pool, u32 hash)
+{
+	pool->ghost[hash_32(hash, TMEM_GHOST_BITS)] = hash;
+}
+
+/* 
+ * Queues a new entry for eviction, called with its shard locked so that 
+ * it cannot be removed from the index before it is on a queue. A new 
+ * value for a key takes over the place of the old one
+ */
+static void tmem_evict_add(struct tmem_pool *pool, struct page_list *page_entry, 
+		struct page_list *old_entry)
+{
+	spin_lock(&pool->evict_lock);
+
+	if (old_entry && !list_empty(&old_entry->lru)) {
+		list_replace_init(&old_entry->lru, &page_entry->lru);
+		page_entry->queue = old_entry->queue;
+		page_entry->freq = old_entry->freq;
+	} else if (tmem_eviction == TMEM_EVICT_S3FIFO && 
+		   !tmem_ghost_test(pool, page_entry->hash)) {
+		page_entry->queue = TMEM_QUEUE_SMALL;
+		list_add_tail(&page_entry->lru, &pool->small);
+		pool->nr_small++;
+	} else {
+		page_entry->queue = TMEM_QUEUE_MAIN;
+		list_add_tail(&page_entry->lru, &pool->main);
+		pool->nr_main++;
+	}
+
+	spin_unlock(&pool->evict_lock);
+}
+
+/* Called with evict_lock held */
+static void tmem_evict_detach(struct tmem_pool *pool, struct page_list *page_entry)
+{
+	list_del_init(&page_entry->lru);
+
+	if (page_entry->queue == TMEM_QUEUE_SMALL)
+		pool->nr_small--;
+	else
+		pool->nr_main--;
+}
+
+/* Has to happen before the entry is freed, eviction may still find it otherwise */
+static void tmem_evict_del(struct tmem_pool *pool, struct page_list *page_entry)
+{
+	if (!(pool->flags & TMEM_POOL_EPHEMERAL))
+		return;
+
+	spin_lock(&pool->evict_lock);
+	if (!list_empty(&page_entry->lru))
+		tmem_evict_detach(pool, page_entry);
+	spin_unlock(&pool->evict_lock);
+}
+
+/* 
+ * Gets only take the queue lock with LRU, and only when nobody holds it: 
+ * otherwise they mark the entry like the other policies do, and eviction 
+ * moves it up when it gets there. Marking skips the store if it is 
+ * marked already
+ */
+static void tmem_evict_touch(struct tmem_pool *pool, struct page_list *page_entry)
+{
+	u8 freq = READ_ONCE(page_entry->freq);
+
+	switch (tmem_eviction) {
+	case TMEM_EVICT_LRU:
+
+		if (spin_trylock(&pool->evict_lock)) {
+			if (!list_empty(&page_entry->lru)) {
+				list_move_tail(&page_entry->lru, &pool->main);
+				page_entry->freq = 0;
+			}
+			spin_unlock(&pool->evict_lock);
 			break;
 		}
+
+		if (!freq)
+			WRITE_ONCE(page_entry->freq, 1);
+		break;
+
+	case TMEM_EVICT_CLOCK:
+
+		if (!freq)
+			WRITE_ONCE(page_entry->freq, 1);
+		break;
+
+	case TMEM_EVICT_S3FIFO:
+
+		if (freq < TMEM_S3FIFO_MAX_FREQ)
+			WRITE_ONCE(page_entry->freq, freq + 1);
+		break;
 	}
-	spin_unlock_irqrestore(&used_lock, flags);
+}
 
-	/* Or else get a new one */
-	if (!already_exists) {	
+/* Picks the next entry to drop and takes it off its queue, with evict_lock held */
+static struct page_list *tmem_evict_victim(struct tmem_pool *pool)
+{
+	struct page_list *page_entry;
+	int scan;
 
-        if (current_memory + PAGE_SIZE > TMEM_POOL_SIZE) 
-            goto out_pool;
-	
-		page_entry = kzalloc(sizeof(*page_entry), GFP_KERNEL);
+	for (scan = 0; scan < TMEM_EVICT_SCAN; scan++) {
+		/* LRU and CLOCK only use the main queue */
+		if (pool->nr_small && (list_empty(&pool->main) || 
+		    pool->nr_small * TMEM_S3FIFO_SMALL_RATIO >= pool->nr_small + pool->nr_main)) {
+			page_entry = list_first_entry(&pool->small, struct page_list, lru);
+
+			/* Hit while on probation, keep it */
+			if (page_entry->freq) {
+				page_entry->freq = 0;
+				page_entry->queue = TMEM_QUEUE_MAIN;
+				list_move_tail(&page_entry->lru, &pool->main);
+				pool->nr_small--;
+				pool->nr_main++;
+				continue;
+			}
+
+			tmem_ghost_add(pool, page_entry->hash);
+			tmem_evict_detach(pool, page_entry);
+
+			return page_entry;
+		}
+
+		page_entry = list_first_entry_or_null(&pool->main, struct page_list, lru);
 		if (!page_entry)
-			goto out_mem;
-        
-        page_entry->key = kmalloc(key_len, GFP_KERNEL);
-        if(!page_entry->key)
-            goto out_mem;
+			return NULL;
 
-        page_entry->value = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		/* 
+		 * Second chance for entries hit since the last pass, 
+		 * or with LRU, hit while the queue was busy
+		 */
+		if (page_entry->freq) {
+			page_entry->freq--;
+			list_move_tail(&page_entry->lru, &pool->main);
+			continue;
+		}
+
+		tmem_evict_detach(pool, page_entry);
+
+		return page_entry;
+	}
+
+	return NULL;
+}
+
+/* 
+ * Drops the next victim of an ephemeral pool, and returns the bytes it 
+ * freed, or -1 if there is nothing left to drop. Called under RCU, so 
+ * victims cannot be freed under us once we let go of the queues
+ */
+static long tmem_pool_evict_one(struct tmem_pool *pool)
+{
+	struct page_list *page_entry;
+	spinlock_t *lock;
+	long size;
+	int ret;
+
+	for (;;) {
+		spin_lock(&pool->evict_lock);
+		page_entry = tmem_evict_victim(pool);
+		spin_unlock(&pool->evict_lock);
+
+		if (!page_entry)
+			return -1;
+
+		/* An invalidate or a put may have taken it out of the index already */
+		lock = tmem_key_lock(used_locks, page_entry->key, page_entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&pool->used_pages, &page_entry->hash_node, 
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (!ret)
+			break;
+	}
+
+	size = page_list_size(page_entry);
+	page_list_unaccount(pool, page_entry);
+	atomic64_inc(&evictions);
+	call_rcu(&page_entry->rcu, page_list_free_rcu);
+
+	return size;
+}
+
+/* Drops entries until at least needed bytes are freed, or there is nothing left */
+static long tmem_pool_evict(struct tmem_pool *pool, long needed)
+{
+	long freed = 0, size;
+
+	while (freed < needed) {
+		size = tmem_pool_evict_one(pool);
+		if (size < 0)
+			break;
+
+		freed += size;
+	}
+
+	return freed;
+}
+
+static int __tmem_local_pool_put_page(int pool_id, void *key, size_t key_len, 
+		void *value, size_t value_len)
+{
+	struct page_list *page_entry = NULL, *old_entry;
+	struct tmem_pool *pool;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+	long delta, over;
+	u64 limit;
+	int ret = -1;
+
+	pr_debug("entering put_page\n");
+
+	if (value_len > TMEM_MAX)
+		return -EINVAL;
+
+	/* 
+	 * Gets read entries without taking any locks, so we never update one 
+	 * in place; a new entry replaces the old one in the index instead
+	 */
+	page_entry = page_list_alloc(key, key_len);
+	if (!page_entry)
+		goto out_mem;
+
+	/* Pages of zeroes or of a repeated word only need the pattern */
+	if (tmem_same_filled(value, value_len, &page_entry->fill)) {
+		atomic64_inc(&same_filled_puts);
+	} else {
+		page_entry->value = page_value_alloc(page_entry, value_len);
 		if (!page_entry->value)
 			goto out_mem;
-	
+
+		memcpy(page_entry->value, value, value_len);
 	}
+	page_entry->value_len = value_len;
 
-	memcpy(page_entry->key, key, key_len);
-    page_entry->key_len = key_len;
-	memcpy(page_entry->value, value, min(value_len, PAGE_SIZE));
-    page_entry->value_len = value_len;
+	if (!tmem_pool_valid(pool_id)) {
+		ret = -EINVAL;
+		goto out_free;
+	}
 
+	rcu_read_lock();
+	pool = rcu_dereference(pools[pool_id]);
+	if (!pool) {
+		rcu_read_unlock();
+		pr_debug("leaving put_page - no such pool\n");
+		ret = -EINVAL;
+		goto out_free;
+	}
 
-	if(!already_exists){
-		spin_lock_irqsave(&used_lock, flags);
-		hash_add(used_pages, &page_entry->hash_node, *(char *)key);
-		spin_unlock_irqrestore(&used_lock, flags);
-	
-		current_memory += PAGE_SIZE;
+	/* Ephemeral pools make room for the new value instead of failing the put */
+	limit = READ_ONCE(pool->limit);
+	over = atomic64_read(&pool->current_memory) + page_list_size(page_entry) - limit;
+	if ((pool->flags & TMEM_POOL_EPHEMERAL) && page_list_size(page_entry) && over > 0)
+		tmem_pool_evict(pool, over);
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+
+	old_entry = rhashtable_lookup_fast(&pool->used_pages, &tmem_key, used_pages_params);
+
+	delta = page_list_size(page_entry);
+	if (old_entry)
+		delta -= page_list_size(old_entry);
+
+	if (delta > 0 && 
+	    atomic64_add_return(delta, &pool->current_memory) > limit) {
+		atomic64_sub(delta, &pool->current_memory);
+		spin_unlock(lock);
+		rcu_read_unlock();
+		ret = -1;
+		goto out_free;
+	}
+
+	if (old_entry)
+		ret = rhashtable_replace_fast(&pool->used_pages, &old_entry->hash_node, 
+				&page_entry->hash_node, used_pages_params);
+	else
+		ret = rhashtable_insert_fast(&pool->used_pages, &page_entry->hash_node, 
+				used_pages_params);
+
+	if (!ret && (pool->flags & TMEM_POOL_EPHEMERAL))
+		tmem_evict_add(pool, page_entry, old_entry);
+
+	spin_unlock(lock);
+
+	if (ret) {
+		if (delta > 0)
+			atomic64_sub(delta, &pool->current_memory);
+		rcu_read_unlock();
+		pr_err("leaving put_page - could not add the page\n");
+		goto out_free;
+	}
+
+	if (delta < 0)
+		atomic64_add(delta, &pool->current_memory);
+
+	/* Only off the queues once nothing else can reach it */
+	if (old_entry)
+		tmem_evict_del(pool, old_entry);
+	rcu_read_unlock();
+
+	if (page_entry->value)
+		atomic64_add(page_list_size(page_entry), &node_memory[page_entry->nid]);
+	else
+		atomic64_inc(&same_filled_pages);
+
+	/* The old entry is not reachable anymore, but gets may still be reading it */
+	if (old_entry) {
+		if (old_entry->value)
+			atomic64_sub(page_list_size(old_entry), &node_memory[old_entry->nid]);
+		else
+			atomic64_dec(&same_filled_pages);
+		call_rcu(&old_entry->rcu, page_list_free_rcu);
 	}
 	
 	pr_debug("leaving put_page\n");
@@ -89,80 +659,110 @@ int tmem_local_put_page(void *key, size_t key_len, void *value, size_t value_len
 
 out_mem:
 
-    if (page_entry->value)
-        kfree(page_entry->value);
-
-    if (page_entry->key)
-        kfree(page_entry->key);
+	pr_err("leaving put_page - not enough memory\n");
 
-    if (page_entry)
-        kfree(page_entry);
+	ret = -ENOMEM;
 
-    pr_err("leaving put_page - not enough memory\n");
-    
-    ret = -ENOMEM;
+out_free:
 
-out_pool:
+	if (page_entry)
+		page_list_free(page_entry);
 
-    pr_debug("leaving put_page - failed\n");
+	pr_debug("leaving put_page - failed\n");
     
-    return ret;
+	return ret;
 }
 
 
-int tmem_local_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+static int __tmem_local_pool_get_page(int pool_id, void *key, size_t key_len, 
+		void *value, size_t *value_len)
 {
-	struct page_list *page_entry;
-	unsigned long flags;
+	struct page_list *page_entry = NULL;
+	struct tmem_pool *pool;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
 
 	pr_debug("entering get_page\n");
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each_possible(used_pages, page_entry, hash_node, *(char *) key) {
-		if (!memcmp(page_entry->key, key, min(page_entry->key_len, key_len))) {
 
-			*value_len = page_entry->value_len;
-			memcpy(value, page_entry->value, min(*value_len, PAGE_SIZE));
-			spin_unlock_irqrestore(&used_lock, flags);
+	/* Entries are only freed after a grace period, so nothing is shared but the index */
+	rcu_read_lock();
+	pool = tmem_pool_valid(pool_id) ? rcu_dereference(pools[pool_id]) : NULL;
+	if (pool)
+		page_entry = rhashtable_lookup(&pool->used_pages, &tmem_key, used_pages_params);
+	if (page_entry) {
+		if (pool->flags & TMEM_POOL_EPHEMERAL)
+			tmem_evict_touch(pool, page_entry);
 
-			pr_debug("leaving get_page\n");
+		*value_len = page_entry->value_len;
+		if (page_entry->value) {
+			if (page_entry->nid == numa_node_id())
+				this_cpu_inc(numa_stats.local_hits);
+			else
+				this_cpu_inc(numa_stats.remote_hits);
 
-			return 0;
-		}
+			memcpy(value, page_entry->value, *value_len);
+		} else
+			memset_l(value, page_entry->fill, 
+					*value_len / sizeof(unsigned long));
+		rcu_read_unlock();
+
+		pr_debug("leaving get_page\n");
+
+		return 0;
 	}
 
-	spin_unlock_irqrestore(&used_lock, flags);
+	rcu_read_unlock();
 	/* pr_debug("leaving get_page - failed\n"); */
 	*value_len = 0;
 
 	return -EINVAL;
 }
 
-void tmem_local_invalidate_page(void *key, size_t key_len)
+static void __tmem_local_pool_invalidate_page(int pool_id, void *key, size_t key_len)
 {
 	struct page_list *page_entry;
-	unsigned long flags;
+	struct tmem_pool *pool;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
 
 	pr_debug("entering invalidate_page\n");
 
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each_possible(used_pages, page_entry, hash_node, *(char *) key) {
-		if (!memcmp(page_entry->key, key, min(page_entry->key_len, key_len))) {
-			hash_del(&page_entry->hash_node);
-			spin_unlock_irqrestore(&used_lock, flags);
+	if (!tmem_pool_valid(pool_id))
+		return;
 
-			kfree(page_entry->value);
-			kfree(page_entry->key);
-			kfree(page_entry);
+	rcu_read_lock();
+	pool = rcu_dereference(pools[pool_id]);
+	if (!pool) {
+		rcu_read_unlock();
+		pr_debug("leaving invalidate_page - no such pool\n");
+		return;
+	}
 
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+	page_entry = rhashtable_lookup_fast(&pool->used_pages, &tmem_key, used_pages_params);
+	if (page_entry && !rhashtable_remove_fast(&pool->used_pages, &page_entry->hash_node, 
+				used_pages_params)) {
+		spin_unlock(lock);
 
-			pr_debug("leaving invalidate_page\n");
+		tmem_evict_del(pool, page_entry);
+		page_list_unaccount(pool, page_entry);
+		rcu_read_unlock();
 
-			current_memory -= PAGE_SIZE;
+		/* Lookups may still be walking past it, so wait for them */
+		call_rcu(&page_entry->rcu, page_list_free_rcu);
 
-			return;
-		}
+		pr_debug("leaving invalidate_page\n");
+
+		return;
 	}
-	spin_unlock_irqrestore(&used_lock, flags);
+	spin_unlock(lock);
+	rcu_read_unlock();
 	pr_debug("leaving invalidate_page - key not present\n");
 
 	return;
@@ -170,27 +770,258 @@ void tmem_local_invalidate_page(void *key, size_t key_len)
 }
 
 
-void tmem_local_invalidate_area(void)
+static void tmem_pool_flush(struct tmem_pool *pool)
 {
 	struct page_list *page_entry;
-	unsigned long flags;
-	int bkt;
+	struct rhashtable_iter iter;
+	spinlock_t *lock;
+	int ret;
 
-	pr_debug("entering invalidate_area\n");
+	rhashtable_walk_enter(&pool->used_pages, &iter);
+	rhashtable_walk_start(&iter);
 
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each(used_pages, bkt, page_entry, hash_node) {
-		hash_del(&page_entry->hash_node);
+	while ((page_entry = rhashtable_walk_next(&iter)) != NULL) {
+		/* The table got resized under us, keep going from where we are */
+		if (IS_ERR(page_entry)) {
+			if (PTR_ERR(page_entry) == -EAGAIN)
+				continue;
+			break;
+		}
 
-		kfree(page_entry->key);
-		kfree(page_entry->value);
-		kfree(page_entry);
+		/* Do not race with a put replacing this same entry */
+		lock = tmem_key_lock(used_locks, page_entry->key, page_entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&pool->used_pages, &page_entry->hash_node, 
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (ret)
+			continue;
 
+		tmem_evict_del(pool, page_entry);
+		page_list_unaccount(pool, page_entry);
+		call_rcu(&page_entry->rcu, page_list_free_rcu);
 	}
-	spin_unlock_irqrestore(&used_lock, flags);
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+}
+
+void tmem_local_pool_invalidate_area(int pool_id)
+{
+	struct tmem_pool *pool;
+
+	pr_debug("entering invalidate_area\n");
+	trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+
+	if (!tmem_pool_valid(pool_id))
+		return;
+
+	/* Keep the pool from being destroyed under the walk */
+	mutex_lock(&pools_lock);
+	pool = rcu_dereference_protected(pools[pool_id], lockdep_is_held(&pools_lock));
+	if (pool)
+		tmem_pool_flush(pool);
+	mutex_unlock(&pools_lock);
+
 	pr_debug("leaving invalidate_area\n");
 }
 
+static struct tmem_pool *tmem_pool_alloc(u64 limit, u32 flags)
+{
+	struct tmem_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	if ((flags & TMEM_POOL_EPHEMERAL) && tmem_eviction == TMEM_EVICT_S3FIFO) {
+		pool->ghost = kcalloc(1 << TMEM_GHOST_BITS, sizeof(*pool->ghost), GFP_KERNEL);
+		if (!pool->ghost) {
+			kfree(pool);
+			return NULL;
+		}
+	}
+
+	if (rhashtable_init(&pool->used_pages, &used_pages_params)) {
+		kfree(pool->ghost);
+		kfree(pool);
+		return NULL;
+	}
+
+	atomic64_set(&pool->current_memory, 0);
+	pool->limit = limit ? limit : READ_ONCE(pool_size);
+	pool->flags = flags;
+	spin_lock_init(&pool->evict_lock);
+	INIT_LIST_HEAD(&pool->main);
+	INIT_LIST_HEAD(&pool->small);
+
+	return pool;
+}
+
+/* Nothing can reach the pool anymore, so its entries are freed right away */
+static void page_list_destroy(void *ptr, void *arg)
+{
+	struct page_list *page_entry = ptr;
+
+	page_list_unaccount(arg, page_entry);
+	page_list_free(page_entry);
+}
+
+int tmem_local_pool_create(u64 limit, u32 flags)
+{
+	struct tmem_pool *pool;
+	int pool_id;
+
+	pool = tmem_pool_alloc(limit, flags);
+	if (!pool)
+		return -ENOMEM;
+
+	mutex_lock(&pools_lock);
+	for (pool_id = TMEM_POOL_DEFAULT + 1; pool_id < TMEM_MAX_POOLS; pool_id++) {
+		if (!rcu_access_pointer(pools[pool_id]))
+			break;
+	}
+
+	if (pool_id == TMEM_MAX_POOLS) {
+		mutex_unlock(&pools_lock);
+		rhashtable_destroy(&pool->used_pages);
+		kfree(pool->ghost);
+		kfree(pool);
+		pr_err("no pool ids left\n");
+		return -ENOSPC;
+	}
+
+	rcu_assign_pointer(pools[pool_id], pool);
+	mutex_unlock(&pools_lock);
+
+	pr_debug("created pool %d\n", pool_id);
+
+	return pool_id;
+}
+
+void tmem_local_pool_destroy(int pool_id)
+{
+	struct tmem_pool *pool;
+
+	if (!tmem_pool_valid(pool_id))
+		return;
+
+	/* The default pool is what the plain tmem_ops use, so only flush it */
+	if (pool_id == TMEM_POOL_DEFAULT) {
+		tmem_local_pool_invalidate_area(pool_id);
+		return;
+	}
+
+	trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+
+	mutex_lock(&pools_lock);
+	pool = rcu_dereference_protected(pools[pool_id], lockdep_is_held(&pools_lock));
+	RCU_INIT_POINTER(pools[pool_id], NULL);
+	mutex_unlock(&pools_lock);
+
+	if (!pool)
+		return;
+
+	/* Wait for the operations that found the pool before it was removed */
+	synchronize_rcu();
+
+	rhashtable_free_and_destroy(&pool->used_pages, page_list_destroy, pool);
+	kfree(pool->ghost);
+	kfree(pool);
+
+	pr_debug("destroyed pool %d\n", pool_id);
+}
+
+TMEM_DEFINE_TRACED_POOL_OPS(tmem_local)
+
+/* The plain tmem_ops act on the default pool */
+int tmem_local_put_page(void *key, size_t key_len, void *value, size_t value_len)
+{
+	return tmem_local_pool_put_page(TMEM_POOL_DEFAULT, key, key_len, value, value_len);
+}
+
+int tmem_local_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+{
+	return tmem_local_pool_get_page(TMEM_POOL_DEFAULT, key, key_len, value, value_len);
+}
+
+void tmem_local_invalidate_page(void *key, size_t key_len)
+{
+	tmem_local_pool_invalidate_page(TMEM_POOL_DEFAULT, key, key_len);
+}
+
+void tmem_local_invalidate_area(void)
+{
+	tmem_local_pool_invalidate_area(TMEM_POOL_DEFAULT);
+}
+
+/* 
+ * Under memory pressure, ephemeral pools give back their coldest entries 
+ * in the order eviction would have; persistent pools are never touched
+ */
+static atomic64_t shrinker_scans;
+static atomic64_t shrinker_freed;
+
+static unsigned long tmem_local_shrink_count(struct shrinker *shrinker, 
+		struct shrink_control *sc)
+{
+	struct tmem_pool *pool;
+	unsigned long count = 0;
+	int pool_id;
+
+	rcu_read_lock();
+	for (pool_id = 0; pool_id < TMEM_MAX_POOLS; pool_id++) {
+		pool = rcu_dereference(pools[pool_id]);
+		if (pool && (pool->flags & TMEM_POOL_EPHEMERAL))
+			count += READ_ONCE(pool->nr_main) + READ_ONCE(pool->nr_small);
+	}
+	rcu_read_unlock();
+
+	return count;
+}
+
+static unsigned long tmem_local_shrink_scan(struct shrinker *shrinker, 
+		struct shrink_control *sc)
+{
+	struct tmem_pool *pool;
+	unsigned long freed = 0;
+	int pool_id;
+
+	atomic64_inc(&shrinker_scans);
+
+	rcu_read_lock();
+	for (pool_id = 0; pool_id < TMEM_MAX_POOLS && freed < sc->nr_to_scan; pool_id++) {
+		pool = rcu_dereference(pools[pool_id]);
+		if (!pool || !(pool->flags & TMEM_POOL_EPHEMERAL))
+			continue;
+
+		while (freed < sc->nr_to_scan && tmem_pool_evict_one(pool) >= 0)
+			freed++;
+	}
+	rcu_read_unlock();
+
+	atomic64_add(freed, &shrinker_freed);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker tmem_local_shrinker = {
+	.count_objects = tmem_local_shrink_count,
+	.scan_objects = tmem_local_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+	.batch = 128,
+};
+
+struct tmem_pool_ops tmem_naive_pool_ops = {
+	.create = tmem_local_pool_create,
+	.destroy = tmem_local_pool_destroy,
+	.get = tmem_local_pool_get_page,
+	.put = tmem_local_pool_put_page,
+	.invalidate = tmem_local_pool_invalidate_page,
+	.invalidate_all = tmem_local_pool_invalidate_area,
+};
+
 struct tmem_ops tmem_naive_ops = {
 	.get = tmem_local_get_page,
 	.put = tmem_local_put_page,
@@ -198,28 +1029,176 @@ struct tmem_ops tmem_naive_ops = {
 	.invalidate_all = tmem_local_invalidate_area,
 };
 
+static int current_memory_get(void *data, u64 *val)
+{
+	struct tmem_pool *pool;
+	int pool_id;
+
+	*val = 0;
+
+	rcu_read_lock();
+	for (pool_id = 0; pool_id < TMEM_MAX_POOLS; pool_id++) {
+		pool = rcu_dereference(pools[pool_id]);
+		if (pool)
+			*val += atomic64_read(&pool->current_memory);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(current_memory_fops, current_memory_get, NULL, "%llu\n");
+
+/* One line per pool: id, memory in use, limit and whether it is ephemeral */
+static int pools_show(struct seq_file *m, void *v)
+{
+	struct tmem_pool *pool;
+	int pool_id;
+
+	rcu_read_lock();
+	for (pool_id = 0; pool_id < TMEM_MAX_POOLS; pool_id++) {
+		pool = rcu_dereference(pools[pool_id]);
+		if (pool)
+			seq_printf(m, "%d %lld %llu %s\n", pool_id, 
+					atomic64_read(&pool->current_memory), READ_ONCE(pool->limit), 
+					(pool->flags & TMEM_POOL_EPHEMERAL) ? "ephemeral" : "persistent");
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pools);
+
+/* One line per node: id, memory in use, and hits from its own and from other nodes' CPUs */
+static int numa_show(struct seq_file *m, void *v)
+{
+	struct tmem_numa_stats *stats;
+	u64 local_hits, remote_hits;
+	int nid, cpu;
+
+	for_each_online_node(nid) {
+		local_hits = 0;
+		remote_hits = 0;
+
+		for_each_possible_cpu(cpu) {
+			if (cpu_to_node(cpu) != nid)
+				continue;
+
+			stats = per_cpu_ptr(&numa_stats, cpu);
+			local_hits += READ_ONCE(stats->local_hits);
+			remote_hits += READ_ONCE(stats->remote_hits);
+		}
+
+		seq_printf(m, "%d %lld %llu %llu\n", nid, atomic64_read(&node_memory[nid]), 
+				local_hits, remote_hits);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(numa);
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+/* How many entries reclaim asks for at a time, read by the kernel on every pass */
+static int shrinker_batch_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(tmem_local_shrinker.batch);
+
+	return 0;
+}
+
+static int shrinker_batch_set(void *data, u64 val)
+{
+	if (!val || val > LONG_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(tmem_local_shrinker.batch, val);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(shrinker_batch_fops, shrinker_batch_get, shrinker_batch_set, "%llu\n");
+
 static int __init tmem_local_init(void)
 {
+	struct tmem_pool *pool;
 	struct dentry *root;
+	int ret, i;
 
-	current_memory = 0;
-	hash_init(used_pages);
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++)
+		spin_lock_init(&used_locks[i].lock);
 
-	register_tmem_ops(&tmem_naive_ops);	
+	page_list_cache = kmem_cache_create("tmem_local_entry", sizeof(struct page_list), 
+			0, 0, NULL);
+	if (!page_list_cache)
+		return -ENOMEM;
 
-	root = debugfs_create_dir("tmem", NULL);
-	if (root == NULL) {
+	/* Classes above a page are left out, those values get their own allocation */
+	for (i = 0; i < TMEM_VALUE_CLASSES && tmem_value_sizes[i] <= PAGE_SIZE; i++) {
+		snprintf(page_value_names[i], sizeof(page_value_names[i]), 
+				"tmem_local_value_%u", tmem_value_sizes[i]);
+		page_value_caches[i] = kmem_cache_create(page_value_names[i], tmem_value_sizes[i], 
+				tmem_value_sizes[i] == PAGE_SIZE ? PAGE_SIZE : 0, 0, NULL);
+		if (!page_value_caches[i]) {
+			ret = -ENOMEM;
+			goto out_rhashtable;
+		}
+	}
+
+	ret = match_string(tmem_evict_names, ARRAY_SIZE(tmem_evict_names), eviction);
+	if (ret < 0) {
+		pr_err("unknown eviction policy %s\n", eviction);
+		goto out_rhashtable;
+	}
+	tmem_eviction = ret;
+
+	pool = tmem_pool_alloc(0, 0);
+	if (!pool) {
+		ret = -ENOMEM;
+		goto out_rhashtable;
+	}
+	RCU_INIT_POINTER(pools[TMEM_POOL_DEFAULT], pool);
+
+	if (register_shrinker(&tmem_local_shrinker))
+		pr_err("shrinker could not be registered\n");
+
+	register_tmem_backend(&tmem_naive_ops, &tmem_naive_pool_ops);
+	register_tmem_tier_ops(KBUILD_MODNAME, &tmem_naive_ops);
+
+	root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root)) {
 		pr_err("debugfs directory could not be set up\n");
 		goto out;
 	}
 
-	if (!debugfs_create_u64("current_memory", S_IRUGO, root, &current_memory)) 
+	if (!debugfs_create_file("current_memory", S_IRUGO, root, NULL, &current_memory_fops) ||
+	    !debugfs_create_file("pools", S_IRUGO, root, NULL, &pools_fops) ||
+	    !debugfs_create_file("numa", S_IRUGO, root, NULL, &numa_fops) ||
+	    !debugfs_create_file("numa_fallbacks", S_IRUGO, root, &numa_fallbacks, &atomic_stat_fops) ||
+	    !debugfs_create_file("same_filled_pages", S_IRUGO, root, &same_filled_pages, &atomic_stat_fops) ||
+	    !debugfs_create_file("same_filled_puts", S_IRUGO, root, &same_filled_puts, &atomic_stat_fops) ||
+	    !debugfs_create_file("evictions", S_IRUGO, root, &evictions, &atomic_stat_fops) ||
+	    !debugfs_create_file("shrinker_scans", S_IRUGO, root, &shrinker_scans, &atomic_stat_fops) ||
+	    !debugfs_create_file("shrinker_freed", S_IRUGO, root, &shrinker_freed, &atomic_stat_fops) ||
+	    !debugfs_create_file("shrinker_batch", S_IRUGO | S_IWUSR, root, NULL, &shrinker_batch_fops)) 
 		pr_err("debugfs entry could not be set up\n");
 
 out:
 
 	return 0;
-    
+
+out_rhashtable:
+
+	for (i = 0; i < TMEM_VALUE_CLASSES; i++)
+		kmem_cache_destroy(page_value_caches[i]);
+
+	kmem_cache_destroy(page_list_cache);
+
+	return ret;
 }
 
 
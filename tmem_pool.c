@@ -0,0 +1,266 @@
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+
+#include <tmem/tmem_ops.h>
+
+#include "tmem_pool.h"
+#include "tmem_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "tmem_trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL(tmem_put);
+EXPORT_TRACEPOINT_SYMBOL(tmem_get);
+EXPORT_TRACEPOINT_SYMBOL(tmem_invalidate);
+EXPORT_TRACEPOINT_SYMBOL(tmem_invalidate_area);
+
+/* 
+ * Frontends go through here, so that they work the same 
+ * whether the registered backend has pools or not
+ */
+static struct tmem_pool_ops *tmem_pool_ops;
+
+/* Time spent in the backend, whichever one it is */
+static DEFINE_PER_CPU(struct tmem_hists, latency);
+
+/* Replaces the pool operations along with the backend, so they never belong to another one */
+static DEFINE_MUTEX(backend_lock);
+
+/*
+ * What the frontends still hold in the registered backend: the pools they
+ * created and have not destroyed yet, under backend_lock, and whether
+ * anything was put in the default pool since the backend registered
+ */
+static unsigned int pool_users[TMEM_MAX_POOLS];
+static bool default_used;
+
+static void __register_tmem_backend(struct tmem_ops *ops, struct tmem_pool_ops *pool_ops)
+{
+	WRITE_ONCE(tmem_pool_ops, NULL);
+	register_tmem_ops(ops);
+	WRITE_ONCE(tmem_pool_ops, pool_ops);
+	WRITE_ONCE(default_used, false);
+
+	pr_debug("backend registered, %s pools\n", pool_ops ? "with" : "without");
+}
+
+void register_tmem_backend(struct tmem_ops *ops, struct tmem_pool_ops *pool_ops)
+{
+	mutex_lock(&backend_lock);
+	__register_tmem_backend(ops, pool_ops);
+	mutex_unlock(&backend_lock);
+}
+EXPORT_SYMBOL(register_tmem_backend);
+
+int replace_tmem_backend(struct tmem_ops *ops, struct tmem_pool_ops *pool_ops)
+{
+	int pool_id, ret = 0;
+
+	mutex_lock(&backend_lock);
+
+	for (pool_id = 0; pool_id < TMEM_MAX_POOLS; pool_id++) {
+		if (pool_users[pool_id])
+			ret = -EBUSY;
+	}
+
+	if (READ_ONCE(default_used))
+		ret = -EBUSY;
+
+	if (!ret)
+		__register_tmem_backend(ops, pool_ops);
+
+	mutex_unlock(&backend_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL(replace_tmem_backend);
+
+int tmem_pool_create(u64 limit, u32 flags)
+{
+	struct tmem_pool_ops *ops;
+	int pool_id;
+
+	mutex_lock(&backend_lock);
+
+	ops = READ_ONCE(tmem_pool_ops);
+	if (!ops) {
+		mutex_unlock(&backend_lock);
+		return TMEM_POOL_DEFAULT;
+	}
+
+	/* Whatever goes in the default pool is caught by the puts */
+	pool_id = ops->create(limit, flags);
+	if (pool_id > TMEM_POOL_DEFAULT && pool_id < TMEM_MAX_POOLS)
+		pool_users[pool_id]++;
+
+	mutex_unlock(&backend_lock);
+
+	return pool_id;
+}
+EXPORT_SYMBOL(tmem_pool_create);
+
+/*
+ * The default pool is what tmem_pool_create() hands out without pool
+ * support, and it holds the values of every other frontend too, so
+ * destroying it leaves it as it is; its keys go one by one
+ */
+void tmem_pool_destroy(int pool_id)
+{
+	struct tmem_pool_ops *ops;
+
+	if (pool_id == TMEM_POOL_DEFAULT)
+		return;
+
+	mutex_lock(&backend_lock);
+
+	if (pool_id > TMEM_POOL_DEFAULT && pool_id < TMEM_MAX_POOLS && pool_users[pool_id])
+		pool_users[pool_id]--;
+
+	ops = READ_ONCE(tmem_pool_ops);
+	if (ops)
+		ops->destroy(pool_id);
+
+	mutex_unlock(&backend_lock);
+}
+EXPORT_SYMBOL(tmem_pool_destroy);
+
+int tmem_pool_get(int pool_id, void *key, size_t key_len, void *value, size_t *value_len)
+{
+	struct tmem_pool_ops *ops = READ_ONCE(tmem_pool_ops);
+	u64 start = ktime_get_ns();
+	int ret;
+
+	if (!ops)
+		ret = tmem_get(key, key_len, value, value_len);
+	else
+		ret = ops->get(pool_id, key, key_len, value, value_len);
+
+	tmem_hist_record(&latency, TMEM_HIST_GET, start);
+
+	return ret;
+}
+EXPORT_SYMBOL(tmem_pool_get);
+
+int tmem_pool_put(int pool_id, void *key, size_t key_len, void *value, size_t value_len)
+{
+	struct tmem_pool_ops *ops = READ_ONCE(tmem_pool_ops);
+	u64 start = ktime_get_ns();
+	int ret;
+
+	if (pool_id == TMEM_POOL_DEFAULT && !READ_ONCE(default_used))
+		WRITE_ONCE(default_used, true);
+
+	if (!ops)
+		ret = tmem_put(key, key_len, value, value_len);
+	else
+		ret = ops->put(pool_id, key, key_len, value, value_len);
+
+	tmem_hist_record(&latency, TMEM_HIST_PUT, start);
+
+	return ret;
+}
+EXPORT_SYMBOL(tmem_pool_put);
+
+void tmem_pool_invalidate(int pool_id, void *key, size_t key_len)
+{
+	struct tmem_pool_ops *ops = READ_ONCE(tmem_pool_ops);
+	u64 start = ktime_get_ns();
+
+	if (!ops)
+		tmem_invalidate(key, key_len);
+	else
+		ops->invalidate(pool_id, key, key_len);
+
+	tmem_hist_record(&latency, TMEM_HIST_INVALIDATE, start);
+}
+EXPORT_SYMBOL(tmem_pool_invalidate);
+
+int tmem_pool_invalidate_all(int pool_id)
+{
+	struct tmem_pool_ops *ops = READ_ONCE(tmem_pool_ops);
+
+	if (pool_id == TMEM_POOL_DEFAULT)
+		return -EPERM;
+
+	/* Without pools there is only the keyspace everybody shares */
+	if (!ops)
+		return -EOPNOTSUPP;
+
+	ops->invalidate_all(pool_id);
+
+	return 0;
+}
+EXPORT_SYMBOL(tmem_pool_invalidate_all);
+
+/* Backends cannot be unloaded, so their names and ops stay valid */
+static DEFINE_MUTEX(tier_lock);
+static struct {
+	const char *name;
+	struct tmem_ops *ops;
+} tier_backends[TMEM_TIER_BACKENDS];
+
+void register_tmem_tier_ops(const char *name, struct tmem_ops *ops)
+{
+	int i;
+
+	mutex_lock(&tier_lock);
+	for (i = 0; i < TMEM_TIER_BACKENDS; i++) {
+		if (!tier_backends[i].name || !strcmp(tier_backends[i].name, name)) {
+			tier_backends[i].name = name;
+			tier_backends[i].ops = ops;
+			break;
+		}
+	}
+	mutex_unlock(&tier_lock);
+
+	if (i == TMEM_TIER_BACKENDS)
+		pr_err("no room to offer %s for tiering\n", name);
+}
+EXPORT_SYMBOL(register_tmem_tier_ops);
+
+struct tmem_ops *tmem_tier_lookup_ops(const char *name)
+{
+	struct tmem_ops *ops = NULL;
+	int i;
+
+	mutex_lock(&tier_lock);
+	for (i = 0; i < TMEM_TIER_BACKENDS && tier_backends[i].name; i++) {
+		if (!strcmp(tier_backends[i].name, name)) {
+			ops = tier_backends[i].ops;
+			break;
+		}
+	}
+	mutex_unlock(&tier_lock);
+
+	return ops;
+}
+EXPORT_SYMBOL(tmem_tier_lookup_ops);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	return tmem_hist_show(m, &latency);
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int __init tmem_pool_init(void)
+{
+	struct dentry *root;
+
+	root = debugfs_create_dir("tmem_pool", NULL);
+	if (IS_ERR_OR_NULL(root) || !debugfs_create_file("latency", S_IRUGO, root, NULL, &latency_fops))
+		pr_err("debugfs entry could not be set up\n");
+
+	return 0;
+}
+
+
+
+module_init(tmem_pool_init);
+MODULE_AUTHOR("Aimilios Tsalapatis");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,63 @@
+#ifndef _TMEM_POOL_H
+#define _TMEM_POOL_H
+
+/*
+ * Pools split the keyspace of a backend in independent parts, each with
+ * its own index and memory limit, that can be flushed without touching
+ * the rest. The tmem_ops of tmem/tmem_ops.h always act on the default
+ * pool. Backends register both through register_tmem_backend(), so that
+ * the pool operations always belong to the registered tmem_ops; backends
+ * without pools pass NULL, and every pool is then their single keyspace
+ */
+
+#include <linux/types.h>
+
+/* Always exists, and is shared by every frontend, so none of them gets to flush it */
+#define TMEM_POOL_DEFAULT (0)
+#define TMEM_MAX_POOLS (64)
+
+/*
+ * Entries of ephemeral pools may be dropped by the backend at any time,
+ * e.g. to make room for new ones; persistent pools fail puts instead
+ */
+#define TMEM_POOL_EPHEMERAL (1 << 0)
+
+struct tmem_pool_ops {
+	/* Returns the new pool id, or a negative error; a limit of 0 means the backend default */
+	int (*create)(u64 limit, u32 flags);
+	void (*destroy)(int pool_id);
+	int (*get)(int pool_id, void *key, size_t key_len, void *value, size_t *value_len);
+	int (*put)(int pool_id, void *key, size_t key_len, void *value, size_t value_len);
+	void (*invalidate)(int pool_id, void *key, size_t key_len);
+	void (*invalidate_all)(int pool_id);
+};
+
+struct tmem_ops;
+
+extern void register_tmem_backend(struct tmem_ops *ops, struct tmem_pool_ops *pool_ops);
+/*
+ * Same, for backends stacked over the registered ones: fails with -EBUSY
+ * while frontends hold pools or default pool values in the current backend,
+ * which would be stranded behind the new one
+ */
+extern int replace_tmem_backend(struct tmem_ops *ops, struct tmem_pool_ops *pool_ops);
+
+/*
+ * Only one backend can be registered with tmem at a time, so every backend
+ * also offers its tmem_ops here under its module name; tmem_tier looks two
+ * of them up to stack them behind its own
+ */
+#define TMEM_TIER_BACKENDS (16)
+
+extern void register_tmem_tier_ops(const char *name, struct tmem_ops *ops);
+extern struct tmem_ops *tmem_tier_lookup_ops(const char *name);
+
+extern int tmem_pool_create(u64 limit, u32 flags);
+extern void tmem_pool_destroy(int pool_id);
+extern int tmem_pool_get(int pool_id, void *key, size_t key_len, void *value, size_t *value_len);
+extern int tmem_pool_put(int pool_id, void *key, size_t key_len, void *value, size_t value_len);
+extern void tmem_pool_invalidate(int pool_id, void *key, size_t key_len);
+/* -EPERM for the default pool, -EOPNOTSUPP when the backend has no pools */
+extern int tmem_pool_invalidate_all(int pool_id);
+
+#endif /* _TMEM_POOL_H */
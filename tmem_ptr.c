@@ -5,35 +5,130 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/list.h>
-#include <linux/hashtable.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/hash.h>
 #include <linux/string.h>
 #include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/moduleparam.h>
+#include <linux/shrinker.h>
 
 #include <tmem/tmem_ops.h> 
 
-static u64 current_memory; 
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
+/* The values handed over to us, which we free when their entries go away */
+static atomic64_t current_memory; 
 
 struct page_list {
-	struct hlist_node hash_node;
+	struct rhash_head hash_node;
+	struct rcu_head rcu;
 	void *key;
 	size_t key_len;
 	void *value;
 	size_t value_len;
+	/* Place in the reclaim queue, see tmem_ptr_shrink_scan() */
+	struct list_head lru;
+	atomic_t state;
+};
+
+/*
+ * Gets hand out the value itself, so once an entry has been read the
+ * shrinker must leave it to invalidates; it only takes entries still idle
+ */
+enum {
+	PAGE_LIST_IDLE,
+	PAGE_LIST_HANDED,
+	PAGE_LIST_RECLAIM,
 };
 
-DEFINE_SPINLOCK(used_lock); 
-DEFINE_HASHTABLE(used_pages, 10);   
+TMEM_DEFINE_OBJ_FNS(struct page_list)
+
+/* 
+ * The whole key is hashed, and the table grows and shrinks 
+ * with the number of entries it holds
+ */
+static const struct rhashtable_params used_pages_params = {
+	.head_offset = offsetof(struct page_list, hash_node),
+	.hashfn = tmem_key_hashfn,
+	.obj_hashfn = tmem_obj_hashfn,
+	.obj_cmpfn = tmem_obj_cmpfn,
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable used_pages;
+
+static struct tmem_lock_shard used_locks[TMEM_LOCK_SHARDS];
 
-#define TMEM_POOL_ID (0) 
-#define TMEM_OBJ_ID (0) 
 #define TMEM_POOL_SIZE (1024 * 1024 * 1024) 
 
-int tmem_ptr_put_page(void *key, size_t key_len, void *value, size_t value_len)
+static unsigned long pool_size = TMEM_POOL_SIZE;
+module_param(pool_size, ulong, 0644);
+MODULE_PARM_DESC(pool_size, "Memory limit in bytes, can be changed at runtime");
+
+/* 
+ * Nothing tells us whether what we hold can be dropped, so reclaim 
+ * leaves it alone unless the store is declared ephemeral
+ */
+static bool ephemeral;
+module_param(ephemeral, bool, 0644);
+MODULE_PARM_DESC(ephemeral, "Let the kernel reclaim entries not read yet under memory pressure");
+
+/* Entries that may be reclaimed, oldest first */
+static DEFINE_SPINLOCK(lru_lock);
+static LIST_HEAD(lru_list);
+static unsigned long nr_lru;
+
+static atomic64_t shrinker_scans;
+static atomic64_t shrinker_freed;
+
+/* Called with the shard of the entry locked, so it cannot be removed before it is queued */
+static void page_list_lru_add(struct page_list *page_entry, struct page_list *old_entry)
+{
+	spin_lock(&lru_lock);
+	if (old_entry && !list_empty(&old_entry->lru)) {
+		list_replace_init(&old_entry->lru, &page_entry->lru);
+	} else {
+		list_add_tail(&page_entry->lru, &lru_list);
+		nr_lru++;
+	}
+	spin_unlock(&lru_lock);
+}
+
+/* Has to happen before the entry is freed */
+static void page_list_lru_del(struct page_list *page_entry)
+{
+	spin_lock(&lru_lock);
+	if (!list_empty(&page_entry->lru)) {
+		list_del_init(&page_entry->lru);
+		nr_lru--;
+	}
+	spin_unlock(&lru_lock);
+}
+
+static void page_list_free_rcu(struct rcu_head *rcu)
 {
-	struct page_list *page_entry = NULL;
-	int already_exists = 0;
-	unsigned long flags;
+	struct page_list *page_entry = container_of(rcu, struct page_list, rcu);
+
+	kfree(page_entry->value);
+	kfree(page_entry->key);
+	kfree(page_entry);
+}
+
+static int __tmem_ptr_put_page(void *key, size_t key_len, void *value, size_t value_len)
+{
+	struct page_list *page_entry = NULL, *old_entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+	long delta;
 	int ret = -1;
 
 //	pr_debug("entering put_page\n");
@@ -41,55 +136,65 @@ int tmem_ptr_put_page(void *key, size_t key_len, void *value, size_t value_len)
 	pr_err("PUT: Key %s", (char *) key);
 	pr_err("PUT: Value %s", (char *) value);
 */
-	/* If the page already exists, update it */
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each_possible(used_pages, page_entry, hash_node, *(char *) key) {
-		if (page_entry->key_len == key_len && !memcmp(page_entry->key, key, key_len)) {
-			already_exists = 1;
-			break;
-		}
-		/*
-		pr_err("GET: Key %s", (char *) page_entry->key);
-		pr_err("GET: Value %s", (char *) page_entry->value);
-		pr_err("GET: Keylen %lu", page_entry->key_len);
-		*/	
-	}
-	spin_unlock_irqrestore(&used_lock, flags);
+	/* 
+	 * Gets read entries without taking any locks, so we never update one 
+	 * in place; a new entry replaces the old one in the index instead
+	 */
+	page_entry = kzalloc(sizeof(*page_entry), GFP_KERNEL);
+	if (!page_entry)
+		goto out_mem;
+
+	page_entry->key = key;
+	page_entry->key_len = key_len;
+	page_entry->value = value;
+	page_entry->value_len = value_len;
+	INIT_LIST_HEAD(&page_entry->lru);
+	atomic_set(&page_entry->state, PAGE_LIST_IDLE);
 
-	/* Or else get a new one */
-	if (!already_exists) {	
-//		pr_err("Doesn't already exist");
-/*
-		if (current_memory + PAGE_SIZE > TMEM_POOL_SIZE) 
-		    goto out_pool;
-*/
-		
-		page_entry = kzalloc(sizeof(*page_entry), GFP_KERNEL);
-		if (!page_entry)
-			goto out_mem;
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
 
-		page_entry->key = key;
-		page_entry->key_len = key_len;
-        
-	} else {
+	old_entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
 
-		//pr_err("Already exists");
-		kfree(key);
-		kfree(page_entry->value);
+	delta = value_len;
+	if (old_entry)
+		delta -= old_entry->value_len;
 
+	if (delta > 0 && 
+	    atomic64_add_return(delta, &current_memory) > READ_ONCE(pool_size)) {
+		atomic64_sub(delta, &current_memory);
+		spin_unlock(lock);
+		kfree(page_entry);
+		ret = -1;
+		goto out_insert;
 	}
 
-	page_entry->value = value;
-	page_entry->value_len = value_len;
+	if (old_entry)
+		ret = rhashtable_replace_fast(&used_pages, &old_entry->hash_node, 
+				&page_entry->hash_node, used_pages_params);
+	else
+		ret = rhashtable_insert_fast(&used_pages, &page_entry->hash_node, 
+				used_pages_params);
 
+	if (!ret)
+		page_list_lru_add(page_entry, old_entry);
 
-	if(!already_exists){
-		spin_lock_irqsave(&used_lock, flags);
-		hash_add(used_pages, &page_entry->hash_node, *(char *)key);
-		spin_unlock_irqrestore(&used_lock, flags);
-	
-		/* Turn off accounting for now */
-		current_memory += 0;
+	spin_unlock(lock);
+
+	if (ret) {
+		if (delta > 0)
+			atomic64_sub(delta, &current_memory);
+		kfree(page_entry);
+		goto out_insert;
+	}
+
+	if (delta < 0)
+		atomic64_add(delta, &current_memory);
+
+	/* The old key and value go away along with the entry holding them */
+	if (old_entry) {
+		page_list_lru_del(old_entry);
+		call_rcu(&old_entry->rcu, page_list_free_rcu);
 	}
 	
 	pr_debug("leaving put_page\n");
@@ -98,51 +203,49 @@ int tmem_ptr_put_page(void *key, size_t key_len, void *value, size_t value_len)
 
 out_mem:
 
-    kfree(key);
-    kfree(value);
-
-    if (page_entry)
-        kfree(page_entry);
-
-    pr_err("leaving put_page - not enough memory\n");
-    
     ret = -ENOMEM;
 
-out_pool:
+out_insert:
+
+    kfree(key);
+    kfree(value);
 
-    pr_debug("leaving put_page - failed\n");
+    pr_err("leaving put_page - could not add the page\n");
     
     return ret;
 }
 
 
-int tmem_ptr_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+static int __tmem_ptr_get_page(void *key, size_t key_len, void *value, size_t *value_len)
 {
 	struct page_list *page_entry;
-	unsigned long flags;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
 	unsigned long *address = (unsigned long *) value;
 
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each_possible(used_pages, page_entry, hash_node, *(char *) key) {
-		if (page_entry->key_len == key_len && !memcmp(page_entry->key, key, key_len)) {
+	/* Entries are only freed after a grace period, so nothing is shared but the index */
+	rcu_read_lock();
+	page_entry = rhashtable_lookup(&used_pages, &tmem_key, used_pages_params);
+	/* Lost to the shrinker, which is about to free the value */
+	if (page_entry && 
+	    atomic_cmpxchg(&page_entry->state, PAGE_LIST_IDLE, 
+			    PAGE_LIST_HANDED) == PAGE_LIST_RECLAIM)
+		page_entry = NULL;
 
-			*value_len = page_entry->value_len;
-			*address = (unsigned long) page_entry->value;
+	if (page_entry) {
+		*value_len = page_entry->value_len;
+		*address = (unsigned long) page_entry->value;
 
-			spin_unlock_irqrestore(&used_lock, flags);
+		rcu_read_unlock();
 
-			kfree(key);
+		kfree(key);
 
-			return 0;
-		}
-		/*
-		pr_err("GET: Key %s", (char *) page_entry->key);
-		pr_err("GET: Value %s", (char *) page_entry->value);
-		pr_err("GET: Keylen %lu", page_entry->key_len);
-		*/
+		return 0;
 	}
 
-	spin_unlock_irqrestore(&used_lock, flags);
+	rcu_read_unlock();
 
 	*address = (long) NULL;
 	*value_len = 0;
@@ -152,36 +255,40 @@ int tmem_ptr_get_page(void *key, size_t key_len, void *value, size_t *value_len)
 	return -EINVAL;
 }
 
-void tmem_ptr_invalidate_page(void *key, size_t key_len)
+static void __tmem_ptr_invalidate_page(void *key, size_t key_len)
 {
 	struct page_list *page_entry;
-	unsigned long flags;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
 
 	pr_debug("entering invalidate_page\n");
 
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each_possible(used_pages, page_entry, hash_node, *(char *) key) {
-		if (!memcmp(page_entry->key, key, min(page_entry->key_len, key_len))) {
-			hash_del(&page_entry->hash_node);
-			spin_unlock_irqrestore(&used_lock, flags);
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+	page_entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (page_entry && !rhashtable_remove_fast(&used_pages, &page_entry->hash_node, 
+				used_pages_params)) {
+		spin_unlock(lock);
 
-			kfree(page_entry->value);
-			kfree(page_entry->key);
-			kfree(page_entry);
+		atomic64_sub(page_entry->value_len, &current_memory);
+		page_list_lru_del(page_entry);
 
-			kfree(key);
+		/* Lookups may still be walking past it, so wait for them */
+		call_rcu(&page_entry->rcu, page_list_free_rcu);
 
-			//pr_debug("leaving invalidate_page\n");
+		kfree(key);
 
-			//current_memory -= PAGE_SIZE;
+		//pr_debug("leaving invalidate_page\n");
 
-			return;
-		}
+		return;
 	}
 
 	kfree(key);
 
-	spin_unlock_irqrestore(&used_lock, flags);
+	spin_unlock(lock);
 	pr_debug("leaving invalidate_page - key not present\n");
 
 	return;
@@ -192,24 +299,138 @@ void tmem_ptr_invalidate_page(void *key, size_t key_len)
 void tmem_ptr_invalidate_area(void)
 {
 	struct page_list *page_entry;
-	unsigned long flags;
-	int bkt;
+	struct rhashtable_iter iter;
+	spinlock_t *lock;
+	int ret;
 
 	pr_debug("entering invalidate_area\n");
+	trace_tmem_invalidate_area(KBUILD_MODNAME, TMEM_POOL_DEFAULT);
 
-	spin_lock_irqsave(&used_lock, flags);
-	hash_for_each(used_pages, bkt, page_entry, hash_node) {
-		hash_del(&page_entry->hash_node);
+	rhashtable_walk_enter(&used_pages, &iter);
+	rhashtable_walk_start(&iter);
 
-		kfree(page_entry->key);
-		kfree(page_entry->value);
-		kfree(page_entry);
+	while ((page_entry = rhashtable_walk_next(&iter)) != NULL) {
+		/* The table got resized under us, keep going from where we are */
+		if (IS_ERR(page_entry)) {
+			if (PTR_ERR(page_entry) == -EAGAIN)
+				continue;
+			break;
+		}
+
+		/* Do not race with a put replacing this same entry */
+		lock = tmem_key_lock(used_locks, page_entry->key, page_entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&used_pages, &page_entry->hash_node, 
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (ret)
+			continue;
 
+		atomic64_sub(page_entry->value_len, &current_memory);
+		page_list_lru_del(page_entry);
+		call_rcu(&page_entry->rcu, page_list_free_rcu);
 	}
-	spin_unlock_irqrestore(&used_lock, flags);
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
 	pr_debug("leaving invalidate_area\n");
 }
 
+static unsigned long tmem_ptr_shrink_count(struct shrinker *shrinker, 
+		struct shrink_control *sc)
+{
+	if (!READ_ONCE(ephemeral))
+		return 0;
+
+	return READ_ONCE(nr_lru);
+}
+
+/* Entries looked at per victim, so that one call never walks the whole queue under lru_lock */
+#define TMEM_PTR_SCAN (1024)
+
+/* 
+ * Takes the oldest entry nobody was handed off the queue, claiming it so
+ * that gets miss it from then on; handed out entries leave the queue for good
+ */
+static struct page_list *tmem_ptr_victim(void)
+{
+	struct page_list *page_entry;
+	unsigned long scanned = 0;
+	int state;
+
+	spin_lock(&lru_lock);
+	while (scanned++ < TMEM_PTR_SCAN) {
+		page_entry = list_first_entry_or_null(&lru_list, struct page_list, lru);
+		if (!page_entry)
+			break;
+
+		list_del_init(&page_entry->lru);
+		nr_lru--;
+
+		state = atomic_cmpxchg(&page_entry->state, PAGE_LIST_IDLE, 
+				PAGE_LIST_RECLAIM);
+		if (state != PAGE_LIST_IDLE)
+			continue;
+
+		spin_unlock(&lru_lock);
+
+		return page_entry;
+	}
+	spin_unlock(&lru_lock);
+
+	return NULL;
+}
+
+static unsigned long tmem_ptr_shrink_scan(struct shrinker *shrinker, 
+		struct shrink_control *sc)
+{
+	struct page_list *page_entry;
+	unsigned long freed = 0;
+	spinlock_t *lock;
+	int ret;
+
+	if (!READ_ONCE(ephemeral))
+		return SHRINK_STOP;
+
+	atomic64_inc(&shrinker_scans);
+
+	/* Victims cannot be freed under us once they are off the queue */
+	rcu_read_lock();
+	while (freed < sc->nr_to_scan) {
+		page_entry = tmem_ptr_victim();
+		if (!page_entry)
+			break;
+
+		lock = tmem_key_lock(used_locks, page_entry->key, page_entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&used_pages, &page_entry->hash_node, 
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (ret)
+			continue;
+
+		atomic64_sub(page_entry->value_len, &current_memory);
+		call_rcu(&page_entry->rcu, page_list_free_rcu);
+		freed++;
+	}
+	rcu_read_unlock();
+
+	atomic64_add(freed, &shrinker_freed);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker tmem_ptr_shrinker = {
+	.count_objects = tmem_ptr_shrink_count,
+	.scan_objects = tmem_ptr_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+	.batch = 128,
+};
+
+TMEM_DEFINE_TRACED_OPS(tmem_ptr)
+
 struct tmem_ops tmem_naive_ops = {
 	.get = tmem_ptr_get_page,
 	.put = tmem_ptr_put_page,
@@ -217,22 +438,70 @@ struct tmem_ops tmem_naive_ops = {
 	.invalidate_all = tmem_ptr_invalidate_area,
 };
 
+static int current_memory_get(void *data, u64 *val)
+{
+	*val = atomic64_read(&current_memory);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(current_memory_fops, current_memory_get, NULL, "%llu\n");
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+/* How many entries reclaim asks for at a time, read by the kernel on every pass */
+static int shrinker_batch_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(tmem_ptr_shrinker.batch);
+
+	return 0;
+}
+
+static int shrinker_batch_set(void *data, u64 val)
+{
+	if (!val || val > LONG_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(tmem_ptr_shrinker.batch, val);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(shrinker_batch_fops, shrinker_batch_get, shrinker_batch_set, "%llu\n");
+
 static int __init tmem_ptr_init(void)
 {
 	struct dentry *root;
+	int ret, i;
+
+	atomic64_set(&current_memory, 0);
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++)
+		spin_lock_init(&used_locks[i].lock);
+
+	ret = rhashtable_init(&used_pages, &used_pages_params);
+	if (ret)
+		return ret;
 
-	current_memory = 0;
-	hash_init(used_pages);
+	if (register_shrinker(&tmem_ptr_shrinker))
+		pr_err("shrinker could not be registered\n");
 
-	register_tmem_ops(&tmem_naive_ops);	
+	register_tmem_backend(&tmem_naive_ops, NULL);
+	register_tmem_tier_ops(KBUILD_MODNAME, &tmem_naive_ops);
 
-	root = debugfs_create_dir("tmem", NULL);
-	if (root == NULL) {
+	root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root)) {
 		pr_err("debugfs directory could not be set up\n");
 		goto out;
 	}
 
-	if (!debugfs_create_u64("current_memory", S_IRUGO, root, &current_memory)) 
+	if (!debugfs_create_file("current_memory", S_IRUGO, root, NULL, &current_memory_fops) ||
+	    !debugfs_create_file("shrinker_scans", S_IRUGO, root, &shrinker_scans, &atomic_stat_fops) ||
+	    !debugfs_create_file("shrinker_freed", S_IRUGO, root, &shrinker_freed, &atomic_stat_fops) ||
+	    !debugfs_create_file("shrinker_batch", S_IRUGO | S_IWUSR, root, NULL, &shrinker_batch_fops)) 
 		pr_err("debugfs entry could not be set up\n");
 
 out:
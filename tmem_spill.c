@@ -0,0 +1,844 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/kref.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
+
+#include <tmem/tmem_ops.h>
+
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
+/*
+ * Values are kept in a preallocated file or block device, one slot of
+ * TMEM_SPILL_SLOT bytes each, and only the index lives in memory. Puts
+ * are queued with their value in memory and written out in batches by
+ * direct, asynchronous I/O; values stay cached in memory after that, up
+ * to cache_size bytes, and gets that miss the cache read their slot back
+ */
+#define TMEM_SPILL_SLOT (PAGE_ALIGN(TMEM_MAX))
+#define TMEM_SPILL_ORDER (get_order(TMEM_SPILL_SLOT))
+
+static char *path;
+module_param(path, charp, S_IRUGO);
+MODULE_PARM_DESC(path, "File or block device holding the values");
+
+static unsigned long size;
+module_param(size, ulong, S_IRUGO);
+MODULE_PARM_DESC(size, "Bytes of it to use, 0 for all of it; files get preallocated to this size");
+
+static unsigned long cache_size = 64 << 20;
+module_param(cache_size, ulong, 0644);
+MODULE_PARM_DESC(cache_size, "Memory in bytes for values, both cached and waiting to be written");
+
+static unsigned int batch = 32;
+module_param(batch, uint, 0644);
+MODULE_PARM_DESC(batch, "Number of queued puts that start a write batch right away");
+
+static struct file *spill_file;
+static struct workqueue_struct *spill_wq;
+
+/* Free slots of the file, handed out from a rotating hint */
+static DEFINE_SPINLOCK(slots_lock);
+static unsigned long *slots;
+static unsigned long nr_slots;
+static unsigned long slots_hint;
+
+static atomic64_t current_memory;
+/* Memory of values queued or being written, which the cache cannot give back */
+static atomic64_t unwritten;
+static atomic64_t stored_bytes;
+static atomic64_t used_slots;
+static atomic64_t cache_hits;
+static atomic64_t cache_misses;
+static atomic64_t writes;
+static atomic64_t write_batches;
+static atomic64_t write_errors;
+static atomic64_t throttled;
+static atomic64_t read_errors;
+
+/* A value in memory, freed after a grace period since gets copy it under RCU */
+struct spill_buf {
+	struct rcu_head rcu;
+	struct page *page;
+};
+
+/*
+ * QUEUED entries are on the pending list, and WRITING ones are in flight;
+ * both keep their value in memory. STORED entries are on disk, and on the
+ * cache list if they still have it in memory too. Entries whose write
+ * failed are kept as MEMORY_ONLY, and never lose their value
+ */
+enum spill_state {
+	SPILL_QUEUED,
+	SPILL_WRITING,
+	SPILL_STORED,
+	SPILL_MEMORY_ONLY,
+};
+
+struct spill_entry {
+	struct rhash_head hash_node;
+	struct rcu_head rcu;
+	struct kref refcount;
+	struct spill_buf __rcu *buf;
+	/* On the pending or the cache list, under list_lock */
+	struct list_head list;
+	enum spill_state state;
+	bool dead;
+	u8 referenced;
+	unsigned long slot;
+	size_t value_len;
+	struct kiocb iocb;
+	struct bio_vec bvec;
+	void *key;
+	size_t key_len;
+	u8 inline_key[TMEM_INLINE_KEY_LEN];
+};
+
+static struct kmem_cache *spill_entry_cache;
+
+/* Write completions take it from interrupt context */
+static DEFINE_SPINLOCK(list_lock);
+static LIST_HEAD(pending_list);
+static unsigned int nr_pending;
+static LIST_HEAD(cache_list);
+
+static void tmem_spill_flush(struct work_struct *work);
+static DECLARE_DELAYED_WORK(flush_work, tmem_spill_flush);
+
+TMEM_DEFINE_OBJ_FNS(struct spill_entry)
+
+static const struct rhashtable_params used_pages_params = {
+	.head_offset = offsetof(struct spill_entry, hash_node),
+	.hashfn = tmem_key_hashfn,
+	.obj_hashfn = tmem_obj_hashfn,
+	.obj_cmpfn = tmem_obj_cmpfn,
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable used_pages;
+
+static struct tmem_lock_shard used_locks[TMEM_LOCK_SHARDS];
+
+static long tmem_spill_slot_alloc(void)
+{
+	unsigned long slot, flags;
+
+	spin_lock_irqsave(&slots_lock, flags);
+	slot = find_next_zero_bit(slots, nr_slots, slots_hint);
+	if (slot >= nr_slots)
+		slot = find_first_zero_bit(slots, nr_slots);
+	if (slot < nr_slots) {
+		__set_bit(slot, slots);
+		slots_hint = slot + 1;
+	}
+	spin_unlock_irqrestore(&slots_lock, flags);
+
+	if (slot >= nr_slots)
+		return -ENOSPC;
+
+	atomic64_inc(&used_slots);
+
+	return slot;
+}
+
+static void tmem_spill_slot_free(unsigned long slot)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&slots_lock, flags);
+	__clear_bit(slot, slots);
+	spin_unlock_irqrestore(&slots_lock, flags);
+
+	atomic64_dec(&used_slots);
+}
+
+/* Values are read and written with direct I/O, so they get whole pages */
+static struct spill_buf *spill_buf_alloc(void)
+{
+	struct spill_buf *buf;
+
+	buf = kmalloc(sizeof(*buf), GFP_NOIO);
+	if (!buf)
+		return NULL;
+
+	buf->page = alloc_pages(GFP_NOIO | __GFP_NOWARN, TMEM_SPILL_ORDER);
+	if (!buf->page) {
+		kfree(buf);
+		return NULL;
+	}
+
+	atomic64_add(TMEM_SPILL_SLOT, &current_memory);
+
+	return buf;
+}
+
+static void spill_buf_free_rcu(struct rcu_head *rcu)
+{
+	struct spill_buf *buf = container_of(rcu, struct spill_buf, rcu);
+
+	__free_pages(buf->page, TMEM_SPILL_ORDER);
+	kfree(buf);
+}
+
+static void spill_buf_free(struct spill_buf *buf)
+{
+	atomic64_sub(TMEM_SPILL_SLOT, &current_memory);
+	call_rcu(&buf->rcu, spill_buf_free_rcu);
+}
+
+static struct spill_entry *spill_entry_alloc(void *key, size_t key_len)
+{
+	struct spill_entry *entry;
+
+	entry = kmem_cache_zalloc(spill_entry_cache, GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	if (key_len <= TMEM_INLINE_KEY_LEN) {
+		entry->key = entry->inline_key;
+	} else {
+		entry->key = kmalloc(key_len, GFP_NOIO);
+		if (!entry->key) {
+			kmem_cache_free(spill_entry_cache, entry);
+			return NULL;
+		}
+	}
+
+	memcpy(entry->key, key, key_len);
+	entry->key_len = key_len;
+	INIT_LIST_HEAD(&entry->list);
+	kref_init(&entry->refcount);
+
+	return entry;
+}
+
+static void spill_entry_free(struct spill_entry *entry)
+{
+	if (entry->key != entry->inline_key)
+		kfree(entry->key);
+
+	kmem_cache_free(spill_entry_cache, entry);
+}
+
+static void spill_entry_free_rcu(struct rcu_head *rcu)
+{
+	spill_entry_free(container_of(rcu, struct spill_entry, rcu));
+}
+
+/*
+ * The slot and the value go away with the last reference, which can be
+ * dropped by a write completion; the entry itself only after a grace
+ * period since lookups do not hold any locks
+ */
+static void spill_entry_release(struct kref *kref)
+{
+	struct spill_entry *entry = container_of(kref, struct spill_entry, refcount);
+	struct spill_buf *buf = rcu_dereference_protected(entry->buf, 1);
+
+	if (buf)
+		spill_buf_free(buf);
+
+	tmem_spill_slot_free(entry->slot);
+	atomic64_sub(entry->value_len, &stored_bytes);
+
+	call_rcu(&entry->rcu, spill_entry_free_rcu);
+}
+
+/* Takes the entry off its list once it has left the index */
+static void spill_entry_unlink(struct spill_entry *entry)
+{
+	struct spill_buf *buf = NULL;
+	bool queued = false;
+	unsigned long flags;
+
+	spin_lock_irqsave(&list_lock, flags);
+	entry->dead = true;
+
+	if (entry->state == SPILL_QUEUED) {
+		list_del_init(&entry->list);
+		nr_pending--;
+		atomic64_sub(TMEM_SPILL_SLOT, &unwritten);
+		queued = true;
+	} else if (entry->state == SPILL_STORED && !list_empty(&entry->list)) {
+		list_del_init(&entry->list);
+		buf = rcu_dereference_protected(entry->buf, lockdep_is_held(&list_lock));
+		RCU_INIT_POINTER(entry->buf, NULL);
+	}
+	spin_unlock_irqrestore(&list_lock, flags);
+
+	if (buf)
+		spill_buf_free(buf);
+
+	/* The write it was queued for will not happen now */
+	if (queued)
+		kref_put(&entry->refcount, spill_entry_release);
+
+	kref_put(&entry->refcount, spill_entry_release);
+}
+
+/* Drops cached values in CLOCK order until the memory limit holds again */
+#define TMEM_SPILL_SCAN (1024)
+
+static void tmem_spill_cache_shrink(void)
+{
+	struct spill_entry *entry;
+	struct spill_buf *buf;
+	int scanned = 0;
+
+	spin_lock_irq(&list_lock);
+	while (atomic64_read(&current_memory) > READ_ONCE(cache_size) &&
+	       !list_empty(&cache_list) && scanned++ < TMEM_SPILL_SCAN) {
+		entry = list_first_entry(&cache_list, struct spill_entry, list);
+
+		if (READ_ONCE(entry->referenced)) {
+			WRITE_ONCE(entry->referenced, 0);
+			list_move_tail(&entry->list, &cache_list);
+			continue;
+		}
+
+		list_del_init(&entry->list);
+		buf = rcu_dereference_protected(entry->buf, lockdep_is_held(&list_lock));
+		RCU_INIT_POINTER(entry->buf, NULL);
+		spill_buf_free(buf);
+	}
+	spin_unlock_irq(&list_lock);
+}
+
+static void tmem_spill_iocb_init(struct kiocb *iocb, struct bio_vec *bvec,
+		struct page *page, unsigned long slot,
+		void (*complete)(struct kiocb *, long, long))
+{
+	bvec->bv_page = page;
+	bvec->bv_len = TMEM_SPILL_SLOT;
+	bvec->bv_offset = 0;
+
+	/* The file is open with O_DIRECT, and a completion makes it asynchronous */
+	init_sync_kiocb(iocb, spill_file);
+	iocb->ki_pos = (loff_t) slot * TMEM_SPILL_SLOT;
+	iocb->ki_complete = complete;
+}
+
+static void tmem_spill_write_done(struct kiocb *iocb, long ret, long ret2)
+{
+	struct spill_entry *entry = container_of(iocb, struct spill_entry, iocb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&list_lock, flags);
+	if (ret != TMEM_SPILL_SLOT) {
+		entry->state = SPILL_MEMORY_ONLY;
+		atomic64_inc(&write_errors);
+	} else {
+		entry->state = SPILL_STORED;
+		if (!entry->dead)
+			list_add_tail(&entry->list, &cache_list);
+	}
+	spin_unlock_irqrestore(&list_lock, flags);
+
+	atomic64_sub(TMEM_SPILL_SLOT, &unwritten);
+	atomic64_inc(&writes);
+
+	kref_put(&entry->refcount, spill_entry_release);
+}
+
+static void tmem_spill_write(struct spill_entry *entry)
+{
+	struct spill_buf *buf = rcu_dereference_protected(entry->buf, 1);
+	struct iov_iter iter;
+	ssize_t ret;
+
+	tmem_spill_iocb_init(&entry->iocb, &entry->bvec, buf->page, entry->slot,
+			tmem_spill_write_done);
+	iov_iter_bvec(&iter, WRITE, &entry->bvec, 1, TMEM_SPILL_SLOT);
+
+	ret = call_write_iter(spill_file, &entry->iocb, &iter);
+	if (ret != -EIOCBQUEUED)
+		tmem_spill_write_done(&entry->iocb, ret, 0);
+}
+
+/* Writes out everything queued, plugged so that the block layer can merge it */
+static void tmem_spill_flush(struct work_struct *work)
+{
+	struct spill_entry *entry, *tmp;
+	struct blk_plug plug;
+	LIST_HEAD(entries);
+
+	spin_lock_irq(&list_lock);
+	list_splice_init(&pending_list, &entries);
+	nr_pending = 0;
+	list_for_each_entry(entry, &entries, list)
+		entry->state = SPILL_WRITING;
+	spin_unlock_irq(&list_lock);
+
+	if (list_empty(&entries))
+		return;
+
+	atomic64_inc(&write_batches);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(entry, tmp, &entries, list) {
+		list_del_init(&entry->list);
+		tmem_spill_write(entry);
+	}
+	blk_finish_plug(&plug);
+}
+
+struct spill_read {
+	struct kiocb iocb;
+	struct completion done;
+	long ret;
+};
+
+static void tmem_spill_read_done(struct kiocb *iocb, long ret, long ret2)
+{
+	struct spill_read *read = container_of(iocb, struct spill_read, iocb);
+
+	read->ret = ret;
+	complete(&read->done);
+}
+
+static int tmem_spill_read(struct page *page, unsigned long slot)
+{
+	struct spill_read read;
+	struct bio_vec bvec;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	init_completion(&read.done);
+	tmem_spill_iocb_init(&read.iocb, &bvec, page, slot, tmem_spill_read_done);
+	iov_iter_bvec(&iter, READ, &bvec, 1, TMEM_SPILL_SLOT);
+
+	ret = call_read_iter(spill_file, &read.iocb, &iter);
+	if (ret != -EIOCBQUEUED)
+		tmem_spill_read_done(&read.iocb, ret, 0);
+
+	wait_for_completion(&read.done);
+
+	if (read.ret != TMEM_SPILL_SLOT) {
+		atomic64_inc(&read_errors);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int __tmem_spill_put_page(void *key, size_t key_len, void *value, size_t value_len)
+{
+	struct spill_entry *entry, *old_entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	struct spill_buf *buf;
+	spinlock_t *lock;
+	unsigned int queued;
+	long slot;
+	int ret;
+
+	pr_debug("entering put_page\n");
+
+	if (value_len > TMEM_MAX)
+		return -EINVAL;
+
+	tmem_spill_cache_shrink();
+
+	/* The device is behind, make it catch up instead of queueing more */
+	if (atomic64_read(&unwritten) >= READ_ONCE(cache_size)) {
+		mod_delayed_work(spill_wq, &flush_work, 0);
+		atomic64_inc(&throttled);
+		pr_debug("leaving put_page - too many values waiting to be written\n");
+		return -ENOMEM;
+	}
+
+	entry = spill_entry_alloc(key, key_len);
+	if (!entry)
+		return -ENOMEM;
+
+	buf = spill_buf_alloc();
+	if (!buf) {
+		spill_entry_free(entry);
+		return -ENOMEM;
+	}
+
+	slot = tmem_spill_slot_alloc();
+	if (slot < 0) {
+		spill_buf_free(buf);
+		spill_entry_free(entry);
+		pr_debug("leaving put_page - store full\n");
+		return slot;
+	}
+
+	memcpy(page_address(buf->page), value, value_len);
+	RCU_INIT_POINTER(entry->buf, buf);
+	entry->slot = slot;
+	entry->value_len = value_len;
+	atomic64_add(value_len, &stored_bytes);
+
+	/* The index holds one reference, the write the other */
+	kref_get(&entry->refcount);
+
+	/* Queued before it can be found, so that an invalidate always finds it on a list */
+	spin_lock_irq(&list_lock);
+	entry->state = SPILL_QUEUED;
+	list_add_tail(&entry->list, &pending_list);
+	queued = ++nr_pending;
+	atomic64_add(TMEM_SPILL_SLOT, &unwritten);
+	spin_unlock_irq(&list_lock);
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+
+	old_entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (old_entry)
+		ret = rhashtable_replace_fast(&used_pages, &old_entry->hash_node,
+				&entry->hash_node, used_pages_params);
+	else
+		ret = rhashtable_insert_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+
+	spin_unlock(lock);
+
+	if (ret) {
+		pr_err("leaving put_page - could not add the page\n");
+		spill_entry_unlink(entry);
+		return ret;
+	}
+
+	/* Gets that already found the old entry still hold a reference */
+	if (old_entry)
+		spill_entry_unlink(old_entry);
+
+	/* Full batches go out right away, the rest after a tick */
+	if (queued >= READ_ONCE(batch))
+		mod_delayed_work(spill_wq, &flush_work, 0);
+	else
+		queue_delayed_work(spill_wq, &flush_work, 1);
+
+	pr_debug("leaving put_page\n");
+
+	return 0;
+}
+
+static int __tmem_spill_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+{
+	struct spill_entry *entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	struct spill_buf *buf;
+	unsigned long flags;
+	int ret;
+
+	pr_debug("entering get_page\n");
+
+	rcu_read_lock();
+	entry = rhashtable_lookup(&used_pages, &tmem_key, used_pages_params);
+	if (!entry) {
+		rcu_read_unlock();
+		*value_len = 0;
+		return -EINVAL;
+	}
+
+	buf = rcu_dereference(entry->buf);
+	if (buf) {
+		if (!READ_ONCE(entry->referenced))
+			WRITE_ONCE(entry->referenced, 1);
+
+		memcpy(value, page_address(buf->page), entry->value_len);
+		*value_len = entry->value_len;
+		rcu_read_unlock();
+
+		atomic64_inc(&cache_hits);
+		return 0;
+	}
+
+	/* The slot stays ours for as long as we hold the entry */
+	if (!kref_get_unless_zero(&entry->refcount)) {
+		rcu_read_unlock();
+		*value_len = 0;
+		return -EINVAL;
+	}
+	rcu_read_unlock();
+
+	atomic64_inc(&cache_misses);
+
+	buf = spill_buf_alloc();
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = tmem_spill_read(buf->page, entry->slot);
+	if (ret) {
+		spill_buf_free(buf);
+		goto out;
+	}
+
+	memcpy(value, page_address(buf->page), entry->value_len);
+	*value_len = entry->value_len;
+
+	/* Read values are cached too, unless the entry changed meanwhile */
+	spin_lock_irqsave(&list_lock, flags);
+	if (!entry->dead && entry->state == SPILL_STORED && !rcu_access_pointer(entry->buf)) {
+		rcu_assign_pointer(entry->buf, buf);
+		list_add_tail(&entry->list, &cache_list);
+		buf = NULL;
+	}
+	spin_unlock_irqrestore(&list_lock, flags);
+
+	if (buf)
+		spill_buf_free(buf);
+
+	tmem_spill_cache_shrink();
+
+out:
+	if (ret)
+		*value_len = 0;
+
+	kref_put(&entry->refcount, spill_entry_release);
+
+	pr_debug("leaving get_page\n");
+
+	return ret;
+}
+
+static void __tmem_spill_invalidate_page(void *key, size_t key_len)
+{
+	struct spill_entry *entry;
+	struct tmem_key tmem_key = {
+		.key = key,
+		.key_len = key_len,
+	};
+	spinlock_t *lock;
+
+	pr_debug("entering invalidate_page\n");
+
+	lock = tmem_key_lock(used_locks, key, key_len);
+	spin_lock(lock);
+	entry = rhashtable_lookup_fast(&used_pages, &tmem_key, used_pages_params);
+	if (entry && !rhashtable_remove_fast(&used_pages, &entry->hash_node,
+				used_pages_params)) {
+		spin_unlock(lock);
+
+		spill_entry_unlink(entry);
+
+		pr_debug("leaving invalidate_page\n");
+
+		return;
+	}
+	spin_unlock(lock);
+
+	pr_debug("leaving invalidate_page - key not present\n");
+}
+
+void tmem_spill_invalidate_area(void)
+{
+	struct spill_entry *entry;
+	struct rhashtable_iter iter;
+	spinlock_t *lock;
+	int ret;
+
+	pr_debug("entering invalidate_area\n");
+	trace_tmem_invalidate_area(KBUILD_MODNAME, TMEM_POOL_DEFAULT);
+
+	rhashtable_walk_enter(&used_pages, &iter);
+	rhashtable_walk_start(&iter);
+
+	while ((entry = rhashtable_walk_next(&iter)) != NULL) {
+		/* The table got resized under us, keep going from where we are */
+		if (IS_ERR(entry)) {
+			if (PTR_ERR(entry) == -EAGAIN)
+				continue;
+			break;
+		}
+
+		/* Do not race with a put replacing this same entry */
+		lock = tmem_key_lock(used_locks, entry->key, entry->key_len);
+		spin_lock(lock);
+		ret = rhashtable_remove_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+		spin_unlock(lock);
+
+		if (!ret)
+			spill_entry_unlink(entry);
+	}
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+
+	pr_debug("leaving invalidate_area\n");
+}
+
+TMEM_DEFINE_TRACED_OPS(tmem_spill)
+
+struct tmem_ops tmem_spill_ops = {
+	.get = tmem_spill_get_page,
+	.put = tmem_spill_put_page,
+	.invalidate = tmem_spill_invalidate_page,
+	.invalidate_all = tmem_spill_invalidate_area,
+};
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+/* Files are preallocated, so that writes never have to allocate blocks */
+static int tmem_spill_open(void)
+{
+	struct inode *inode;
+	loff_t avail;
+	int ret;
+
+	if (!path) {
+		pr_err("no file or block device given\n");
+		return -EINVAL;
+	}
+
+	spill_file = filp_open(path, O_RDWR | O_LARGEFILE | O_DIRECT, 0);
+	if (IS_ERR(spill_file)) {
+		ret = PTR_ERR(spill_file);
+		pr_err("could not open %s: %d\n", path, ret);
+		return ret;
+	}
+
+	inode = spill_file->f_mapping->host;
+	avail = i_size_read(inode);
+
+	if (S_ISREG(inode->i_mode) && size > avail) {
+		ret = vfs_fallocate(spill_file, 0, 0, size);
+		if (ret) {
+			pr_err("could not preallocate %lu bytes: %d\n", size, ret);
+			goto out_close;
+		}
+		avail = size;
+	}
+
+	if (size && size < avail)
+		avail = size;
+
+	nr_slots = avail / TMEM_SPILL_SLOT;
+	if (!nr_slots) {
+		pr_err("%s has no room for values\n", path);
+		ret = -ENOSPC;
+		goto out_close;
+	}
+
+	slots = kvcalloc(BITS_TO_LONGS(nr_slots), sizeof(long), GFP_KERNEL);
+	if (!slots) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+
+	return 0;
+
+out_close:
+
+	filp_close(spill_file, NULL);
+
+	return ret;
+}
+
+static int __init tmem_spill_init(void)
+{
+	struct dentry *root;
+	int ret, i;
+
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++)
+		spin_lock_init(&used_locks[i].lock);
+
+	ret = tmem_spill_open();
+	if (ret)
+		return ret;
+
+	spill_entry_cache = kmem_cache_create("tmem_spill_entry",
+			sizeof(struct spill_entry), 0, 0, NULL);
+	if (!spill_entry_cache) {
+		ret = -ENOMEM;
+		goto out_cache;
+	}
+
+	/* Writes are what frees memory under swap, so they must make progress */
+	spill_wq = alloc_workqueue("tmem_spill", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!spill_wq) {
+		ret = -ENOMEM;
+		goto out_wq;
+	}
+
+	ret = rhashtable_init(&used_pages, &used_pages_params);
+	if (ret)
+		goto out_rhashtable;
+
+	register_tmem_backend(&tmem_spill_ops, NULL);
+	register_tmem_tier_ops(KBUILD_MODNAME, &tmem_spill_ops);
+
+	pr_info("storing up to %lu values in %s\n", nr_slots, path);
+
+	root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root)) {
+		pr_err("debugfs directory could not be set up\n");
+		goto out;
+	}
+
+	if (!debugfs_create_file("current_memory", S_IRUGO, root, &current_memory, &atomic_stat_fops) ||
+	    !debugfs_create_file("stored_bytes", S_IRUGO, root, &stored_bytes, &atomic_stat_fops) ||
+	    !debugfs_create_file("used_slots", S_IRUGO, root, &used_slots, &atomic_stat_fops) ||
+	    !debugfs_create_file("cache_hits", S_IRUGO, root, &cache_hits, &atomic_stat_fops) ||
+	    !debugfs_create_file("cache_misses", S_IRUGO, root, &cache_misses, &atomic_stat_fops) ||
+	    !debugfs_create_file("writes", S_IRUGO, root, &writes, &atomic_stat_fops) ||
+	    !debugfs_create_file("write_batches", S_IRUGO, root, &write_batches, &atomic_stat_fops) ||
+	    !debugfs_create_file("write_errors", S_IRUGO, root, &write_errors, &atomic_stat_fops) ||
+	    !debugfs_create_file("unwritten", S_IRUGO, root, &unwritten, &atomic_stat_fops) ||
+	    !debugfs_create_file("throttled", S_IRUGO, root, &throttled, &atomic_stat_fops) ||
+	    !debugfs_create_file("read_errors", S_IRUGO, root, &read_errors, &atomic_stat_fops))
+		pr_err("debugfs entry could not be set up\n");
+
+out:
+
+	return 0;
+
+out_rhashtable:
+
+	destroy_workqueue(spill_wq);
+
+out_wq:
+
+	kmem_cache_destroy(spill_entry_cache);
+
+out_cache:
+
+	kvfree(slots);
+	filp_close(spill_file, NULL);
+
+	return ret;
+}
+
+
+
+module_init(tmem_spill_init);
+MODULE_AUTHOR("Aimilios Tsalapatis");
+MODULE_LICENSE("GPL");
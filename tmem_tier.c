@@ -0,0 +1,959 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/kref.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+
+#include <tmem/tmem_ops.h>
+
+#include "tmem_pool.h"
+#include "tmem_backend.h"
+#include "tmem_trace.h"
+
+/*
+ * Stacks two backends that are already loaded: puts go to the fast tier,
+ * values that go cold there are demoted to the slow tier in the
+ * background once the fast tier holds more than fast_size bytes, and
+ * values that keep getting hit in the slow tier are promoted back. Only
+ * the index of which tier holds each key lives here, along with the
+ * pools, which the tiers see as one keyspace
+ */
+enum tmem_tier {
+	TMEM_TIER_FAST,
+	TMEM_TIER_SLOW,
+	TMEM_TIERS,
+};
+
+static const char * const tier_names[TMEM_TIERS] = { "fast", "slow" };
+
+static char *fast = "tmem_local";
+module_param(fast, charp, S_IRUGO);
+MODULE_PARM_DESC(fast, "Backend module holding the hot values");
+
+static char *slow = "tmem_kvm";
+module_param(slow, charp, S_IRUGO);
+MODULE_PARM_DESC(slow, "Backend module the cold values get demoted to");
+
+static unsigned long fast_size = 64 << 20;
+module_param(fast_size, ulong, 0644);
+MODULE_PARM_DESC(fast_size, "Bytes of values kept in the fast tier before demoting");
+
+static unsigned int promote_after = 2;
+module_param(promote_after, uint, 0644);
+MODULE_PARM_DESC(promote_after, "Hits in the slow tier that promote a value back");
+
+static struct tmem_ops *tiers[TMEM_TIERS];
+
+static struct workqueue_struct *tier_wq;
+static void tmem_tier_demote(struct work_struct *work);
+static DECLARE_WORK(demote_work, tmem_tier_demote);
+static void tmem_tier_reap(struct work_struct *work);
+static DECLARE_WORK(reap_work, tmem_tier_reap);
+/* Set when the fast tier refused a put before reaching fast_size */
+static bool fast_full;
+/* Only the demotion work uses it, and it never runs concurrently with itself */
+static void *demote_buffer;
+
+static atomic64_t gets;
+static atomic64_t hits[TMEM_TIERS];
+static atomic64_t stored_bytes[TMEM_TIERS];
+/* Keys in the index that their tier no longer had */
+static atomic64_t lost;
+static atomic64_t promotions;
+static atomic64_t demotions;
+
+struct tier_entry {
+	struct rhash_head hash_node;
+	struct rcu_head rcu;
+	struct kref refcount;
+	/* On the fast list while in the fast tier, under fast_lock */
+	struct list_head list;
+	/* On the reap list of its shard once invalidated */
+	struct list_head reap;
+	/*
+	 * Changed under the shard mutex; moves is bumped after every change of
+	 * tier, so that a get that raced with one knows to try again
+	 */
+	enum tmem_tier tier;
+	unsigned int moves;
+	bool dead;
+	u8 referenced;
+	atomic_t slow_hits;
+	size_t value_len;
+	int pool_id;
+	/* The key as the tiers see it, prefixed with its pool id */
+	void *key;
+	size_t key_len;
+	u8 inline_key[sizeof(u32) + TMEM_INLINE_KEY_LEN];
+};
+
+/* The key as the frontend gave it */
+static const void *tier_entry_key(const struct tier_entry *entry)
+{
+	return entry->key + sizeof(u32);
+}
+
+static size_t tier_entry_key_len(const struct tier_entry *entry)
+{
+	return entry->key_len - sizeof(u32);
+}
+
+static struct kmem_cache *tier_entry_cache;
+
+/* Entries of the fast tier, in CLOCK order for demotion */
+static DEFINE_SPINLOCK(fast_lock);
+static LIST_HEAD(fast_list);
+
+/* Keys are variable length and per pool, so lookups go through this instead of a raw pointer */
+struct tier_key {
+	int pool_id;
+	const void *key;
+	size_t key_len;
+};
+
+static u32 tier_key_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct tier_key *tier_key = data;
+
+	return jhash(tier_key->key, tier_key->key_len, jhash_1word(tier_key->pool_id, seed));
+}
+
+static u32 tier_obj_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct tier_entry *entry = data;
+
+	return jhash(tier_entry_key(entry), tier_entry_key_len(entry),
+			jhash_1word(entry->pool_id, seed));
+}
+
+static int tier_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)
+{
+	const struct tier_key *tier_key = arg->key;
+	const struct tier_entry *entry = obj;
+
+	if (entry->pool_id != tier_key->pool_id ||
+	    tier_entry_key_len(entry) != tier_key->key_len)
+		return 1;
+
+	return memcmp(tier_entry_key(entry), tier_key->key, tier_key->key_len);
+}
+
+static const struct rhashtable_params used_pages_params = {
+	.head_offset = offsetof(struct tier_entry, hash_node),
+	.hashfn = tier_key_hashfn,
+	.obj_hashfn = tier_obj_hashfn,
+	.obj_cmpfn = tier_obj_cmpfn,
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable used_pages;
+
+/*
+ * Gets only need RCU. The index changes under the spinlock of the key's
+ * shard, so that invalidates can come from atomic context, and whatever
+ * calls into the tiers holds the mutex too, since the backends may sleep
+ */
+struct tier_shard {
+	spinlock_t lock;
+	struct mutex mutex;
+	/* Entries out of the index whose values the tiers still hold */
+	struct list_head reap;
+} ____cacheline_aligned_in_smp;
+
+static struct tier_shard used_locks[TMEM_LOCK_SHARDS];
+
+/* The pools handed out, the default one always among them */
+static DEFINE_MUTEX(pools_lock);
+static DECLARE_BITMAP(pool_ids, TMEM_MAX_POOLS);
+
+/* Pool ids come from the frontends, so they are checked on every call */
+static bool tmem_tier_pool_valid(int pool_id)
+{
+	return pool_id >= 0 && pool_id < TMEM_MAX_POOLS;
+}
+
+static struct tier_shard *tmem_key_shard(int pool_id, const void *key, size_t key_len)
+{
+	u32 hash = jhash(key, key_len, pool_id);
+
+	return &used_locks[hash_32(hash, TMEM_LOCK_SHARDS_SHIFT)];
+}
+
+static struct tier_shard *tier_entry_shard(const struct tier_entry *entry)
+{
+	return tmem_key_shard(entry->pool_id, tier_entry_key(entry), tier_entry_key_len(entry));
+}
+
+static struct tier_entry *tier_entry_alloc(int pool_id, void *key, size_t key_len)
+{
+	struct tier_entry *entry;
+	u32 prefix = pool_id;
+
+	entry = kmem_cache_zalloc(tier_entry_cache, GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	if (key_len <= TMEM_INLINE_KEY_LEN) {
+		entry->key = entry->inline_key;
+	} else {
+		entry->key = kmalloc(sizeof(prefix) + key_len, GFP_NOIO);
+		if (!entry->key) {
+			kmem_cache_free(tier_entry_cache, entry);
+			return NULL;
+		}
+	}
+
+	memcpy(entry->key, &prefix, sizeof(prefix));
+	memcpy(entry->key + sizeof(prefix), key, key_len);
+	entry->key_len = sizeof(prefix) + key_len;
+	entry->pool_id = pool_id;
+	INIT_LIST_HEAD(&entry->list);
+	kref_init(&entry->refcount);
+
+	return entry;
+}
+
+static void tier_entry_free(struct tier_entry *entry)
+{
+	if (entry->key != entry->inline_key)
+		kfree(entry->key);
+
+	kmem_cache_free(tier_entry_cache, entry);
+}
+
+static void tier_entry_free_rcu(struct rcu_head *rcu)
+{
+	tier_entry_free(container_of(rcu, struct tier_entry, rcu));
+}
+
+static void tier_entry_release(struct kref *kref)
+{
+	struct tier_entry *entry = container_of(kref, struct tier_entry, refcount);
+
+	call_rcu(&entry->rcu, tier_entry_free_rcu);
+}
+
+/* Moves an entry between tiers, with the shard mutex held */
+static void tier_entry_set_tier(struct tier_entry *entry, enum tmem_tier tier)
+{
+	if (entry->tier == tier)
+		return;
+
+	WRITE_ONCE(entry->tier, tier);
+	/* Pairs with the barriers in get: a new moves means the new tier is visible */
+	smp_wmb();
+	WRITE_ONCE(entry->moves, entry->moves + 1);
+
+	spin_lock(&fast_lock);
+	if (tier == TMEM_TIER_FAST)
+		list_add_tail(&entry->list, &fast_list);
+	else
+		list_del_init(&entry->list);
+	spin_unlock(&fast_lock);
+}
+
+/* Takes an entry out of the index, with the shard lock held; false if it already was */
+static bool tier_entry_unhash(struct tier_entry *entry)
+{
+	if (rhashtable_remove_fast(&used_pages, &entry->hash_node, used_pages_params))
+		return false;
+
+	WRITE_ONCE(entry->dead, true);
+
+	return true;
+}
+
+/*
+ * Drops an entry that left the index, with the shard mutex held. Its
+ * value leaves its tier too, unless a newer put of the key has already
+ * overwritten it there
+ */
+static void tier_entry_reap(struct tier_entry *entry)
+{
+	struct tier_entry *newer;
+	struct tier_key tier_key = {
+		.pool_id = entry->pool_id,
+		.key = tier_entry_key(entry),
+		.key_len = tier_entry_key_len(entry),
+	};
+	bool overwritten;
+
+	spin_lock(&fast_lock);
+	list_del_init(&entry->list);
+	spin_unlock(&fast_lock);
+
+	atomic64_sub(entry->value_len, &stored_bytes[entry->tier]);
+
+	/* Tiers only change under the mutex we hold */
+	rcu_read_lock();
+	newer = rhashtable_lookup(&used_pages, &tier_key, used_pages_params);
+	overwritten = newer && newer->tier == entry->tier;
+	rcu_read_unlock();
+
+	if (!overwritten)
+		tiers[entry->tier]->invalidate(entry->key, entry->key_len);
+
+	kref_put(&entry->refcount, tier_entry_release);
+}
+
+/* Same as invalidating it, for callers that already hold the shard mutex */
+static void tier_entry_remove(struct tier_shard *shard, struct tier_entry *entry)
+{
+	bool unhashed;
+
+	spin_lock(&shard->lock);
+	unhashed = tier_entry_unhash(entry);
+	spin_unlock(&shard->lock);
+
+	if (unhashed)
+		tier_entry_reap(entry);
+}
+
+static void tmem_tier_reap_shard(struct tier_shard *shard)
+{
+	struct tier_entry *entry, *next;
+	LIST_HEAD(reap);
+
+	mutex_lock(&shard->mutex);
+
+	spin_lock(&shard->lock);
+	list_splice_init(&shard->reap, &reap);
+	spin_unlock(&shard->lock);
+
+	list_for_each_entry_safe(entry, next, &reap, reap)
+		tier_entry_reap(entry);
+
+	mutex_unlock(&shard->mutex);
+}
+
+/* Does the tier invalidates that invalidating a key from atomic context had to put off */
+static void tmem_tier_reap(struct work_struct *work)
+{
+	int i;
+
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++) {
+		if (list_empty_careful(&used_locks[i].reap))
+			continue;
+
+		tmem_tier_reap_shard(&used_locks[i]);
+		cond_resched();
+	}
+}
+
+static bool tmem_tier_over_limit(void)
+{
+	return atomic64_read(&stored_bytes[TMEM_TIER_FAST]) > READ_ONCE(fast_size);
+}
+
+/*
+ * Puts always go to the fast tier, unless it is full; the value then
+ * leaves the tier it used to be in, if that was the other one
+ */
+static int __tmem_tier_pool_put_page(int pool_id, void *key, size_t key_len, 
+		void *value, size_t value_len)
+{
+	struct tier_entry *entry;
+	struct tier_key tier_key = {
+		.pool_id = pool_id,
+		.key = key,
+		.key_len = key_len,
+	};
+	enum tmem_tier tier = TMEM_TIER_FAST;
+	struct tier_shard *shard;
+	bool new = false;
+	int ret;
+
+	pr_debug("entering put_page\n");
+
+	if (!tmem_tier_pool_valid(pool_id))
+		return -EINVAL;
+
+	shard = tmem_key_shard(pool_id, key, key_len);
+	mutex_lock(&shard->mutex);
+
+	/* Pools are destroyed only once every shard saw them go */
+	if (!test_bit(pool_id, pool_ids)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Only puts add to the index, and they hold the mutex */
+	entry = rhashtable_lookup_fast(&used_pages, &tier_key, used_pages_params);
+	if (!entry) {
+		entry = tier_entry_alloc(pool_id, key, key_len);
+		if (!entry) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		/* Gets cannot find it until it is in its tier */
+		new = true;
+	}
+
+	ret = tiers[TMEM_TIER_FAST]->put(entry->key, entry->key_len, value, value_len);
+	if (ret) {
+		WRITE_ONCE(fast_full, true);
+		queue_work(tier_wq, &demote_work);
+
+		tier = TMEM_TIER_SLOW;
+		ret = tiers[TMEM_TIER_SLOW]->put(entry->key, entry->key_len, value, value_len);
+	}
+
+	if (ret) {
+		/* Neither tier took it, and the old value must not be found anymore */
+		if (new)
+			tier_entry_free(entry);
+		else
+			tier_entry_remove(shard, entry);
+		pr_debug("leaving put_page - no tier took the page\n");
+		goto out;
+	}
+
+	if (new) {
+		entry->tier = tier;
+		entry->value_len = value_len;
+
+		spin_lock(&shard->lock);
+		ret = rhashtable_insert_fast(&used_pages, &entry->hash_node,
+				used_pages_params);
+		spin_unlock(&shard->lock);
+		if (ret) {
+			pr_err("leaving put_page - could not add the page\n");
+			tiers[tier]->invalidate(entry->key, entry->key_len);
+			tier_entry_free(entry);
+			goto out;
+		}
+
+		if (tier == TMEM_TIER_FAST) {
+			spin_lock(&fast_lock);
+			list_add_tail(&entry->list, &fast_list);
+			spin_unlock(&fast_lock);
+		}
+	} else {
+		atomic64_sub(entry->value_len, &stored_bytes[entry->tier]);
+		entry->value_len = value_len;
+
+		if (entry->tier != tier) {
+			enum tmem_tier old_tier = entry->tier;
+
+			tier_entry_set_tier(entry, tier);
+			tiers[old_tier]->invalidate(entry->key, entry->key_len);
+		}
+	}
+
+	atomic_set(&entry->slow_hits, 0);
+	atomic64_add(value_len, &stored_bytes[tier]);
+
+	pr_debug("leaving put_page\n");
+
+out:
+
+	mutex_unlock(&shard->mutex);
+
+	if (tmem_tier_over_limit())
+		queue_work(tier_wq, &demote_work);
+
+	return ret;
+}
+
+/* Done from the get that hit, with the value it read; skipped if the key is busy */
+static void tmem_tier_promote(struct tier_entry *entry, unsigned int moves, void *value, size_t value_len)
+{
+	struct tier_shard *shard = tier_entry_shard(entry);
+
+	if (!mutex_trylock(&shard->mutex))
+		return;
+
+	if (entry->dead || entry->moves != moves || entry->tier != TMEM_TIER_SLOW)
+		goto out;
+
+	if (tiers[TMEM_TIER_FAST]->put(entry->key, entry->key_len, value, value_len))
+		goto out;
+
+	/* A full round of the CLOCK before it can be demoted again */
+	WRITE_ONCE(entry->referenced, 1);
+	tier_entry_set_tier(entry, TMEM_TIER_FAST);
+	atomic64_sub(entry->value_len, &stored_bytes[TMEM_TIER_SLOW]);
+	atomic64_add(entry->value_len, &stored_bytes[TMEM_TIER_FAST]);
+	tiers[TMEM_TIER_SLOW]->invalidate(entry->key, entry->key_len);
+
+	atomic64_inc(&promotions);
+
+out:
+
+	mutex_unlock(&shard->mutex);
+
+	if (tmem_tier_over_limit())
+		queue_work(tier_wq, &demote_work);
+}
+
+static int __tmem_tier_pool_get_page(int pool_id, void *key, size_t key_len, 
+		void *value, size_t *value_len)
+{
+	struct tier_entry *entry;
+	struct tier_key tier_key = {
+		.pool_id = pool_id,
+		.key = key,
+		.key_len = key_len,
+	};
+	enum tmem_tier tier;
+	unsigned int moves;
+	int ret;
+
+	pr_debug("entering get_page\n");
+
+	atomic64_inc(&gets);
+
+again:
+
+	rcu_read_lock();
+	entry = rhashtable_lookup(&used_pages, &tier_key, used_pages_params);
+	if (!entry || !kref_get_unless_zero(&entry->refcount)) {
+		rcu_read_unlock();
+		*value_len = 0;
+		pr_debug("leaving get_page - key not present\n");
+		return -EINVAL;
+	}
+	rcu_read_unlock();
+
+	moves = READ_ONCE(entry->moves);
+	smp_rmb();
+	tier = READ_ONCE(entry->tier);
+
+	ret = tiers[tier]->get(entry->key, entry->key_len, value, value_len);
+
+	/* The value left that tier while we were looking for it there */
+	smp_rmb();
+	if (ret && !READ_ONCE(entry->dead) && READ_ONCE(entry->moves) != moves) {
+		kref_put(&entry->refcount, tier_entry_release);
+		goto again;
+	}
+
+	if (ret) {
+		atomic64_inc(&lost);
+		*value_len = 0;
+	} else if (tier == TMEM_TIER_FAST) {
+		atomic64_inc(&hits[TMEM_TIER_FAST]);
+		if (!READ_ONCE(entry->referenced))
+			WRITE_ONCE(entry->referenced, 1);
+	} else {
+		atomic64_inc(&hits[TMEM_TIER_SLOW]);
+		if (atomic_inc_return(&entry->slow_hits) >= READ_ONCE(promote_after))
+			tmem_tier_promote(entry, moves, value, *value_len);
+	}
+
+	kref_put(&entry->refcount, tier_entry_release);
+
+	pr_debug("leaving get_page\n");
+
+	return ret;
+}
+
+static void __tmem_tier_pool_invalidate_page(int pool_id, void *key, size_t key_len)
+{
+	struct tier_entry *entry;
+	struct tier_key tier_key = {
+		.pool_id = pool_id,
+		.key = key,
+		.key_len = key_len,
+	};
+	struct tier_shard *shard;
+	bool reap = false;
+
+	pr_debug("entering invalidate_page\n");
+
+	/*
+	 * Frontswap invalidates with preemption disabled, so the key only
+	 * leaves the index here and the tiers hear of it from the reap work
+	 */
+	shard = tmem_key_shard(pool_id, key, key_len);
+	spin_lock(&shard->lock);
+	entry = rhashtable_lookup_fast(&used_pages, &tier_key, used_pages_params);
+	if (entry && tier_entry_unhash(entry)) {
+		list_add_tail(&entry->reap, &shard->reap);
+		reap = true;
+	}
+	spin_unlock(&shard->lock);
+
+	if (reap)
+		queue_work(tier_wq, &reap_work);
+
+	pr_debug("leaving invalidate_page\n");
+}
+
+/* Keys go one by one, so that the tiers keep whatever else they hold */
+void tmem_tier_pool_invalidate_area(int pool_id)
+{
+	struct tier_entry *entry;
+	struct rhashtable_iter iter;
+	struct tier_shard *shard;
+	int i;
+
+	pr_debug("entering invalidate_area\n");
+	trace_tmem_invalidate_area(KBUILD_MODNAME, pool_id);
+
+	rhashtable_walk_enter(&used_pages, &iter);
+	rhashtable_walk_start(&iter);
+
+	while ((entry = rhashtable_walk_next(&iter)) != NULL) {
+		/* The table got resized under us, keep going from where we are */
+		if (IS_ERR(entry)) {
+			if (PTR_ERR(entry) == -EAGAIN)
+				continue;
+			break;
+		}
+
+		if (entry->pool_id != pool_id || !kref_get_unless_zero(&entry->refcount))
+			continue;
+
+		/* The backends may sleep, so the walk cannot stay in an RCU section */
+		rhashtable_walk_stop(&iter);
+
+		shard = tier_entry_shard(entry);
+		mutex_lock(&shard->mutex);
+		tier_entry_remove(shard, entry);
+		mutex_unlock(&shard->mutex);
+
+		kref_put(&entry->refcount, tier_entry_release);
+
+		rhashtable_walk_start(&iter);
+	}
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+
+	/* Keys invalidated before the walk may still be in their tiers */
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++)
+		tmem_tier_reap_shard(&used_locks[i]);
+
+	pr_debug("leaving invalidate_area\n");
+}
+
+/* Picks the next entry of the fast tier in CLOCK order, with a reference */
+#define TMEM_TIER_SCAN (1024)
+
+static struct tier_entry *tmem_tier_demote_victim(void)
+{
+	struct tier_entry *entry;
+	int scanned = 0;
+
+	spin_lock(&fast_lock);
+	while (!list_empty(&fast_list) && scanned++ < TMEM_TIER_SCAN) {
+		entry = list_first_entry(&fast_list, struct tier_entry, list);
+		list_move_tail(&entry->list, &fast_list);
+
+		if (READ_ONCE(entry->referenced)) {
+			WRITE_ONCE(entry->referenced, 0);
+			continue;
+		}
+
+		/* Entries leave the list before their last reference goes */
+		kref_get(&entry->refcount);
+		spin_unlock(&fast_lock);
+
+		return entry;
+	}
+	spin_unlock(&fast_lock);
+
+	return NULL;
+}
+
+/* Returns false once the slow tier takes no more, so that demotion stops for now */
+static bool tmem_tier_demote_one(struct tier_entry *entry)
+{
+	struct tier_shard *shard = tier_entry_shard(entry);
+	size_t value_len;
+	bool progress = true;
+
+	mutex_lock(&shard->mutex);
+
+	if (entry->dead || entry->tier != TMEM_TIER_FAST)
+		goto out;
+
+	/* The fast tier may have dropped it on its own */
+	if (tiers[TMEM_TIER_FAST]->get(entry->key, entry->key_len, demote_buffer, &value_len)) {
+		atomic64_inc(&lost);
+		tier_entry_remove(shard, entry);
+		goto out;
+	}
+
+	if (tiers[TMEM_TIER_SLOW]->put(entry->key, entry->key_len, demote_buffer, value_len)) {
+		progress = false;
+		goto out;
+	}
+
+	tier_entry_set_tier(entry, TMEM_TIER_SLOW);
+	atomic_set(&entry->slow_hits, 0);
+	atomic64_sub(entry->value_len, &stored_bytes[TMEM_TIER_FAST]);
+	atomic64_add(entry->value_len, &stored_bytes[TMEM_TIER_SLOW]);
+	tiers[TMEM_TIER_FAST]->invalidate(entry->key, entry->key_len);
+
+	atomic64_inc(&demotions);
+
+out:
+
+	mutex_unlock(&shard->mutex);
+
+	return progress;
+}
+
+/* Demoted even under fast_size once the fast tier fills up on its own */
+#define TMEM_TIER_DEMOTE_BATCH (32)
+
+static void tmem_tier_demote(struct work_struct *work)
+{
+	struct tier_entry *entry;
+	int budget = xchg(&fast_full, false) ? TMEM_TIER_DEMOTE_BATCH : 0;
+	bool progress;
+
+	while (tmem_tier_over_limit() || budget-- > 0) {
+		entry = tmem_tier_demote_victim();
+		if (!entry)
+			break;
+
+		progress = tmem_tier_demote_one(entry);
+		kref_put(&entry->refcount, tier_entry_release);
+
+		if (!progress)
+			break;
+
+		cond_resched();
+	}
+}
+
+TMEM_DEFINE_TRACED_POOL_OPS(tmem_tier)
+
+/* Limits and eviction are up to the tiers, which hold every pool in one keyspace */
+int tmem_tier_pool_create(u64 limit, u32 flags)
+{
+	int pool_id;
+
+	mutex_lock(&pools_lock);
+	pool_id = find_next_zero_bit(pool_ids, TMEM_MAX_POOLS, TMEM_POOL_DEFAULT + 1);
+	if (pool_id == TMEM_MAX_POOLS) {
+		mutex_unlock(&pools_lock);
+		pr_err("no pool ids left\n");
+		return -ENOSPC;
+	}
+
+	set_bit(pool_id, pool_ids);
+	mutex_unlock(&pools_lock);
+
+	pr_debug("created pool %d\n", pool_id);
+
+	return pool_id;
+}
+
+void tmem_tier_pool_destroy(int pool_id)
+{
+	int i;
+
+	if (!tmem_tier_pool_valid(pool_id))
+		return;
+
+	/* The default pool is what the plain tmem_ops use, so only flush it */
+	if (pool_id == TMEM_POOL_DEFAULT) {
+		tmem_tier_pool_invalidate_area(pool_id);
+		return;
+	}
+
+	/* The id cannot be handed out again before the flush is done */
+	mutex_lock(&pools_lock);
+	if (!test_and_clear_bit(pool_id, pool_ids)) {
+		mutex_unlock(&pools_lock);
+		return;
+	}
+
+	/* Wait for the puts that found the pool before it was removed */
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++) {
+		mutex_lock(&used_locks[i].mutex);
+		mutex_unlock(&used_locks[i].mutex);
+	}
+
+	tmem_tier_pool_invalidate_area(pool_id);
+	mutex_unlock(&pools_lock);
+
+	pr_debug("destroyed pool %d\n", pool_id);
+}
+
+/* The plain tmem_ops act on the default pool */
+int tmem_tier_put_page(void *key, size_t key_len, void *value, size_t value_len)
+{
+	return tmem_tier_pool_put_page(TMEM_POOL_DEFAULT, key, key_len, value, value_len);
+}
+
+int tmem_tier_get_page(void *key, size_t key_len, void *value, size_t *value_len)
+{
+	return tmem_tier_pool_get_page(TMEM_POOL_DEFAULT, key, key_len, value, value_len);
+}
+
+void tmem_tier_invalidate_page(void *key, size_t key_len)
+{
+	tmem_tier_pool_invalidate_page(TMEM_POOL_DEFAULT, key, key_len);
+}
+
+void tmem_tier_invalidate_area(void)
+{
+	tmem_tier_pool_invalidate_area(TMEM_POOL_DEFAULT);
+}
+
+struct tmem_pool_ops tmem_tier_pool_ops = {
+	.create = tmem_tier_pool_create,
+	.destroy = tmem_tier_pool_destroy,
+	.get = tmem_tier_pool_get_page,
+	.put = tmem_tier_pool_put_page,
+	.invalidate = tmem_tier_pool_invalidate_page,
+	.invalidate_all = tmem_tier_pool_invalidate_area,
+};
+
+struct tmem_ops tmem_tier_ops = {
+	.get = tmem_tier_get_page,
+	.put = tmem_tier_put_page,
+	.invalidate = tmem_tier_invalidate_page,
+	.invalidate_all = tmem_tier_invalidate_area,
+};
+
+static int atomic_stat_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *) data);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(atomic_stat_fops, atomic_stat_get, NULL, "%llu\n");
+
+/* Percentage of all gets served by the tier whose hit counter this is */
+static int hit_rate_get(void *data, u64 *val)
+{
+	u64 total = atomic64_read(&gets);
+
+	*val = total ? div64_u64(atomic64_read((atomic64_t *) data) * 100, total) : 0;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(hit_rate_fops, hit_rate_get, NULL, "%llu\n");
+
+static int __init tmem_tier_init(void)
+{
+	struct dentry *root, *dir;
+	int ret, i;
+
+	tiers[TMEM_TIER_FAST] = tmem_tier_lookup_ops(fast);
+	tiers[TMEM_TIER_SLOW] = tmem_tier_lookup_ops(slow);
+
+	for (i = 0; i < TMEM_TIERS; i++) {
+		if (!tiers[i]) {
+			pr_err("%s tier backend %s is not loaded\n", tier_names[i],
+					i == TMEM_TIER_FAST ? fast : slow);
+			return -ENODEV;
+		}
+	}
+
+	if (tiers[TMEM_TIER_FAST] == tiers[TMEM_TIER_SLOW]) {
+		pr_err("both tiers are %s\n", fast);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < TMEM_LOCK_SHARDS; i++) {
+		spin_lock_init(&used_locks[i].lock);
+		mutex_init(&used_locks[i].mutex);
+		INIT_LIST_HEAD(&used_locks[i].reap);
+	}
+
+	demote_buffer = kmalloc(TMEM_MAX, GFP_KERNEL);
+	if (!demote_buffer)
+		return -ENOMEM;
+
+	tier_entry_cache = kmem_cache_create("tmem_tier_entry",
+			sizeof(struct tier_entry), 0, 0, NULL);
+	if (!tier_entry_cache) {
+		ret = -ENOMEM;
+		goto out_cache;
+	}
+
+	/* Demotion is what makes room in the fast tier under swap, so it must make progress */
+	tier_wq = alloc_workqueue("tmem_tier", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!tier_wq) {
+		ret = -ENOMEM;
+		goto out_wq;
+	}
+
+	ret = rhashtable_init(&used_pages, &used_pages_params);
+	if (ret)
+		goto out_rhashtable;
+
+	set_bit(TMEM_POOL_DEFAULT, pool_ids);
+
+	/*
+	 * What frontends hold in the tiers cannot be found through the index,
+	 * so they must not hold anything yet; the tiers keep their own pools
+	 * to themselves, the index has one for every pool handed out here
+	 */
+	ret = replace_tmem_backend(&tmem_tier_ops, &tmem_tier_pool_ops);
+	if (ret) {
+		pr_err("frontends hold values in the registered backend, load tmem_tier before them\n");
+		goto out_register;
+	}
+
+	pr_info("stacking %s over %s\n", fast, slow);
+
+	root = debugfs_create_dir("tmem_tier", NULL);
+	if (IS_ERR_OR_NULL(root)) {
+		pr_err("debugfs directory could not be set up\n");
+		goto out;
+	}
+
+	if (!debugfs_create_file("gets", S_IRUGO, root, &gets, &atomic_stat_fops) ||
+	    !debugfs_create_file("lost", S_IRUGO, root, &lost, &atomic_stat_fops) ||
+	    !debugfs_create_file("promotions", S_IRUGO, root, &promotions, &atomic_stat_fops) ||
+	    !debugfs_create_file("demotions", S_IRUGO, root, &demotions, &atomic_stat_fops))
+		pr_err("debugfs entry could not be set up\n");
+
+	for (i = 0; i < TMEM_TIERS; i++) {
+		dir = debugfs_create_dir(tier_names[i], root);
+		if (IS_ERR_OR_NULL(dir) ||
+		    !debugfs_create_file("hits", S_IRUGO, dir, &hits[i], &atomic_stat_fops) ||
+		    !debugfs_create_file("hit_rate", S_IRUGO, dir, &hits[i], &hit_rate_fops) ||
+		    !debugfs_create_file("stored_bytes", S_IRUGO, dir, &stored_bytes[i], &atomic_stat_fops))
+			pr_err("debugfs entry could not be set up\n");
+	}
+
+out:
+
+	return 0;
+
+out_register:
+
+	rhashtable_destroy(&used_pages);
+
+out_rhashtable:
+
+	destroy_workqueue(tier_wq);
+
+out_wq:
+
+	kmem_cache_destroy(tier_entry_cache);
+
+out_cache:
+
+	kfree(demote_buffer);
+
+	return ret;
+}
+
+
+
+module_init(tmem_tier_init);
+MODULE_AUTHOR("Aimilios Tsalapatis");
+MODULE_LICENSE("GPL");
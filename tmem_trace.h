@@ -0,0 +1,93 @@
+/*
+ * Tracepoints for every tmem operation. They are created in tmem_pool,
+ * which every frontend and backend already depends on, and fired by each
+ * of them with its own name. Events carry a hash of the key, computed by
+ * the caller while the key is still its own, and only when they are on
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tmem
+
+#if !defined(_TMEM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TMEM_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/jhash.h>
+
+#define tmem_trace_key_hash(event, key, key_len) \
+	(trace_##event##_enabled() ? jhash(key, key_len, 0) : 0)
+
+DECLARE_EVENT_CLASS(tmem_op,
+
+	TP_PROTO(const char *name, int pool_id, u32 key_hash, size_t value_len, int ret),
+
+	TP_ARGS(name, pool_id, key_hash, value_len, ret),
+
+	TP_STRUCT__entry(
+		__string(	name,		name		)
+		__field(	int,		pool_id		)
+		__field(	u32,		key_hash	)
+		__field(	size_t,		value_len	)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->pool_id = pool_id;
+		__entry->key_hash = key_hash;
+		__entry->value_len = value_len;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%s pool=%d key=%08x len=%zu ret=%d", __get_str(name),
+		__entry->pool_id, __entry->key_hash, __entry->value_len, __entry->ret)
+);
+
+DEFINE_EVENT(tmem_op, tmem_put,
+
+	TP_PROTO(const char *name, int pool_id, u32 key_hash, size_t value_len, int ret),
+
+	TP_ARGS(name, pool_id, key_hash, value_len, ret)
+);
+
+/* The value length is only meaningful when ret is 0 */
+DEFINE_EVENT(tmem_op, tmem_get,
+
+	TP_PROTO(const char *name, int pool_id, u32 key_hash, size_t value_len, int ret),
+
+	TP_ARGS(name, pool_id, key_hash, value_len, ret)
+);
+
+DEFINE_EVENT(tmem_op, tmem_invalidate,
+
+	TP_PROTO(const char *name, int pool_id, u32 key_hash, size_t value_len, int ret),
+
+	TP_ARGS(name, pool_id, key_hash, value_len, ret)
+);
+
+TRACE_EVENT(tmem_invalidate_area,
+
+	TP_PROTO(const char *name, int pool_id),
+
+	TP_ARGS(name, pool_id),
+
+	TP_STRUCT__entry(
+		__string(	name,		name		)
+		__field(	int,		pool_id		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->pool_id = pool_id;
+	),
+
+	TP_printk("%s pool=%d", __get_str(name), __entry->pool_id)
+);
+
+#endif /* _TMEM_TRACE_H */
+
+/* Out of tree, so the header is found through the module's own directory */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tmem_trace
+#include <trace/define_trace.h>